@@ -0,0 +1,204 @@
+#include "checksum.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// This file contains the CRC-32C checksums of file ranges. The checksum is
+// computed with the SSE4.2 crc32 instruction when the CPU has it and with a
+// lookup table otherwise. Checksums are cached per (file version, range) so
+// that a range which was just sent doesn't have to be read again to be
+// checked.
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t* data, size_t len)
+{
+    pthread_once(&crc_table_once, build_crc_table);
+
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    // eight bytes per instruction, the data doesn't have to be aligned
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+
+    while (len > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+        data++;
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+
+// continues the CRC-32C of some data, starting from 0 for new data
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len)
+{
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+
+    return ~crc32c_table(crc, data, len);
+}
+
+
+struct checksum_cache* create_checksum_cache()
+{
+    struct checksum_cache* c = calloc(1, sizeof(*c));
+
+    pthread_mutex_init(&c->lock, NULL);
+
+    return c;
+}
+
+
+static struct checksum_entry* cache_slot(struct checksum_cache* c,
+    struct stat* st, uint64_t start_offset, uint64_t n_bytes)
+{
+    uint64_t hash = st->st_ino * 0x9e3779b97f4a7c15ULL;
+    hash ^= start_offset * 0xff51afd7ed558ccdULL;
+    hash ^= n_bytes * 0xc4ceb9fe1a85ec53ULL;
+
+    return &c->entries[(hash >> 32) % N_CHECKSUM_CACHE];
+}
+
+
+bool checksum_cache_get(struct checksum_cache* c, struct stat* st,
+    uint64_t start_offset, uint64_t n_bytes, uint32_t* crc)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&c->lock);
+
+    struct checksum_entry* e = cache_slot(c, st, start_offset, n_bytes);
+
+    // an entry of an older version of the file is never matched
+    if (e->in_use && e->dev == st->st_dev && e->ino == st->st_ino &&
+        e->file_size == st->st_size &&
+        e->mtime.tv_sec == st->st_mtim.tv_sec &&
+        e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        e->start_offset == start_offset && e->n_bytes == n_bytes)
+    {
+        *crc = e->crc;
+        found = true;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return found;
+}
+
+
+void checksum_cache_put(struct checksum_cache* c, struct stat* st,
+    uint64_t start_offset, uint64_t n_bytes, uint32_t crc)
+{
+    pthread_mutex_lock(&c->lock);
+
+    struct checksum_entry* e = cache_slot(c, st, start_offset, n_bytes);
+
+    e->in_use = true;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->file_size = st->st_size;
+    e->start_offset = start_offset;
+    e->n_bytes = n_bytes;
+    e->crc = crc;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+// returns the checksum of a range of an open file, reading the range on the
+// I/O queue of its device only if its checksum isn't cached. Returns -1 if
+// the range couldn't be read
+int checksum_file_range(struct checksum_cache* c, struct volume_set* vs,
+    int fd, struct stat* st, uint64_t start_offset, uint64_t n_bytes, 
+    uint32_t* crc)
+{
+    if (checksum_cache_get(c, st, start_offset, n_bytes, crc))
+    {
+        return 0;
+    }
+
+    size_t buf_len = n_bytes < CHECKSUM_READ_SZ ? n_bytes : CHECKSUM_READ_SZ;
+    uint8_t* buf = malloc(sizeof(*buf)*(buf_len > 0 ? buf_len : 1));
+    uint64_t n_read = 0;
+    uint32_t range_crc = 0;
+
+    while (n_read < n_bytes)
+    {
+        size_t len = n_bytes - n_read < buf_len ? n_bytes - n_read : buf_len;
+        ssize_t ret = volume_pread(vs, fd, st->st_dev, buf, len, 
+                                start_offset + n_read);
+
+        if (ret <= 0)
+        {
+            free(buf);
+            return -1;
+        }
+
+        range_crc = crc32c(range_crc, buf, ret);
+        n_read += ret;
+    }
+
+    free(buf);
+
+    checksum_cache_put(c, st, start_offset, n_bytes, range_crc);
+    *crc = range_crc;
+
+    return 0;
+}
+
+
+void free_checksum_cache(struct checksum_cache* c)
+{
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
@@ -0,0 +1,62 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "volume.h"
+
+
+// reflected CRC-32C (Castagnoli) polynomial
+#define CRC32C_POLY (0x82f63b78)
+
+#define N_CHECKSUM_CACHE (1024)
+
+// bytes read at a time when a range has to be read just for its checksum
+#define CHECKSUM_READ_SZ (1024*1024)
+
+#define CHECKSUM_SZ (4)
+
+
+// the checksum of a range of one version of a file
+struct checksum_entry {
+    bool in_use;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t file_size;
+    uint64_t start_offset;
+    uint64_t n_bytes;
+    uint32_t crc;
+};
+
+struct checksum_cache {
+    pthread_mutex_t lock;
+    struct checksum_entry entries[N_CHECKSUM_CACHE];
+};
+
+
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len);
+
+struct checksum_cache* create_checksum_cache();
+
+bool checksum_cache_get(struct checksum_cache* c, struct stat* st,
+    uint64_t start_offset, uint64_t n_bytes, uint32_t* crc);
+
+void checksum_cache_put(struct checksum_cache* c, struct stat* st,
+    uint64_t start_offset, uint64_t n_bytes, uint32_t crc);
+
+int checksum_file_range(struct checksum_cache* c, struct volume_set* vs,
+    int fd, struct stat* st, uint64_t start_offset, uint64_t n_bytes, 
+    uint32_t* crc);
+
+void free_checksum_cache(struct checksum_cache* c);
+
+#endif
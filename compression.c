@@ -3,288 +3,789 @@
 
 // This fil contains the functions necessary functions for
 // compressing and decompressing the payload.
+// The tables built from compression.dict are generated at build time by
+// gen_tables (see compression_tables.c), a dictionary is only read at runtime
+// when the server is told to use a different one.
+// The blocks of large framed payloads are coded by the threads of one codec
+// pool shared by every worker, alongside the worker that asked for them.
 
 
-struct compression_info* create_compression_info()
+static struct codec_pool codec_pool;
+
+
+// creates the compression info of the dictionary at dict_path, or of the
+// dictionary compiled into the binary when dict_path is NULL
+struct compression_info* create_compression_info(char* dict_path)
 {
-    struct compression_info* c_info = malloc(sizeof(*c_info));
+    struct compression_info* c_info = calloc(1, sizeof(*c_info));
 
-    create_bit_array(c_info);
-    set_bit_codes(c_info);
-    create_decompression_tree(c_info);
+    if (dict_path == NULL || load_dictionary(c_info, dict_path) < 0)
+    {
+        if (dict_path != NULL)
+        {
+            fprintf(stderr, "using the built in dictionary instead of %s\n",
+                    dict_path);
+        }
+
+        c_info->codes = static_codes;
+        c_info->tree = static_tree;
+        c_info->max_code_length = static_max_code_length;
+        c_info->min_code_length = static_min_code_length;
+        c_info->owns_tables = false;
+    }
+
+    c_info->dict_hash = dictionary_hash(c_info->codes);
 
     return c_info;
 }
 
-// stores the contents of the compression.dict file into memory
-void create_bit_array(struct compression_info* c_info)
+static void set_code_lengths(struct compression_info* c_info)
 {
-    char* file_name = "compression.dict";
-    FILE* f = fopen(file_name, "rb");
-
-    if (f == NULL)
-        perror("couldn't open compression.dict");
+    c_info->max_code_length = 0;
+    c_info->min_code_length = MAX_CODE_LENGTH;
 
-    
-    size_t array_cap = 50;
-    uint8_t* array = malloc(sizeof(*array)*array_cap);
-
-    int i = 0;
-    while (true)
+    for (size_t i = 0; i < N_SEGMENTS; i++)
     {
-        if (feof(f))
+        if (c_info->codes[i].length > c_info->max_code_length)
         {
-            break;
+            c_info->max_code_length = c_info->codes[i].length;
         }
 
-        if (i >= array_cap)
+        if (c_info->codes[i].length < c_info->min_code_length)
         {
-            array_cap += 20;
-            array = realloc(array, sizeof(*array)*array_cap);
+            c_info->min_code_length = c_info->codes[i].length;
         }
+    }
+}
+
+// builds the tables of a dictionary file, returns -1 if it can't be used
+int load_dictionary(struct compression_info* c_info, char* dict_path)
+{
+    size_t dict_len;
+    uint8_t* dict = read_dictionary_file(dict_path, &dict_len);
 
-        array[i] = fgetc(f);
+    if (dict == NULL)
+    {
+        return -1;
+    }
 
-        i += 1;
+    struct huffman_code* codes = malloc(sizeof(*codes)*N_SEGMENTS);
+    struct decode_node* tree = malloc(sizeof(*tree)*N_DECODE_NODES);
+
+    if (parse_dictionary(dict, dict_len, codes) < 0 ||
+        build_decode_tree(codes, tree) < 0)
+    {
+        fprintf(stderr, "%s is not a valid dictionary\n", dict_path);
 
+        free(dict);
+        free(codes);
+        free(tree);
+        return -1;
     }
 
-    fclose(f);
+    free(dict);
 
-    c_info->array_size = i;
-    c_info->bit_array = array;
+    c_info->codes = codes;
+    c_info->tree = tree;
+    c_info->owns_tables = true;
+    set_code_lengths(c_info);
+
+    return 0;
 }
 
-// Creates a dictionary which can be used to access the bitcodes for a 
-// specific bytes. The length of the bitcode and its offset in the bit 
-// array is stored in the bit_code struct
-void set_bit_codes(struct compression_info* c_info)
+// creates the compression info of codes built at runtime, taking ownership
+// of them. Returns NULL if they aren't a complete prefix code
+struct compression_info* compression_info_from_codes(
+    struct huffman_code* codes, uint32_t id)
 {
-    struct bit_code* codes = malloc(sizeof(*codes)*N_SEGMENTS);
-    uint8_t len_buffer;
+    struct decode_node* tree = malloc(sizeof(*tree)*N_DECODE_NODES);
 
-    size_t i = 0;
-    size_t j = 0;
-    size_t n_codes = 0;
+    if (build_decode_tree(codes, tree) < 0)
+    {
+        free(codes);
+        free(tree);
+        return NULL;
+    }
 
-    
-    while (n_codes < N_SEGMENTS)
+    struct compression_info* c_info = calloc(1, sizeof(*c_info));
+
+    c_info->codes = codes;
+    c_info->tree = tree;
+    c_info->owns_tables = true;
+    c_info->id = id;
+    c_info->dict_hash = dictionary_hash(codes);
+    set_code_lengths(c_info);
+
+    return c_info;
+}
+
+// returns the number of bits in a compressed stream of len bytes, the last
+// byte holds the number of padding bits at the end
+static uint64_t stream_bits(uint8_t* stream, uint64_t len)
+{
+    if (len > 1 && stream[len - 1] < 8)
     {
-        len_buffer = 0;
-        j = 0;
+        return (len - 1)*8 - stream[len - 1];
+    }
 
-        while (j < 8)
+    return 0;
+}
+
+// decodes n_bits into out and returns the number of bytes decoded, or -1 if
+// there are more than out_cap of them. Bits left over after the last whole
+// code are ignored
+static int64_t decode_bits(struct compression_info* c_info, uint8_t* bits,
+    uint64_t n_bits, uint8_t* out, uint64_t out_cap)
+{
+    uint64_t d_len = 0;
+    const struct decode_node* tree = c_info->tree;
+    int16_t node = 0;
+
+    for (uint64_t i = 0; i < n_bits; i++)
+    {
+        node = tree[node].next[TEST_BIT(bits, i) ? 1 : 0];
+
+        // reached a leaf
+        if (node < 0)
         {
-            if (TEST_BIT(c_info->bit_array, i))
+            if (d_len == out_cap)
             {
-                SET_BIT(len_buffer, j);
+                return -1;
             }
-            i++;
-            j++;
+
+            out[d_len] = -(node + 1);
+            d_len++;
+
+            node = 0;
         }
+    }
+
+    return d_len;
+}
+
+// decompresses the payloae and resets the payload appropiately 
+void decompress_payload(struct compression_info* c_info, uint8_t** payload,
+                        uint64_t* payload_len)
+{
+    uint64_t n_bits = stream_bits(*payload, *payload_len);
+
+    uint64_t decompressed_cap = n_bits / c_info->min_code_length + 1;
+    uint8_t* decompressed = alloc_buffer(sizeof(*decompressed)*
+                                        decompressed_cap);
 
-        codes[n_codes].length = len_buffer;
-        codes[n_codes].offset = i;
-        codes[n_codes].byte = n_codes;
+    int64_t d_len = decode_bits(c_info, *payload, n_bits, decompressed,
+                                decompressed_cap);
 
-        i = i + len_buffer;
-   
-        n_codes++;
+    free_buffer(*payload);
+    *payload = decompressed;
+    *payload_len = d_len;
+    
+}
+
+
+
+// writes the codes of len bytes into a zeroed bit array starting at bit_pos
+// and returns the bit position after the last code
+uint64_t encode_bytes(struct compression_info* c_info, uint8_t* data,
+    uint64_t len, uint8_t* bits, uint64_t bit_pos)
+{
+    const struct huffman_code* codes = c_info->codes;
+    uint8_t* out = bits + bit_pos / 8;
+
+    // bits not yet written out, the newest in the lowest bits
+    uint64_t acc = 0;
+    uint8_t acc_bits = bit_pos % 8;
+    uint64_t n_bits = bit_pos;
+
+    // picking up the bits already in a partly written byte
+    if (acc_bits > 0)
+    {
+        acc = *out >> (8 - acc_bits);
     }
 
-    c_info->bit_codes = codes;
+    for (uint64_t i = 0; i < len; i++)
+    {
+        const struct huffman_code* code = &codes[data[i]];
+
+        acc = (acc << code->length) | code->bits;
+        acc_bits += code->length;
+        n_bits += code->length;
+
+        while (acc_bits >= 8)
+        {
+            acc_bits -= 8;
+            *out = (uint8_t) (acc >> acc_bits);
+            out++;
+        }
+    }
+
+    if (acc_bits > 0)
+    {
+        *out = (uint8_t) (acc << (8 - acc_bits));
+    }
+
+    return n_bits;
 }
 
+// copies n_bits from the start of src into a zeroed bit array at dst_pos.
+// Bits of src past n_bits must be zero
+void copy_bits(uint8_t* dst, uint64_t dst_pos, uint8_t* src, uint64_t n_bits)
+{
+    uint64_t n_bytes = (n_bits + 7) / 8;
+    uint8_t shift = dst_pos % 8;
+    uint8_t* out = dst + dst_pos / 8;
+
+    if (shift == 0)
+    {
+        memcpy(out, src, n_bytes);
+        return;
+    }
+
+    // number of destination bytes the shifted bits touch
+    uint64_t n_out = (shift + n_bits + 7) / 8;
+
+    for (uint64_t i = 0; i < n_bytes; i++)
+    {
+        out[i] |= src[i] >> shift;
+
+        if (i + 1 < n_out)
+        {
+            out[i + 1] |= src[i] << (8 - shift);
+        }
+    }
+}
 
-void create_decompression_tree(struct compression_info* c_info)
+// returns the number of bytes needed to hold the compressed form of len bytes
+// including the trailing padding byte. Lengths too large to count saturate
+// at UINT64_MAX, which no memory budget can cover
+uint64_t compressed_bound(struct compression_info* c_info, uint64_t len)
 {
-    c_info->root = create_node();
+    if (len > (UINT64_MAX - 7) / c_info->max_code_length)
+    {
+        return UINT64_MAX;
+    }
 
-    for (size_t i = 0; i < N_SEGMENTS; i++)
+    return (len * c_info->max_code_length + 7) / 8 + 1;
+}
+
+// returns the most bytes len bytes of compressed data can decode to, framed
+// or not, saturating at UINT64_MAX
+uint64_t decompressed_bound(struct compression_info* c_info, uint64_t len)
+{
+    if (len > (UINT64_MAX - 1) / 8)
     {
-        add_node(c_info, &c_info->root, &c_info->bit_codes[i]);
+        return UINT64_MAX;
     }
+
+    return len * 8 / c_info->min_code_length + 1;
 }
 
+// appends the byte holding the padding count after n_bits of compressed data
+// and returns the length of the compressed payload
+uint64_t finish_compressed(uint8_t* bits, uint64_t n_bits)
+{
+    uint64_t len = (n_bits + 7) / 8;
+
+    // case when the compressed payload is already aligned with a byte boundary
+    if (n_bits % 8 == 0)
+    {
+        bits[len] = 0;
+    }
+    // case when the compressed payload is not aligned
+    else
+    {
+        bits[len] = 8 - (n_bits % 8);
+    }
+
+    return len + 1;
+}
 
-struct node* create_node()
+// encodes len more bytes onto the end of a compressed payload
+void append_compressed(struct compression_info* c_info, uint8_t** payload,
+    uint64_t* payload_len, uint8_t* data, uint64_t len)
 {
-    struct node* n = malloc(sizeof(*n));
-    n->right = NULL;
-    n->left = NULL;
-    n->is_leaf = false;
+    uint64_t n_bits = stream_bits(*payload, *payload_len);
+    uint64_t n_bytes = (n_bits + 7) / 8;
+    uint64_t cap = n_bytes + compressed_bound(c_info, len);
+
+    *payload = realloc_buffer(*payload, sizeof(**payload)*cap);
 
-    return n;
+    // the padding byte and everything after it gets written over
+    memset(*payload + n_bytes, 0, cap - n_bytes);
+
+    n_bits = encode_bytes(c_info, data, len, *payload, n_bits);
+    *payload_len = finish_compressed(*payload, n_bits);
 }
 
+void compress_payload(struct compression_info* c_info, uint8_t** payload, 
+    uint64_t* payload_len)
+{
+    uint64_t compressed_cap = compressed_bound(c_info, *payload_len);
+    uint8_t* compressed = alloc_buffer(sizeof(*compressed)*compressed_cap);
+
+    uint64_t n_bits = encode_bytes(c_info, *payload, *payload_len, 
+                                    compressed, 0);
+
+    *payload_len = finish_compressed(compressed, n_bits);
 
-// adds a new node in the tree based on the bits of an the bit code
-// adds nodes along the way to the left if 0 and right if 1
-void add_node(struct compression_info* c_info, struct node** root,
-             struct bit_code* code)
+    free_buffer(*payload);
+    *payload = compressed;
+
+}
+
+// one of the threads of the codec pool, coding the blocks of whichever
+// payload queued them
+static void* codec_thread(void* args)
 {
-    uint64_t index;
-    struct node* cursor = *root;
-    
-    for (size_t i = 0; i < code->length; i++)
+    struct codec_pool* cp = args;
+
+    while (true)
     {
-        index = code->offset + i;
+        pthread_mutex_lock(&cp->lock);
 
-        if (TEST_BIT(c_info->bit_array, index))
+        while (!cp->stop && cp->head == NULL)
         {
-            if (cursor->right == NULL)
-            {                
-                cursor->right = create_node();
-            }
-            
-            cursor = cursor->right;
-            continue;
-            
+            pthread_cond_wait(&cp->job_cond, &cp->lock);
         }
-        else 
+
+        if (cp->head == NULL)
         {
-            if (cursor->left == NULL)
-            {
-                cursor->left = create_node();
-            }
-            
-            cursor = cursor->left;
-            continue;
-            
+            pthread_mutex_unlock(&cp->lock);
+            break;
+        }
+
+        struct block_job* job = cp->head;
+        cp->head = job->next;
+
+        if (cp->head == NULL)
+        {
+            cp->tail = NULL;
         }
+
+        job->queued = false;
+        pthread_mutex_unlock(&cp->lock);
+
+        job->run(job);
+
+        pthread_mutex_lock(&cp->lock);
+        job->done = true;
+        pthread_cond_broadcast(&cp->done_cond);
+        pthread_mutex_unlock(&cp->lock);
     }
 
-    cursor->is_leaf = true;
-    cursor->byte = code->byte;
-    
+    return (void*) NULL;
 }
 
-// decompresses the payloae and resets the payload appropiately 
-void decompress_payload(struct compression_info* c_info, uint8_t** payload,
-                        uint64_t* payload_len)
+// starts the threads the blocks of large framed payloads are shared out to,
+// one fewer than there are processors as the worker coding a payload takes
+// a share of its blocks too
+void init_codec_pool(void)
 {
-    uint64_t decompressed_cap = (*payload_len)*4;
-    uint8_t* decompressed = malloc(sizeof(*decompressed)*decompressed_cap);
-    bzero(decompressed, decompressed_cap);
+    uint32_t n_threads = get_nprocs();
 
-    size_t d_len = 0;
-    uint8_t* bit_array = *payload;
-    struct node* cursor = c_info->root;
+    if (n_threads > MAX_CODEC_THREADS)
+    {
+        n_threads = MAX_CODEC_THREADS;
+    }
+
+    pthread_mutex_init(&codec_pool.lock, NULL);
+    pthread_cond_init(&codec_pool.job_cond, NULL);
+    pthread_cond_init(&codec_pool.done_cond, NULL);
 
-    for (size_t i = 0; i < (*payload_len-1)*8; i++)
+    for (uint32_t i = 0; i + 1 < n_threads; i++)
     {
+        if (pthread_create(&codec_pool.threads[codec_pool.n_threads], NULL,
+                codec_thread, (void*) &codec_pool) == 0)
+        {
+            codec_pool.n_threads++;
+        }
+    }
+}
+
+void free_codec_pool(void)
+{
+    pthread_mutex_lock(&codec_pool.lock);
+    codec_pool.stop = true;
+    pthread_cond_broadcast(&codec_pool.job_cond);
+    pthread_mutex_unlock(&codec_pool.lock);
+
+    for (uint32_t i = 0; i < codec_pool.n_threads; i++)
+    {
+        pthread_join(codec_pool.threads[i], NULL);
+    }
+
+    codec_pool.n_threads = 0;
+}
+
+// number of jobs the blocks of a framed payload of raw_len bytes are split
+// into, one for the calling thread and one for each thread of the pool
+static uint32_t codec_threads(uint64_t raw_len, uint32_t n_blocks)
+{
+    if (raw_len < PARALLEL_CODEC_THRESHOLD || n_blocks < 2)
+    {
+        return 1;
+    }
 
-        if (cursor->is_leaf)
+    uint32_t n_threads = codec_pool.n_threads + 1;
+
+    if (n_threads > n_blocks)
+    {
+        n_threads = n_blocks;
+    }
+
+    return n_threads;
+}
+
+// runs the job of every thread, the calling thread takes the first one and
+// queues the others on the pool. Jobs no thread of the pool has picked up
+// by the time the first one is done are taken back and run here, so a busy
+// pool never holds a payload up for longer than coding it alone would
+static void run_block_jobs(void* (*run)(void*), struct block_job* jobs,
+    uint32_t n_threads)
+{
+    struct codec_pool* cp = &codec_pool;
+
+    if (n_threads > 1)
+    {
+        pthread_mutex_lock(&cp->lock);
+
+        for (uint32_t i = 1; i < n_threads; i++)
         {
-            decompressed[d_len] = cursor->byte;
-            d_len++;
+            jobs[i].run = run;
+            jobs[i].queued = true;
+            jobs[i].done = false;
+            jobs[i].next = NULL;
+
+            if (cp->tail == NULL)
+            {
+                cp->head = &jobs[i];
+            }
+            else
+            {
+                cp->tail->next = &jobs[i];
+            }
 
-            cursor = c_info->root;
+            cp->tail = &jobs[i];
         }
 
-        if (TEST_BIT(bit_array, i))
+        pthread_cond_broadcast(&cp->job_cond);
+        pthread_mutex_unlock(&cp->lock);
+    }
+
+    run(&jobs[0]);
+
+    for (uint32_t i = 1; i < n_threads; i++)
+    {
+        pthread_mutex_lock(&cp->lock);
+
+        bool take_back = jobs[i].queued;
+
+        if (take_back)
         {
-            cursor = cursor->right;
+            // unlinking the job, the queue only ever holds a few of them
+            struct block_job* prev = NULL;
+            struct block_job* curr = cp->head;
+
+            while (curr != &jobs[i])
+            {
+                prev = curr;
+                curr = curr->next;
+            }
+
+            if (prev == NULL)
+            {
+                cp->head = curr->next;
+            }
+            else
+            {
+                prev->next = curr->next;
+            }
+
+            if (cp->tail == curr)
+            {
+                cp->tail = prev;
+            }
+
+            jobs[i].queued = false;
         }
-        else
+
+        pthread_mutex_unlock(&cp->lock);
+
+        if (take_back)
         {
-            cursor = cursor->left;
+            run(&jobs[i]);
+            jobs[i].done = true;
         }
-        
     }
 
-    free(*payload);
-    *payload = decompressed;
-    *payload_len = d_len;
-    
+    pthread_mutex_lock(&cp->lock);
+
+    for (uint32_t i = 1; i < n_threads; i++)
+    {
+        while (!jobs[i].done)
+        {
+            pthread_cond_wait(&cp->done_cond, &cp->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&cp->lock);
 }
 
+// splits the blocks of a frame between n_threads jobs
+static void split_blocks(struct block_job* jobs, struct block_job* job,
+    uint32_t n_threads)
+{
+    uint32_t per_thread = job->index->n_blocks / n_threads;
+    uint32_t extra = job->index->n_blocks % n_threads;
+    uint32_t first = 0;
 
+    for (uint32_t i = 0; i < n_threads; i++)
+    {
+        jobs[i] = *job;
+        jobs[i].first_block = first;
+        first += per_thread + (i < extra ? 1 : 0);
+        jobs[i].end_block = first;
+    }
+}
 
-void compress_payload(struct compression_info* c_info, uint8_t** payload, 
-    uint64_t* payload_len)
+// number of raw bytes in a block of the frame
+static uint64_t block_raw_len(struct frame_index* index, uint32_t block)
 {
-    uint64_t compressed_cap = (*payload_len)*4;
-    uint8_t* compressed = malloc(sizeof(*compressed)*compressed_cap);
-    bzero(compressed, compressed_cap);
-    
+    uint64_t start = (uint64_t) block * index->block_size;
+    uint64_t left = index->raw_len - start;
 
-    size_t len_index = 0;
-    size_t comp_index = 0;
-    size_t code_index = 0;
-    size_t ba_index = 0;
-    
-    struct bit_code* code;
-    
+    return left < index->block_size ? left : index->block_size;
+}
+
+static void* encode_blocks(void* args)
+{
+    struct block_job* job = args;
+    struct frame_index* index = job->index;
+    uint64_t scratch_cap = compressed_bound(job->c_info, index->block_size);
+    uint8_t* scratch = malloc(sizeof(*scratch)*scratch_cap);
 
-    for (size_t i = 0; i < *payload_len; i++)
+    for (uint32_t i = job->first_block; i < job->end_block; i++)
     {
-        len_index = 0;
-        code_index = (int) (*payload)[i];
-        code = &(c_info->bit_codes[code_index]);
+        uint64_t raw_len = block_raw_len(index, i);
 
-        while (len_index < code->length)
-        {
-            ba_index = len_index + code->offset;
-            if (TEST_BIT(c_info->bit_array, ba_index))
-            {
-                SET_BIT_BA(compressed, comp_index);
-            }
+        memset(scratch, 0, scratch_cap);
+        uint64_t n_bits = encode_bytes(job->c_info, 
+                job->raw + (uint64_t) i * index->block_size, raw_len, 
+                scratch, 0);
+        uint64_t len = finish_compressed(scratch, n_bits);
 
-            comp_index++;
-            len_index++;
-        }
+        job->encoded[i] = malloc(sizeof(uint8_t)*len);
+        memcpy(job->encoded[i], scratch, len);
+        index->offsets[i + 1] = len;
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+static void* decode_blocks(void* args)
+{
+    struct block_job* job = args;
+    struct frame_index* index = job->index;
 
+    for (uint32_t i = job->first_block; i < job->end_block; i++)
+    {
+        uint8_t* block = index->blocks + index->offsets[i];
+        uint64_t len = index->offsets[i + 1] - index->offsets[i];
+        uint64_t raw_len = block_raw_len(index, i);
+
+        // every block has to decode to exactly its share of the payload
+        if (block[len - 1] >= 8 ||
+            decode_bits(job->c_info, block, stream_bits(block, len), 
+                job->raw + (uint64_t) i * index->block_size, raw_len) 
+                != raw_len)
+        {
+            job->failed = true;
+            break;
+        }
     }
 
-    // case when the compressed payload is already aligned with a byte boundary
-    if (comp_index % 8 == 0)
+    return NULL;
+}
+
+// compresses the payload as a frame of independently encoded blocks. The
+// frame starts with the raw length, the block size and the number of blocks,
+// followed by the compressed length of every block and then the blocks,
+// each one a compressed stream with its own padding byte
+void compress_payload_framed(struct compression_info* c_info, 
+    uint8_t** payload, uint64_t* payload_len)
+{
+    struct frame_index index;
+    index.raw_len = *payload_len;
+    index.block_size = FRAME_BLOCK_SIZE;
+    index.n_blocks = (index.raw_len + FRAME_BLOCK_SIZE - 1) / FRAME_BLOCK_SIZE;
+    index.offsets = calloc(index.n_blocks + 1, sizeof(*index.offsets));
+
+    struct block_job job = {0};
+    job.c_info = c_info;
+    job.index = &index;
+    job.raw = *payload;
+    job.encoded = malloc(sizeof(*job.encoded)*(index.n_blocks + 1));
+
+    struct block_job jobs[MAX_CODEC_THREADS];
+    uint32_t n_threads = codec_threads(index.raw_len, index.n_blocks);
+
+    split_blocks(jobs, &job, n_threads);
+    run_block_jobs(encode_blocks, jobs, n_threads);
+
+    // the encoders leave the length of each block behind its offset
+    for (uint32_t i = 0; i < index.n_blocks; i++)
     {
-        *payload_len = comp_index/8;
-        compressed[*payload_len] = 0;
-        *payload_len = *payload_len + 1;  
+        index.offsets[i + 1] += index.offsets[i];
     }
-    // case when the compressed payload is not aligned
-    else
+
+    uint64_t header_len = FRAME_HEADER_SZ + 
+                        (uint64_t) index.n_blocks*FRAME_INDEX_ENTRY_SZ;
+    uint64_t framed_len = header_len + index.offsets[index.n_blocks];
+    uint8_t* framed = alloc_buffer(sizeof(*framed)*framed_len);
+
+    uint64_t be_raw_len = htobe64(index.raw_len);
+    uint32_t be_block_size = htobe32(index.block_size);
+    uint32_t be_n_blocks = htobe32(index.n_blocks);
+
+    memcpy(framed, &be_raw_len, 8);
+    memcpy(framed + 8, &be_block_size, 4);
+    memcpy(framed + 12, &be_n_blocks, 4);
+
+    for (uint32_t i = 0; i < index.n_blocks; i++)
     {
-        *payload_len = comp_index/8 + 1;
-        compressed[*payload_len] = 8 - (comp_index % 8);    
-        *payload_len = *payload_len + 1;
+        uint64_t len = index.offsets[i + 1] - index.offsets[i];
+        uint32_t be_len = htobe32(len);
+
+        memcpy(framed + FRAME_HEADER_SZ + i*FRAME_INDEX_ENTRY_SZ, &be_len, 4);
+        memcpy(framed + header_len + index.offsets[i], job.encoded[i], len);
+        free(job.encoded[i]);
     }
 
-    free(*payload);
-    *payload = compressed;
+    free(job.encoded);
+    free(index.offsets);
 
+    free_buffer(*payload);
+    *payload = framed;
+    *payload_len = framed_len;
 }
 
-// frees the decompression tree using a post order traversal
-void free_decompression_tree(struct node* n)
+// reads the header and block index of a frame, returns -1 if they don't
+// describe a frame that fits in framed_len bytes. The offsets have to be
+// freed by the caller on success
+static int parse_frame_index(struct compression_info* c_info, 
+    uint8_t* framed, uint64_t framed_len, struct frame_index* index)
 {
-    if (n->is_leaf)
+    uint64_t be_raw_len;
+    uint32_t be_block_size;
+    uint32_t be_n_blocks;
+
+    if (framed_len < FRAME_HEADER_SZ)
     {
-        free(n);
+        return -1;
     }
-    else
+
+    memcpy(&be_raw_len, framed, 8);
+    memcpy(&be_block_size, framed + 8, 4);
+    memcpy(&be_n_blocks, framed + 12, 4);
+
+    index->raw_len = be64toh(be_raw_len);
+    index->block_size = be32toh(be_block_size);
+    index->n_blocks = be32toh(be_n_blocks);
+
+    // no more bytes can come out than there are codes in the frame, which
+    // keeps a bogus raw length from allocating much more than was sent
+    if (index->block_size == 0 || index->block_size > MAX_FRAME_BLOCK_SIZE ||
+        index->raw_len > framed_len * 8 / c_info->min_code_length ||
+        index->n_blocks != index->raw_len / index->block_size + 
+            (index->raw_len % index->block_size != 0) ||
+        (framed_len - FRAME_HEADER_SZ) / FRAME_INDEX_ENTRY_SZ < 
+            index->n_blocks)
     {
-        if (n->left != NULL)
+        return -1;
+    }
+
+    uint64_t header_len = FRAME_HEADER_SZ + 
+                        (uint64_t) index->n_blocks*FRAME_INDEX_ENTRY_SZ;
+
+    index->blocks = framed + header_len;
+    index->offsets = malloc(sizeof(*index->offsets)*(index->n_blocks + 1));
+    index->offsets[0] = 0;
+
+    for (uint32_t i = 0; i < index->n_blocks; i++)
+    {
+        uint32_t be_len;
+        memcpy(&be_len, framed + FRAME_HEADER_SZ + i*FRAME_INDEX_ENTRY_SZ, 4);
+
+        uint32_t len = be32toh(be_len);
+        index->offsets[i + 1] = index->offsets[i] + len;
+
+        // every block holds at least its padding byte
+        if (len == 0 || index->offsets[i + 1] > framed_len - header_len)
         {
-            free_decompression_tree(n->left);
+            free(index->offsets);
+            return -1;
         }
-            
-        if (n->right != NULL)
+    }
+
+    if (index->offsets[index->n_blocks] != framed_len - header_len)
+    {
+        free(index->offsets);
+        return -1;
+    }
+
+    return 0;
+}
+
+// decompresses a framed payload, decoding the blocks of large payloads on
+// several threads. Returns -1 and leaves the payload as it is if the frame is
+// malformed
+int decompress_payload_framed(struct compression_info* c_info,
+    uint8_t** payload, uint64_t* payload_len)
+{
+    struct frame_index index;
+
+    if (parse_frame_index(c_info, *payload, *payload_len, &index) < 0)
+    {
+        return -1;
+    }
+
+    struct block_job job = {0};
+    job.c_info = c_info;
+    job.index = &index;
+    job.raw = alloc_buffer(sizeof(uint8_t)*index.raw_len);
+
+    struct block_job jobs[MAX_CODEC_THREADS];
+    uint32_t n_threads = codec_threads(index.raw_len, index.n_blocks);
+
+    split_blocks(jobs, &job, n_threads);
+    run_block_jobs(decode_blocks, jobs, n_threads);
+
+    free(index.offsets);
+
+    for (uint32_t i = 0; i < n_threads; i++)
+    {
+        if (jobs[i].failed)
         {
-            free_decompression_tree(n->right);
+            free_buffer(job.raw);
+            return -1;
         }
-        
-        free(n);
     }
-    
+
+    free_buffer(*payload);
+    *payload = job.raw;
+    *payload_len = index.raw_len;
+
+    return 0;
 }
 
 void free_compression_info(struct compression_info* c_info)
 {
-    free(c_info->bit_codes);
-    free(c_info->bit_array);
-    free_decompression_tree(c_info->root);
+    if (c_info->owns_tables)
+    {
+        free((void*) c_info->codes);
+        free((void*) c_info->tree);
+    }
+
     free(c_info);
 }
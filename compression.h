@@ -8,14 +8,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 
 
 
-#define N_SEGMENTS (256)
-
-
-#define SET_BIT_32(BF,N)   ((byte) |= (1<<(N)))
-#define IS_BIT_SET_32(BF,N) ((byte) & (1<<(N)))
+#include "dictionary.h"
+#include "hugepage.h"
 
 
 
@@ -32,52 +32,130 @@
 #define TEST_BIT(A,k) (A[(k/8)] & ((uint8_t)1 << (7-(k%8)) )) 
 #define SET_BIT_BA(A,k)( A[(k/8)] |= ((uint8_t)1 << (7-(k%8)) )) 
 
-struct bit_code {
-    uint8_t length;
-    size_t offset;
-    // uint32_t bits;
-    uint8_t byte;
+// framed payloads are made of blocks of this many raw bytes
+#define FRAME_BLOCK_SIZE (64*1024)
+
+// largest block size accepted in a frame sent by a client
+#define MAX_FRAME_BLOCK_SIZE (16*1024*1024)
+
+// raw length, block size and number of blocks at the start of a frame
+#define FRAME_HEADER_SZ (8 + 4 + 4)
+#define FRAME_INDEX_ENTRY_SZ (4)
+
+// framed payloads smaller than this are coded on the calling thread
+#define PARALLEL_CODEC_THRESHOLD (1024*1024)
+
+// threads a framed payload is coded with, the calling thread included
+#define MAX_CODEC_THREADS (8)
+
+
+struct compression_info
+{
+    const struct huffman_code* codes;
+    const struct decode_node* tree;
+    uint8_t max_code_length;
+    uint8_t min_code_length;
+    uint64_t dict_hash;
+
+    // version of the dictionary, 0 is the one the server started with.
+    // Trained versions are freed once retired and no longer referenced
+    uint32_t id;
+    uint32_t refcount;
+    bool retired;
+
+    // false when the tables are the ones compiled into the binary
+    bool owns_tables;
 };
 
-struct node {
-    bool is_leaf;
-    uint8_t byte;
-    struct node* right;
-    struct node* left;
-    
+
+// the blocks of a frame, offsets holds n_blocks + 1 offsets into blocks
+struct frame_index
+{
+    uint64_t raw_len;
+    uint32_t block_size;
+    uint32_t n_blocks;
+    uint8_t* blocks;
+    uint64_t* offsets;
 };
 
-struct compression_info
+// the blocks one thread encodes or decodes
+struct block_job
+{
+    struct compression_info* c_info;
+    struct frame_index* index;
+    uint8_t* raw;
+    uint8_t** encoded;
+    uint32_t first_block;
+    uint32_t end_block;
+    bool failed;
+
+    // set while the job waits on the codec pool
+    void* (*run)(void*);
+    bool queued;
+    bool done;
+    struct block_job* next;
+};
+
+// the threads shared by every worker that code the blocks of large framed
+// payloads
+struct codec_pool
 {
-    uint8_t* bit_array;
-    size_t array_size;
-    struct bit_code* bit_codes;
-    struct node* root;
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    struct block_job* head;
+    struct block_job* tail;
+    bool stop;
+
+    uint32_t n_threads;
+    pthread_t threads[MAX_CODEC_THREADS];
 };
 
 
+// tables of compression.dict, generated at build time by gen_tables
+extern const struct huffman_code static_codes[N_SEGMENTS];
+extern const struct decode_node static_tree[N_DECODE_NODES];
+extern const uint8_t static_max_code_length;
+extern const uint8_t static_min_code_length;
 
 
-struct compression_info* create_compression_info();
 
-void create_bit_array(struct compression_info* c_info);
+void init_codec_pool(void);
 
-void set_bit_codes(struct compression_info* c_info);
+void free_codec_pool(void);
 
-void create_decompression_tree(struct compression_info* c_info);
+struct compression_info* create_compression_info(char* dict_path);
 
-struct node* create_node();
+int load_dictionary(struct compression_info* c_info, char* dict_path);
 
-void add_node(struct compression_info* c_info, struct node** root,
-             struct bit_code* code);
+struct compression_info* compression_info_from_codes(
+    struct huffman_code* codes, uint32_t id);
 
 void decompress_payload(struct compression_info* c_info, uint8_t** payload,
                         uint64_t* payload_len);
 
+uint64_t encode_bytes(struct compression_info* c_info, uint8_t* data,
+    uint64_t len, uint8_t* bits, uint64_t bit_pos);
+
+void copy_bits(uint8_t* dst, uint64_t dst_pos, uint8_t* src, uint64_t n_bits);
+
+uint64_t compressed_bound(struct compression_info* c_info, uint64_t len);
+
+uint64_t decompressed_bound(struct compression_info* c_info, uint64_t len);
+
+uint64_t finish_compressed(uint8_t* bits, uint64_t n_bits);
+
+void append_compressed(struct compression_info* c_info, uint8_t** payload,
+    uint64_t* payload_len, uint8_t* data, uint64_t len);
+
 void compress_payload(struct compression_info* c_info, uint8_t** payload, 
     uint64_t* payload_len);
 
-void free_decompression_tree(struct node* n);    
+void compress_payload_framed(struct compression_info* c_info, 
+    uint8_t** payload, uint64_t* payload_len);
+
+int decompress_payload_framed(struct compression_info* c_info,
+    uint8_t** payload, uint64_t* payload_len);
 
 void free_compression_info(struct compression_info* c_info);
 
@@ -0,0 +1,782 @@
+#include "connection.h"
+#include "server.h"
+
+// This file contains the bookkeeping of client connections. Every accepted
+// connection has an entry in a table indexed by its fd, and idle connections
+// sit in a min heap ordered by the time at which they are closed if nothing
+// arrives. The heap is serviced from the accepter's event loop. Responses
+// sent with MSG_ZEROCOPY are kept with their connection until the kernel
+// reports it is done with their buffers.
+
+
+uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+void init_connection_table(struct connection_table* t, size_t max_connections,
+    uint64_t idle_timeout_ms)
+{
+    pthread_mutex_init(&t->lock, NULL);
+
+    t->cap_connections = STARTING_CLIENTS;
+    t->connections = calloc(t->cap_connections, sizeof(*t->connections));
+    t->n_connections = 0;
+    t->max_connections = max_connections;
+
+    t->heap = malloc(sizeof(*t->heap)*t->cap_connections);
+    t->heap_size = 0;
+    t->orphaned_sends = NULL;
+
+    t->idle_timeout_ms = idle_timeout_ms;
+}
+
+
+static void swap_heap(struct connection_table* t, size_t i, size_t j)
+{
+    struct connection* tmp = t->heap[i];
+
+    t->heap[i] = t->heap[j];
+    t->heap[j] = tmp;
+
+    t->heap[i]->heap_index = i;
+    t->heap[j]->heap_index = j;
+}
+
+
+static void sift_up(struct connection_table* t, size_t i)
+{
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+
+        if (t->heap[parent]->deadline_ms <= t->heap[i]->deadline_ms)
+        {
+            break;
+        }
+
+        swap_heap(t, i, parent);
+        i = parent;
+    }
+}
+
+
+static void sift_down(struct connection_table* t, size_t i)
+{
+    while (true)
+    {
+        size_t smallest = i;
+        size_t left = 2*i + 1;
+        size_t right = 2*i + 2;
+
+        if (left < t->heap_size &&
+            t->heap[left]->deadline_ms < t->heap[smallest]->deadline_ms)
+        {
+            smallest = left;
+        }
+
+        if (right < t->heap_size &&
+            t->heap[right]->deadline_ms < t->heap[smallest]->deadline_ms)
+        {
+            smallest = right;
+        }
+
+        if (smallest == i)
+        {
+            break;
+        }
+
+        swap_heap(t, i, smallest);
+        i = smallest;
+    }
+}
+
+
+static void heap_push(struct connection_table* t, struct connection* c)
+{
+    c->heap_index = t->heap_size;
+    t->heap[t->heap_size] = c;
+    t->heap_size++;
+
+    sift_up(t, c->heap_index);
+}
+
+
+static void heap_remove(struct connection_table* t, struct connection* c)
+{
+    size_t i = c->heap_index;
+
+    if (i == NOT_IN_HEAP)
+    {
+        return;
+    }
+
+    t->heap_size--;
+
+    if (i != t->heap_size)
+    {
+        struct connection* moved = t->heap[t->heap_size];
+
+        swap_heap(t, i, t->heap_size);
+        sift_up(t, i);
+        sift_down(t, moved->heap_index);
+    }
+
+    c->heap_index = NOT_IN_HEAP;
+}
+
+
+static void free_zerocopy_send(struct zerocopy_send* zs)
+{
+    for (size_t i = 0; i < zs->n_buffers; i++)
+    {
+        release_buffer(zs->buffers[i]);
+    }
+
+    free(zs->copied);
+    free(zs);
+}
+
+
+// lets go of the sends of a connection the kernel is done with, the
+// connection's zerocopy lock is held
+static void reap_zerocopy_sends(struct connection* c)
+{
+    struct zerocopy_send** zs = &c->zerocopy_sends;
+
+    while (*zs != NULL)
+    {
+        if ((*zs)->sealed && (*zs)->n_done >= (*zs)->n_sends)
+        {
+            struct zerocopy_send* done = *zs;
+
+            *zs = done->next;
+            free_zerocopy_send(done);
+        }
+        else
+        {
+            zs = &(*zs)->next;
+        }
+    }
+}
+
+
+// moves the sends of a connection to the orphaned ones, the table's lock
+// and the connection's zerocopy lock are held
+static void orphan_sends(struct connection_table* t, struct connection* c,
+    uint64_t deadline_ms)
+{
+    while (c->zerocopy_sends != NULL)
+    {
+        struct zerocopy_send* zs = c->zerocopy_sends;
+
+        c->zerocopy_sends = zs->next;
+        zs->deadline_ms = deadline_ms;
+        zs->next = t->orphaned_sends;
+        t->orphaned_sends = zs;
+    }
+}
+
+
+// adds a freshly accepted connection to the table, returns false if the
+// server is already at its connection limit
+bool register_connection(struct connection_table* t, int fd,
+    struct sockaddr_in* addr, bool local, size_t node)
+{
+    pthread_mutex_lock(&t->lock);
+
+    if (t->n_connections >= t->max_connections)
+    {
+        pthread_mutex_unlock(&t->lock);
+        return false;
+    }
+
+    if (fd >= t->cap_connections)
+    {
+        size_t new_cap = t->cap_connections;
+        while (fd >= new_cap)
+        {
+            new_cap *= 2;
+        }
+
+        t->connections = realloc(t->connections,
+                                sizeof(*t->connections)*new_cap);
+        memset(t->connections + t->cap_connections, 0,
+                sizeof(*t->connections)*(new_cap - t->cap_connections));
+
+        t->heap = realloc(t->heap, sizeof(*t->heap)*new_cap);
+        t->cap_connections = new_cap;
+    }
+
+    if (t->connections[fd] == NULL)
+    {
+        t->connections[fd] = calloc(1, sizeof(struct connection));
+        t->connections[fd]->heap_index = NOT_IN_HEAP;
+        pthread_mutex_init(&t->connections[fd]->send_lock, NULL);
+        pthread_mutex_init(&t->connections[fd]->zerocopy_lock, NULL);
+    }
+
+    struct connection* c = t->connections[fd];
+
+    // the fd was closed without being unregistered
+    if (c->in_use)
+    {
+        heap_remove(t, c);
+        t->n_connections--;
+    }
+
+    // the sends of the socket the fd used to be are no longer reported
+    pthread_mutex_lock(&c->zerocopy_lock);
+    orphan_sends(t, c, now_ms() + t->idle_timeout_ms);
+    c->zerocopy_seq = 0;
+    pthread_mutex_unlock(&c->zerocopy_lock);
+
+    c->fd = fd;
+    c->in_use = true;
+    c->addr = *addr;
+    c->local = local;
+    c->node = node;
+    c->n_busy = 0;
+    c->closing = false;
+    c->flags = 0;
+    c->zerocopy = false;
+    c->dict_id = 0;
+    c->deadline_ms = now_ms() + t->idle_timeout_ms;
+    heap_push(t, c);
+
+    t->n_connections++;
+
+    pthread_mutex_unlock(&t->lock);
+
+    return true;
+}
+
+
+// removes a connection from the table, must be called before its fd is closed
+void unregister_connection(struct connection_table* t, int fd)
+{
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        struct connection* c = t->connections[fd];
+
+        heap_remove(t, c);
+        c->in_use = false;
+        t->n_connections--;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// marks a request of the connection as dispatched, it can't time out until
+// every dispatched request has been handled. Returns false if the
+// connection is being closed, in which case nothing is dispatched
+bool connection_busy(struct connection_table* t, int fd)
+{
+    bool busy = false;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use && !t->connections[fd]->closing)
+    {
+        struct connection* c = t->connections[fd];
+
+        c->n_busy++;
+        heap_remove(t, c);
+        busy = true;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return busy;
+}
+
+
+// marks a request of the connection as handled, restarting its idle timer
+// once nothing else is in flight. Returns true if the connection is being
+// closed and this was its last request, in which case it has been
+// unregistered and the caller closes the fd
+bool connection_idle(struct connection_table* t, int fd)
+{
+    bool closed = false;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        struct connection* c = t->connections[fd];
+
+        if (c->n_busy > 0)
+        {
+            c->n_busy--;
+        }
+
+        if (c->closing && c->n_busy == 0)
+        {
+            heap_remove(t, c);
+            c->in_use = false;
+            t->n_connections--;
+            closed = true;
+        }
+        else if (c->n_busy == 0 && c->heap_index == NOT_IN_HEAP)
+        {
+            c->deadline_ms = now_ms() + t->idle_timeout_ms;
+            heap_push(t, c);
+        }
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return closed;
+}
+
+
+// marks a connection as being closed, no more of its requests are
+// dispatched and it can't time out meanwhile
+void connection_closing(struct connection_table* t, int fd)
+{
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        struct connection* c = t->connections[fd];
+
+        c->closing = true;
+        heap_remove(t, c);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// unregisters up to max_expired connections whose idle deadline has passed
+// and stores their fds in expired for the caller to close
+size_t pop_expired_connections(struct connection_table* t, uint64_t now,
+    int* expired, size_t max_expired)
+{
+    size_t n_expired = 0;
+
+    pthread_mutex_lock(&t->lock);
+
+    while (t->heap_size > 0 && n_expired < max_expired &&
+            t->heap[0]->deadline_ms <= now)
+    {
+        struct connection* c = t->heap[0];
+
+        heap_remove(t, c);
+        c->in_use = false;
+        t->n_connections--;
+
+        expired[n_expired] = c->fd;
+        n_expired++;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return n_expired;
+}
+
+
+uint8_t connection_flags(struct connection_table* t, int fd)
+{
+    uint8_t flags = 0;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        flags = t->connections[fd]->flags;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return flags;
+}
+
+
+void set_connection_flags(struct connection_table* t, int fd, uint8_t flags)
+{
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        t->connections[fd]->flags = flags;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// turns on MSG_ZEROCOPY for a connection if its socket supports it
+void enable_connection_zerocopy(struct connection_table* t, int fd)
+{
+    int option = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &option, sizeof(option)) < 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        t->connections[fd]->zerocopy = true;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+bool connection_is_local(struct connection_table* t, int fd)
+{
+    bool local = false;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        local = t->connections[fd]->local;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return local;
+}
+
+
+// looks up the address of a TCP client, returns false for local clients,
+// which don't have one
+bool connection_source(struct connection_table* t, int fd, in_addr_t* addr)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use && !t->connections[fd]->local)
+    {
+        *addr = t->connections[fd]->addr.sin_addr.s_addr;
+        found = true;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return found;
+}
+
+
+size_t connection_node(struct connection_table* t, int fd)
+{
+    size_t node = 0;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        node = t->connections[fd]->node;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return node;
+}
+
+
+uint32_t connection_dictionary(struct connection_table* t, int fd)
+{
+    uint32_t dict_id = 0;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        dict_id = t->connections[fd]->dict_id;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return dict_id;
+}
+
+
+void set_connection_dictionary(struct connection_table* t, int fd,
+    uint32_t dict_id)
+{
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        t->connections[fd]->dict_id = dict_id;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// adds a response about to be sent with MSG_ZEROCOPY to the sends of its
+// connection, before its first send so that no completion is missed. Its
+// sends are numbered from the connection's next sequence number on
+void add_zerocopy_send(struct connection* c, struct zerocopy_send* zs)
+{
+    pthread_mutex_lock(&c->zerocopy_lock);
+
+    zs->first_seq = c->zerocopy_seq;
+    zs->next = c->zerocopy_sends;
+    c->zerocopy_sends = zs;
+
+    pthread_mutex_unlock(&c->zerocopy_lock);
+}
+
+
+// records how many sends a response took once the last one has been made,
+// letting go of it if they are all done already
+void seal_zerocopy_send(struct connection* c, struct zerocopy_send* zs,
+    uint32_t n_sends)
+{
+    pthread_mutex_lock(&c->zerocopy_lock);
+
+    c->zerocopy_seq += n_sends;
+    zs->n_sends = n_sends;
+    zs->sealed = true;
+    reap_zerocopy_sends(c);
+
+    pthread_mutex_unlock(&c->zerocopy_lock);
+}
+
+
+// counts the completion of the sends numbered first_seq to last_seq, and
+// lets go of the responses all of whose sends are done
+void complete_zerocopy_sends(struct connection_table* t, int fd,
+    uint32_t first_seq, uint32_t last_seq)
+{
+    struct connection* c = NULL;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections)
+    {
+        c = t->connections[fd];
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    if (c == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&c->zerocopy_lock);
+
+    for (struct zerocopy_send* zs = c->zerocopy_sends; zs != NULL;
+        zs = zs->next)
+    {
+        // the sequence numbers wrap around so they are compared by their
+        // distance from the first send. An unsealed send takes every number
+        // from its first on
+        int64_t from = (int32_t) (first_seq - zs->first_seq);
+        int64_t to = (int32_t) (last_seq - zs->first_seq);
+        int64_t end = zs->sealed ? zs->n_sends : INT32_MAX;
+
+        from = from > 0 ? from : 0;
+        to = to < end - 1 ? to : end - 1;
+
+        if (from <= to)
+        {
+            zs->n_done += to - from + 1;
+        }
+    }
+
+    reap_zerocopy_sends(c);
+
+    pthread_mutex_unlock(&c->zerocopy_lock);
+}
+
+
+// whether a connection has responses sent with MSG_ZEROCOPY the kernel
+// hasn't reported done yet
+bool has_zerocopy_sends(struct connection_table* t, int fd)
+{
+    struct connection* c = NULL;
+    bool pending = false;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections)
+    {
+        c = t->connections[fd];
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    if (c != NULL)
+    {
+        pthread_mutex_lock(&c->zerocopy_lock);
+        pending = c->zerocopy_sends != NULL;
+        pthread_mutex_unlock(&c->zerocopy_lock);
+    }
+
+    return pending;
+}
+
+
+// hands the sends of a connection whose fd is about to be closed over to
+// the table. Their completions can't be read once it is closed, but the
+// kernel may still retransmit from their buffers, so they are held until
+// deadline_ms
+void orphan_zerocopy_sends(struct connection_table* t, int fd,
+    uint64_t deadline_ms)
+{
+    pthread_mutex_lock(&t->lock);
+
+    if (fd < t->cap_connections && t->connections[fd] != NULL)
+    {
+        struct connection* c = t->connections[fd];
+
+        pthread_mutex_lock(&c->zerocopy_lock);
+        orphan_sends(t, c, deadline_ms);
+        pthread_mutex_unlock(&c->zerocopy_lock);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// lets go of the orphaned sends whose deadline has passed
+void expire_zerocopy_sends(struct connection_table* t, uint64_t now)
+{
+    struct zerocopy_send* expired = NULL;
+
+    pthread_mutex_lock(&t->lock);
+
+    struct zerocopy_send** zs = &t->orphaned_sends;
+
+    while (*zs != NULL)
+    {
+        if ((*zs)->deadline_ms <= now)
+        {
+            struct zerocopy_send* done = *zs;
+
+            *zs = done->next;
+            done->next = expired;
+            expired = done;
+        }
+        else
+        {
+            zs = &(*zs)->next;
+        }
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    while (expired != NULL)
+    {
+        struct zerocopy_send* done = expired;
+
+        expired = done->next;
+        free_zerocopy_send(done);
+    }
+}
+
+
+// takes the send lock of a connection so that a whole response can be sent
+// without another worker's response ending up in the middle of it. Returns
+// NULL if the connection isn't registered
+struct connection* lock_connection_send(struct connection_table* t, int fd)
+{
+    struct connection* c = NULL;
+
+    pthread_mutex_lock(&t->lock);
+
+    // entries are never freed while the server runs, only reused
+    if (fd < t->cap_connections && t->connections[fd] != NULL &&
+        t->connections[fd]->in_use)
+    {
+        c = t->connections[fd];
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    if (c != NULL)
+    {
+        pthread_mutex_lock(&c->send_lock);
+    }
+
+    return c;
+}
+
+
+void unlock_connection_send(struct connection* c)
+{
+    if (c != NULL)
+    {
+        pthread_mutex_unlock(&c->send_lock);
+    }
+}
+
+
+// returns how long the event loop may wait before the next deadline is due
+int connection_timeout(struct connection_table* t, int max_timeout)
+{
+    int timeout = max_timeout;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->heap_size > 0)
+    {
+        uint64_t now = now_ms();
+        uint64_t deadline = t->heap[0]->deadline_ms;
+
+        if (deadline <= now)
+        {
+            timeout = 0;
+        }
+        else if (deadline - now < max_timeout)
+        {
+            timeout = deadline - now;
+        }
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return timeout;
+}
+
+
+void free_connection_table(struct connection_table* t)
+{
+    for (size_t i = 0; i < t->cap_connections; i++)
+    {
+        if (t->connections[i] != NULL)
+        {
+            orphan_sends(t, t->connections[i], 0);
+            pthread_mutex_destroy(&t->connections[i]->send_lock);
+            pthread_mutex_destroy(&t->connections[i]->zerocopy_lock);
+        }
+
+        free(t->connections[i]);
+    }
+
+    expire_zerocopy_sends(t, UINT64_MAX);
+
+    free(t->connections);
+    free(t->heap);
+    pthread_mutex_destroy(&t->lock);
+}
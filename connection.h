@@ -0,0 +1,174 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+
+#define NOT_IN_HEAP (SIZE_MAX)
+
+// per connection settings a client can turn on with an extended request
+#define CONNECTION_RETRIEVAL_CHECKSUM (0x01)
+#define CONNECTION_FLAGS_MASK (CONNECTION_RETRIEVAL_CHECKSUM)
+
+// buffers a response sent with MSG_ZEROCOPY can be made of
+#define MAX_ZEROCOPY_BUFFERS (8)
+
+
+// a response sent with MSG_ZEROCOPY. Its buffers are held until the kernel
+// has reported every send of it done, which is once the client has
+// acknowledged its bytes. The small parts of the response are sent from a
+// copy of their own
+struct zerocopy_send {
+    // completion sequence numbers of its sends, n_sends is only known once
+    // it is sealed, after the last send
+    uint32_t first_seq;
+    uint32_t n_sends;
+    uint32_t n_done;
+    bool sealed;
+
+    uint8_t* copied;
+    void* buffers[MAX_ZEROCOPY_BUFFERS];
+    size_t n_buffers;
+
+    // when it is let go of anyway, once its connection has been closed
+    uint64_t deadline_ms;
+
+    struct zerocopy_send* next;
+};
+
+
+struct connection {
+    int fd;
+    bool in_use;
+    struct sockaddr_in addr;
+
+    // accepted on the unix domain socket, addr is unset
+    bool local;
+
+    // numa node whose workers handle the connection's requests
+    size_t node;
+
+    // number of requests queued or being handled, the connection is only
+    // idle (and can time out) while this is zero
+    uint32_t n_busy;
+
+    // the connection has been shut down, its fd is closed once the last
+    // request in flight has been handled so that it can't be reused while
+    // a worker may still send on it
+    bool closing;
+
+    uint64_t deadline_ms;
+    size_t heap_index;
+
+    uint8_t flags;
+
+    // large responses are sent with MSG_ZEROCOPY, until the kernel reports
+    // it had to copy them anyway
+    bool zerocopy;
+
+    // responses sent with MSG_ZEROCOPY the kernel may still send from, and
+    // the sequence number of the next send, counted by the kernel per socket
+    pthread_mutex_t zerocopy_lock;
+    struct zerocopy_send* zerocopy_sends;
+    uint32_t zerocopy_seq;
+
+    // version of the dictionary used for the connection's payloads
+    uint32_t dict_id;
+
+    // held while a response is sent, several requests of a connection can
+    // be handled at once
+    pthread_mutex_t send_lock;
+};
+
+struct connection_table {
+    pthread_mutex_t lock;
+
+    // indexed by the client fd
+    struct connection** connections;
+    size_t cap_connections;
+    size_t n_connections;
+    size_t max_connections;
+
+    // min heap of idle connections ordered by deadline
+    struct connection** heap;
+    size_t heap_size;
+
+    // zerocopy sends of closed connections, whose completions can no longer
+    // be read, let go of at their deadline
+    struct zerocopy_send* orphaned_sends;
+
+    uint64_t idle_timeout_ms;
+};
+
+
+
+uint64_t now_ms();
+
+void init_connection_table(struct connection_table* t, size_t max_connections,
+    uint64_t idle_timeout_ms);
+
+bool register_connection(struct connection_table* t, int fd,
+    struct sockaddr_in* addr, bool local, size_t node);
+
+void unregister_connection(struct connection_table* t, int fd);
+
+bool connection_busy(struct connection_table* t, int fd);
+
+bool connection_idle(struct connection_table* t, int fd);
+
+void connection_closing(struct connection_table* t, int fd);
+
+size_t pop_expired_connections(struct connection_table* t, uint64_t now,
+    int* expired, size_t max_expired);
+
+uint8_t connection_flags(struct connection_table* t, int fd);
+
+void set_connection_flags(struct connection_table* t, int fd, uint8_t flags);
+
+void enable_connection_zerocopy(struct connection_table* t, int fd);
+
+bool connection_is_local(struct connection_table* t, int fd);
+
+bool connection_source(struct connection_table* t, int fd, in_addr_t* addr);
+
+size_t connection_node(struct connection_table* t, int fd);
+
+uint32_t connection_dictionary(struct connection_table* t, int fd);
+
+void set_connection_dictionary(struct connection_table* t, int fd,
+    uint32_t dict_id);
+
+void add_zerocopy_send(struct connection* c, struct zerocopy_send* zs);
+
+void seal_zerocopy_send(struct connection* c, struct zerocopy_send* zs,
+    uint32_t n_sends);
+
+void complete_zerocopy_sends(struct connection_table* t, int fd,
+    uint32_t first_seq, uint32_t last_seq);
+
+bool has_zerocopy_sends(struct connection_table* t, int fd);
+
+void orphan_zerocopy_sends(struct connection_table* t, int fd,
+    uint64_t deadline_ms);
+
+void expire_zerocopy_sends(struct connection_table* t, uint64_t now);
+
+struct connection* lock_connection_send(struct connection_table* t, int fd);
+
+void unlock_connection_send(struct connection* c);
+
+int connection_timeout(struct connection_table* t, int max_timeout);
+
+void free_connection_table(struct connection_table* t);
+
+#endif
@@ -0,0 +1,343 @@
+#include "dictionary.h"
+
+// This file turns a dictionary in the compression.dict format into the flat
+// tables used for encoding and decoding. The format is, for every byte value
+// in order, an 8 bit code length followed by the code's bits, all packed
+// together with no padding. It is used by gen_tables at build time and by
+// the server when a dictionary is loaded at runtime.
+
+
+// reads a whole dictionary file into memory
+uint8_t* read_dictionary_file(char* path, size_t* dict_len)
+{
+    FILE* f = fopen(path, "rb");
+
+    if (f == NULL)
+    {
+        perror("couldn't open dictionary");
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* dict = malloc(sizeof(*dict)*(size > 0 ? size : 1));
+
+    if (size < 0 || fread(dict, 1, size, f) != size)
+    {
+        perror("couldn't read dictionary");
+        free(dict);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+
+    *dict_len = size;
+    return dict;
+}
+
+
+static bool dict_bit(uint8_t* dict, size_t i)
+{
+    return (dict[i / 8] >> (7 - i % 8)) & 0x1;
+}
+
+
+// reads the code of every byte value out of the dictionary, returns -1 if the
+// dictionary is truncated or has codes that are too long
+int parse_dictionary(uint8_t* dict, size_t dict_len,
+    struct huffman_code* codes)
+{
+    size_t n_bits = dict_len * 8;
+    size_t i = 0;
+
+    for (size_t n_codes = 0; n_codes < N_SEGMENTS; n_codes++)
+    {
+        uint8_t length = 0;
+
+        if (i + CODE_LENGTH_BITS > n_bits)
+        {
+            return -1;
+        }
+
+        for (size_t j = 0; j < CODE_LENGTH_BITS; j++, i++)
+        {
+            length = (length << 1) | dict_bit(dict, i);
+        }
+
+        if (length == 0 || length > MAX_CODE_LENGTH || i + length > n_bits)
+        {
+            return -1;
+        }
+
+        uint32_t bits = 0;
+        for (size_t j = 0; j < length; j++, i++)
+        {
+            bits = (bits << 1) | dict_bit(dict, i);
+        }
+
+        codes[n_codes].bits = bits;
+        codes[n_codes].length = length;
+    }
+
+    return 0;
+}
+
+
+// builds the flat decoding tree of the codes. Returns the number of nodes
+// used, or -1 if the codes aren't a complete prefix code, since decoding
+// would otherwise be able to walk off the tree
+int build_decode_tree(struct huffman_code* codes, struct decode_node* tree)
+{
+    int n_nodes = 1;
+
+    // zero means no child yet, the root can never be anyone's child
+    memset(tree, 0, sizeof(*tree)*N_DECODE_NODES);
+
+    for (int byte = 0; byte < N_SEGMENTS; byte++)
+    {
+        int node = 0;
+
+        for (int j = codes[byte].length - 1; j >= 0; j--)
+        {
+            int bit = (codes[byte].bits >> j) & 0x1;
+            int16_t child = tree[node].next[bit];
+
+            // a shorter code is a prefix of this one
+            if (child < 0)
+            {
+                return -1;
+            }
+
+            if (j == 0)
+            {
+                // this code is a prefix of a longer one, or a duplicate
+                if (child != 0)
+                {
+                    return -1;
+                }
+
+                tree[node].next[bit] = -(byte + 1);
+                break;
+            }
+
+            if (child == 0)
+            {
+                if (n_nodes == N_DECODE_NODES)
+                {
+                    return -1;
+                }
+
+                child = n_nodes;
+                tree[node].next[bit] = child;
+                n_nodes++;
+            }
+
+            node = child;
+        }
+    }
+
+    // every internal node needs both children for the code to be complete
+    for (int node = 0; node < n_nodes; node++)
+    {
+        if (tree[node].next[0] == 0 || tree[node].next[1] == 0)
+        {
+            return -1;
+        }
+    }
+
+    return n_nodes;
+}
+
+
+// FNV-1a hash of the codes, telling apart data encoded with different
+// dictionaries
+uint64_t dictionary_hash(const struct huffman_code* codes)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        uint8_t bytes[5] = {
+            codes[i].bits >> 24, codes[i].bits >> 16, codes[i].bits >> 8,
+            codes[i].bits, codes[i].length
+        };
+
+        for (int j = 0; j < 5; j++)
+        {
+            hash = (hash ^ bytes[j]) * 1099511628211ULL;
+        }
+    }
+
+    return hash;
+}
+
+
+static void set_dict_bit(uint8_t* dict, size_t i, bool bit)
+{
+    if (bit)
+    {
+        dict[i / 8] |= 1 << (7 - i % 8);
+    }
+}
+
+
+// writes the codes in the compression.dict format
+uint8_t* write_dictionary(const struct huffman_code* codes, size_t* dict_len)
+{
+    size_t n_bits = 0;
+
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        n_bits += CODE_LENGTH_BITS + codes[i].length;
+    }
+
+    *dict_len = (n_bits + 7) / 8;
+    uint8_t* dict = calloc(*dict_len, sizeof(*dict));
+    size_t pos = 0;
+
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        for (int j = CODE_LENGTH_BITS - 1; j >= 0; j--, pos++)
+        {
+            set_dict_bit(dict, pos, (codes[i].length >> j) & 0x1);
+        }
+
+        for (int j = codes[i].length - 1; j >= 0; j--, pos++)
+        {
+            set_dict_bit(dict, pos, (codes[i].bits >> j) & 0x1);
+        }
+    }
+
+    return dict;
+}
+
+
+static int compare_items(const void* a, const void* b)
+{
+    const struct package_item* i1 = a;
+    const struct package_item* i2 = b;
+
+    if (i1->weight != i2->weight)
+    {
+        return i1->weight < i2->weight ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+// adds one to the code length of every leaf under an item
+static void count_leaves(struct package_item (*levels)[MAX_PACKAGE_ITEMS],
+    int level, int item, uint8_t* lengths)
+{
+    struct package_item* it = &levels[level][item];
+
+    if (it->symbol >= 0)
+    {
+        lengths[it->symbol]++;
+        return;
+    }
+
+    count_leaves(levels, level - 1, it->left, lengths);
+    count_leaves(levels, level - 1, it->right, lengths);
+}
+
+
+// builds the optimal prefix code for the weights of every byte value with no
+// code longer than max_length, using package merge. Every byte value gets a
+// code even if its weight is zero. The codes are canonical, so codes of the
+// same length are in byte order
+void build_length_limited_code(const uint64_t* weights, uint8_t max_length,
+    struct huffman_code* codes)
+{
+    struct package_item leaves[N_SEGMENTS];
+    struct package_item (*levels)[MAX_PACKAGE_ITEMS] = 
+            malloc(sizeof(*levels)*max_length);
+    int n_items[MAX_CODE_LENGTH];
+    uint8_t lengths[N_SEGMENTS] = {0};
+
+    // a zero weight would let unused bytes get arbitrarily long codes
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        leaves[i].weight = weights[i] + 1;
+        leaves[i].symbol = i;
+        leaves[i].left = -1;
+        leaves[i].right = -1;
+    }
+
+    qsort(leaves, N_SEGMENTS, sizeof(*leaves), compare_items);
+
+    memcpy(levels[0], leaves, sizeof(leaves));
+    n_items[0] = N_SEGMENTS;
+
+    // each level merges the leaves with the pairs of the level below
+    for (int l = 1; l < max_length; l++)
+    {
+        int n_packages = n_items[l - 1] / 2;
+        int li = 0;
+        int pi = 0;
+
+        n_items[l] = 0;
+
+        while (li < N_SEGMENTS || pi < n_packages)
+        {
+            struct package_item package = {0};
+
+            if (pi < n_packages)
+            {
+                package.weight = levels[l - 1][2*pi].weight + 
+                                levels[l - 1][2*pi + 1].weight;
+                package.symbol = -1;
+                package.left = 2*pi;
+                package.right = 2*pi + 1;
+            }
+
+            if (pi == n_packages ||
+                (li < N_SEGMENTS && leaves[li].weight <= package.weight))
+            {
+                levels[l][n_items[l]] = leaves[li];
+                li++;
+            }
+            else
+            {
+                levels[l][n_items[l]] = package;
+                pi++;
+            }
+
+            n_items[l]++;
+        }
+    }
+
+    // the cheapest 2n - 2 items of the top level give the code lengths
+    for (int i = 0; i < 2*N_SEGMENTS - 2; i++)
+    {
+        count_leaves(levels, max_length - 1, i, lengths);
+    }
+
+    free(levels);
+
+    // canonical codes, shortest first and in byte order within a length
+    uint32_t code = 0;
+    uint8_t prev_length = 0;
+
+    for (uint8_t length = 1; length <= max_length; length++)
+    {
+        for (int i = 0; i < N_SEGMENTS; i++)
+        {
+            if (lengths[i] != length)
+            {
+                continue;
+            }
+
+            code <<= length - prev_length;
+            prev_length = length;
+
+            codes[i].bits = code;
+            codes[i].length = length;
+            code++;
+        }
+    }
+}
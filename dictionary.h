@@ -0,0 +1,63 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#define N_SEGMENTS (256)
+
+// a prefix code can't have more internal nodes than this
+#define N_DECODE_NODES (N_SEGMENTS - 1)
+
+// longest code that fits in the bits of a huffman_code
+#define MAX_CODE_LENGTH (32)
+
+// number of bits holding the length of each code in the dictionary format
+#define CODE_LENGTH_BITS (8)
+
+// upper bound on the number of items in a level of package merge
+#define MAX_PACKAGE_ITEMS (2*N_SEGMENTS)
+
+
+// the code of a byte, right aligned in bits
+struct huffman_code {
+    uint32_t bits;
+    uint8_t length;
+};
+
+// an item of package merge, either the leaf of a byte value or a package of
+// two items of the level below
+struct package_item {
+    uint64_t weight;
+    int16_t symbol;
+    int16_t left;
+    int16_t right;
+};
+
+// an internal node of the decoding tree stored as a flat array. A child >= 0
+// is the index of another node, a child < 0 is the leaf for byte -(child+1)
+struct decode_node {
+    int16_t next[2];
+};
+
+
+
+uint8_t* read_dictionary_file(char* path, size_t* dict_len);
+
+int parse_dictionary(uint8_t* dict, size_t dict_len,
+    struct huffman_code* codes);
+
+int build_decode_tree(struct huffman_code* codes, struct decode_node* tree);
+
+uint64_t dictionary_hash(const struct huffman_code* codes);
+
+uint8_t* write_dictionary(const struct huffman_code* codes, size_t* dict_len);
+
+void build_length_limited_code(const uint64_t* weights, uint8_t max_length,
+    struct huffman_code* codes);
+
+#endif
@@ -0,0 +1,130 @@
+#include "flight.h"
+
+// This file contains the single flight table used by file retrievals.
+// The first worker asking for a (file, range, dictionary) reads and encodes
+// it, every other worker asking for the same thing while that is in progress
+// waits for it and shares the result. A flight leaves the table once it is
+// done, so later requests always see the current file contents.
+
+
+struct flight_table* create_flight_table()
+{
+    struct flight_table* t = malloc(sizeof(*t));
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->done_cond, NULL);
+    t->head = NULL;
+
+    return t;
+}
+
+
+// joins the flight of a range, creating it if nobody is reading the range.
+// leader is set when the caller created the flight and has to complete it
+struct flight* join_flight(struct flight_table* t, char* file_name,
+    struct stat* st, uint64_t start_offset, uint64_t n_bytes, 
+    struct compression_info* c_info, bool* leader)
+{
+    struct flight* f;
+
+    pthread_mutex_lock(&t->lock);
+
+    for (f = t->head; f != NULL; f = f->next)
+    {
+        if (f->start_offset == start_offset && f->n_bytes == n_bytes &&
+            f->c_info == c_info && f->dev == st->st_dev &&
+            f->ino == st->st_ino && f->file_size == st->st_size &&
+            f->mtime.tv_sec == st->st_mtim.tv_sec &&
+            f->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+            strcmp(f->file_name, file_name) == 0)
+        {
+            f->refcount++;
+            *leader = false;
+
+            pthread_mutex_unlock(&t->lock);
+            return f;
+        }
+    }
+
+    f = calloc(1, sizeof(*f));
+    strncpy(f->file_name, file_name, MAX_FILE_NAME - 1);
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->mtime = st->st_mtim;
+    f->file_size = st->st_size;
+    f->start_offset = start_offset;
+    f->n_bytes = n_bytes;
+    f->c_info = c_info;
+    f->refcount = 1;
+
+    f->next = t->head;
+    t->head = f;
+    *leader = true;
+
+    pthread_mutex_unlock(&t->lock);
+
+    return f;
+}
+
+
+// publishes the result of a flight to its waiters and takes it out of the
+// table so that no new requests join it
+void complete_flight(struct flight_table* t, struct flight* f, bool failed)
+{
+    pthread_mutex_lock(&t->lock);
+
+    struct flight** cursor = &t->head;
+    while (*cursor != NULL && *cursor != f)
+    {
+        cursor = &(*cursor)->next;
+    }
+
+    if (*cursor != NULL)
+    {
+        *cursor = f->next;
+    }
+
+    f->next = NULL;
+    f->done = true;
+    f->failed = failed;
+
+    pthread_cond_broadcast(&t->done_cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+void wait_flight(struct flight_table* t, struct flight* f)
+{
+    pthread_mutex_lock(&t->lock);
+
+    while (!f->done)
+    {
+        pthread_cond_wait(&t->done_cond, &t->lock);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// drops a reference to a completed flight, the last one frees it
+void release_flight(struct flight_table* t, struct flight* f)
+{
+    pthread_mutex_lock(&t->lock);
+    f->refcount--;
+    bool last = f->refcount == 0;
+    pthread_mutex_unlock(&t->lock);
+
+    if (last)
+    {
+        free_buffer(f->data);
+        free(f);
+    }
+}
+
+
+void free_flight_table(struct flight_table* t)
+{
+    pthread_cond_destroy(&t->done_cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
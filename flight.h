@@ -0,0 +1,67 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "requests.h"
+
+
+// a read (and possibly encode) of a file range shared by every worker that
+// asks for the same range while it is in progress
+struct flight {
+    char file_name[MAX_FILE_NAME];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t file_size;
+    uint64_t start_offset;
+    uint64_t n_bytes;
+
+    // dictionary the range is encoded with, NULL when it isn't encoded
+    struct compression_info* c_info;
+
+    int refcount;
+    bool done;
+    bool failed;
+
+    // the file bytes, or their encoded bits when c_info is set
+    uint8_t* data;
+    uint64_t n_bits;
+
+    // CRC-32C of the file bytes
+    uint32_t crc;
+
+    struct flight* next;
+};
+
+struct flight_table {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    struct flight* head;
+};
+
+
+
+struct flight_table* create_flight_table();
+
+struct flight* join_flight(struct flight_table* t, char* file_name,
+    struct stat* st, uint64_t start_offset, uint64_t n_bytes, 
+    struct compression_info* c_info, bool* leader);
+
+void complete_flight(struct flight_table* t, struct flight* f, bool failed);
+
+void wait_flight(struct flight_table* t, struct flight* f);
+
+void release_flight(struct flight_table* t, struct flight* f);
+
+void free_flight_table(struct flight_table* t);
+
+#endif
@@ -0,0 +1,76 @@
+#include "dictionary.h"
+
+// Build time generator of the static compression tables. Reads a dictionary
+// in the compression.dict format and writes C source defining the encoding
+// and decoding tables, so that the server doesn't have to build them at
+// startup.
+
+
+int main(int argc, char** argv)
+{
+    struct huffman_code codes[N_SEGMENTS];
+    struct decode_node tree[N_DECODE_NODES];
+    size_t dict_len;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s compression.dict\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t* dict = read_dictionary_file(argv[1], &dict_len);
+    if (dict == NULL)
+    {
+        return 1;
+    }
+
+    if (parse_dictionary(dict, dict_len, codes) < 0 ||
+        build_decode_tree(codes, tree) < 0)
+    {
+        fprintf(stderr, "%s is not a valid dictionary\n", argv[1]);
+        free(dict);
+        return 1;
+    }
+
+    free(dict);
+
+    uint8_t max_length = 0;
+    uint8_t min_length = MAX_CODE_LENGTH;
+
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        if (codes[i].length > max_length)
+        {
+            max_length = codes[i].length;
+        }
+
+        if (codes[i].length < min_length)
+        {
+            min_length = codes[i].length;
+        }
+    }
+
+    printf("// generated by gen_tables from %s, do not edit\n\n", argv[1]);
+    printf("#include \"compression.h\"\n\n\n");
+
+    printf("const struct huffman_code static_codes[N_SEGMENTS]\n");
+    printf("    __attribute__((aligned(64))) = {\n");
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        printf("    {0x%08x, %2u},\n", codes[i].bits, codes[i].length);
+    }
+    printf("};\n\n");
+
+    printf("const struct decode_node static_tree[N_DECODE_NODES]\n");
+    printf("    __attribute__((aligned(64))) = {\n");
+    for (int i = 0; i < N_DECODE_NODES; i++)
+    {
+        printf("    {{%4d, %4d}},\n", tree[i].next[0], tree[i].next[1]);
+    }
+    printf("};\n\n");
+
+    printf("const uint8_t static_max_code_length = %u;\n", max_length);
+    printf("const uint8_t static_min_code_length = %u;\n", min_length);
+
+    return 0;
+}
@@ -0,0 +1,645 @@
+#include "handoff.h"
+#include "thread_pool.h"
+#include "checksum.h"
+
+// This file contains the graceful restart. On SIGUSR2 the server execs a
+// successor, which may be a new binary at the same path, and talks to it
+// over a unix domain socket pair:
+//
+//  1. the checksum cache is sent, so the successor doesn't start cold,
+//     followed by the listening sockets
+//  2. the successor reports it is ready and starts accepting, the old
+//     process stops accepting and lets its workers finish what they have
+//  3. every connection, now idle, is passed on with its settings and the
+//     old process exits without having dropped a single one
+//
+// If the successor doesn't get ready in time the restart is called off and
+// the old process carries on.
+
+
+extern char** environ;
+
+static struct server_info* restart_info = NULL;
+static volatile sig_atomic_t restart_requested = 0;
+
+
+// returns the handoff descriptor if this process was started as a
+// successor, and -1 otherwise
+int handoff_fd_from_env()
+{
+    char* value = getenv(HANDOFF_ENV);
+
+    if (value == NULL)
+    {
+        return -1;
+    }
+
+    int fd = atoi(value);
+
+    // a successor's own successor gets a variable of its own
+    unsetenv(HANDOFF_ENV);
+
+    return fd;
+}
+
+
+static void handle_restart_signal(int sig)
+{
+    restart_requested = 1;
+    sem_post(&restart_info->shutdown_sem);
+}
+
+
+void install_restart_handler(struct server_info* s_info)
+{
+    restart_info = s_info;
+    signal(SIGUSR2, handle_restart_signal);
+}
+
+
+// returns whether the main thread was woken up to restart, and clears it
+bool take_restart_request()
+{
+    bool requested = restart_requested;
+    restart_requested = 0;
+
+    return requested;
+}
+
+
+static int send_handoff_msg(int fd, uint8_t type, uint8_t* entries,
+    uint32_t n_entries, size_t entry_sz, int* fds, size_t n_fds)
+{
+    size_t msg_len = HANDOFF_HEADER_SZ + n_entries * entry_sz;
+    uint8_t* msg_buf = malloc(sizeof(*msg_buf)*msg_len);
+    uint32_t be_n_entries = htobe32(n_entries);
+
+    msg_buf[0] = type;
+    memcpy(msg_buf + 1, &be_n_entries, 4);
+    memcpy(msg_buf + HANDOFF_HEADER_SZ, entries, n_entries * entry_sz);
+
+    struct iovec iov;
+    iov.iov_base = msg_buf;
+    iov.iov_len = msg_len;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } control;
+
+    if (n_fds > 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+    }
+
+    ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    free(msg_buf);
+
+    return ret == msg_len ? 0 : -1;
+}
+
+
+// receives one message into buf, along with the descriptors passed with it.
+// Returns its type, or -1 once the other side has gone away
+static int recv_handoff_msg(int fd, uint8_t* buf, size_t cap,
+    uint32_t* n_entries, int* fds, size_t* n_fds)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = cap;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t ret = recvmsg(fd, &msg, 0);
+
+    if (ret < HANDOFF_HEADER_SZ)
+    {
+        return -1;
+    }
+
+    *n_fds = 0;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+        cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *n_fds);
+        }
+    }
+
+    memcpy(n_entries, buf + 1, 4);
+    *n_entries = be32toh(*n_entries);
+
+    return buf[0];
+}
+
+
+// sends entries in as many messages as it takes
+static int send_handoff_entries(int fd, uint8_t type, uint8_t* entries,
+    size_t n_entries, size_t entry_sz)
+{
+    for (size_t i = 0; i < n_entries; i += HANDOFF_ENTRIES)
+    {
+        size_t n = n_entries - i < HANDOFF_ENTRIES ?
+                    n_entries - i : HANDOFF_ENTRIES;
+
+        if (send_handoff_msg(fd, type, entries + i * entry_sz, n, entry_sz,
+                            NULL, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void put_be64(uint8_t* buf, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(buf, &value, 8);
+}
+
+
+static uint64_t get_be64(uint8_t* buf)
+{
+    uint64_t value;
+    memcpy(&value, buf, 8);
+
+    return be64toh(value);
+}
+
+
+static int send_checksums(struct server_info* s_info, int fd)
+{
+    struct checksum_cache* c = s_info->checksums;
+    uint8_t* entries = malloc(HANDOFF_CHECKSUM_SZ * N_CHECKSUM_CACHE);
+    size_t n_entries = 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    for (size_t i = 0; i < N_CHECKSUM_CACHE; i++)
+    {
+        struct checksum_entry* ce = &c->entries[i];
+
+        if (!ce->in_use)
+        {
+            continue;
+        }
+
+        uint8_t* e = entries + n_entries * HANDOFF_CHECKSUM_SZ;
+        uint32_t be_crc = htobe32(ce->crc);
+
+        put_be64(e, ce->dev);
+        put_be64(e + 8, ce->ino);
+        put_be64(e + 16, ce->mtime.tv_sec);
+        put_be64(e + 24, ce->mtime.tv_nsec);
+        put_be64(e + 32, ce->file_size);
+        put_be64(e + 40, ce->start_offset);
+        put_be64(e + 48, ce->n_bytes);
+        memcpy(e + 56, &be_crc, 4);
+
+        n_entries++;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    int ret = send_handoff_entries(fd, HANDOFF_CHECKSUMS, entries, n_entries,
+                                HANDOFF_CHECKSUM_SZ);
+    free(entries);
+
+    return ret;
+}
+
+
+static int send_listeners(struct server_info* s_info, int fd)
+{
+    int fds[MAX_NUMA_NODES + 1];
+    uint8_t kinds[MAX_NUMA_NODES + 1];
+    size_t n_fds = 0;
+
+    // the listeners of the nodes in the order they joined their group,
+    // which its steering program relies on
+    for (size_t i = 0; i < s_info->n_nodes; i++)
+    {
+        fds[n_fds] = s_info->node_sockets[i];
+        kinds[n_fds] = HANDOFF_LISTENER_TCP;
+        n_fds++;
+    }
+
+    if (s_info->unix_socket >= 0)
+    {
+        fds[n_fds] = s_info->unix_socket;
+        kinds[n_fds] = HANDOFF_LISTENER_UNIX;
+        n_fds++;
+    }
+
+    return send_handoff_msg(fd, HANDOFF_LISTENERS, kinds, n_fds, 1, fds,
+                            n_fds);
+}
+
+
+// waits for the successor to report it is accepting connections
+static int wait_ready(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, HANDOFF_TIMEOUT_MS) != 1)
+    {
+        return -1;
+    }
+
+    uint8_t buf[HANDOFF_HEADER_SZ];
+    int fds[HANDOFF_BATCH];
+    size_t n_fds;
+    uint32_t n_entries;
+
+    if (recv_handoff_msg(fd, buf, sizeof(buf), &n_entries, fds, &n_fds) !=
+        HANDOFF_READY)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// passes every connection on to the successor, the workers must have been
+// drained so that none of them is in the middle of a request. Connections
+// using a trained dictionary are closed, the successor doesn't have it
+static void send_connections(struct server_info* s_info, int fd)
+{
+    struct connection_table* t = &s_info->connections;
+    int fds[HANDOFF_BATCH];
+    uint8_t entries[HANDOFF_BATCH * HANDOFF_CONNECTION_SZ];
+    size_t n_fds = 0;
+    size_t next_fd = 0;
+
+    while (true)
+    {
+        n_fds = 0;
+
+        pthread_mutex_lock(&t->lock);
+
+        for (; next_fd < t->cap_connections && n_fds < HANDOFF_BATCH;
+            next_fd++)
+        {
+            struct connection* c = t->connections[next_fd];
+
+            if (c == NULL || !c->in_use)
+            {
+                continue;
+            }
+
+            if (c->dict_id != 0)
+            {
+                fds[n_fds] = -1 - c->fd;
+                n_fds++;
+                continue;
+            }
+
+            uint8_t* e = entries + n_fds * HANDOFF_CONNECTION_SZ;
+            e[0] = c->flags;
+            e[1] = c->local;
+            memcpy(e + 2, &c->addr.sin_addr.s_addr, 4);
+            memcpy(e + 6, &c->addr.sin_port, 2);
+
+            fds[n_fds] = c->fd;
+            n_fds++;
+        }
+
+        pthread_mutex_unlock(&t->lock);
+
+        if (n_fds == 0)
+        {
+            break;
+        }
+
+        // the closed ones were marked with negative descriptors
+        int passed[HANDOFF_BATCH];
+        uint8_t passed_entries[HANDOFF_BATCH * HANDOFF_CONNECTION_SZ];
+        size_t n_passed = 0;
+
+        for (size_t i = 0; i < n_fds; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                memcpy(passed_entries + n_passed * HANDOFF_CONNECTION_SZ,
+                    entries + i * HANDOFF_CONNECTION_SZ,
+                    HANDOFF_CONNECTION_SZ);
+                passed[n_passed] = fds[i];
+                n_passed++;
+            }
+        }
+
+        if (n_passed > 0 &&
+            send_handoff_msg(fd, HANDOFF_CONNECTIONS, passed_entries,
+                n_passed, HANDOFF_CONNECTION_SZ, passed, n_passed) < 0)
+        {
+            perror("failed to pass connections on");
+        }
+
+        // the sockets live on in the successor, so they are only closed here
+        // and not shut down
+        for (size_t i = 0; i < n_fds; i++)
+        {
+            int client_socket = fds[i] >= 0 ? fds[i] : -1 - fds[i];
+            struct epoll_event event;
+
+            unregister_connection(t, client_socket);
+            epoll_ctl(s_info->epfd, EPOLL_CTL_DEL, client_socket, &event);
+            close(client_socket);
+        }
+    }
+}
+
+
+// forks and execs the successor with its end of the handoff socket.
+// Returns its pid, or -1 if it couldn't be started
+static pid_t spawn_successor(struct server_info* s_info, int child_fd)
+{
+    // everything the child needs is prepared first, only async signal safe
+    // calls can be made between fork and exec
+    size_t n_env = 0;
+    while (environ[n_env] != NULL)
+    {
+        n_env++;
+    }
+
+    char** envp = malloc(sizeof(*envp)*(n_env + 2));
+    char handoff_var[64];
+    size_t n_envp = 0;
+
+    for (size_t i = 0; i < n_env; i++)
+    {
+        if (strncmp(environ[i], HANDOFF_ENV "=", strlen(HANDOFF_ENV) + 1) != 0)
+        {
+            envp[n_envp] = environ[i];
+            n_envp++;
+        }
+    }
+
+    snprintf(handoff_var, sizeof(handoff_var), "%s=%d", HANDOFF_ENV,
+            HANDOFF_FD);
+    envp[n_envp] = handoff_var;
+    envp[n_envp + 1] = NULL;
+
+    struct rlimit rl;
+    int max_fd = 1024;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    {
+        max_fd = rl.rlim_cur;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        dup2(child_fd, HANDOFF_FD);
+
+        // the successor only inherits what is handed to it explicitly
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, HANDOFF_FD + 1, ~0U, 0) < 0)
+#endif
+        {
+            for (int i = HANDOFF_FD + 1; i < max_fd; i++)
+            {
+                close(i);
+            }
+        }
+
+        execve(s_info->exe_path, s_info->argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+
+    if (pid < 0)
+    {
+        perror("failed to start the successor");
+    }
+
+    return pid;
+}
+
+
+// replaces this process with a freshly exec'd one without dropping any
+// connection. Returns false if the restart had to be called off, and true
+// once everything has been handed over and this process should exit
+bool graceful_restart(struct server_info* s_info)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+    {
+        perror("failed to create the handoff socket");
+        return false;
+    }
+
+    pid_t pid = spawn_successor(s_info, fds[1]);
+    close(fds[1]);
+
+    int fd = fds[0];
+
+    if (pid < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    if (send_checksums(s_info, fd) < 0 ||
+        send_listeners(s_info, fd) < 0 || wait_ready(fd) < 0)
+    {
+        fputs("the successor didn't take over, restart called off\n", stderr);
+
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(fd);
+        return false;
+    }
+
+    // the successor accepts the new connections from here on
+    stop_accepter(s_info);
+    drain_workers(s_info);
+    send_connections(s_info, fd);
+
+    send_handoff_msg(fd, HANDOFF_DONE, NULL, 0, 0, NULL, 0);
+    close(fd);
+
+    s_info->handed_off = true;
+
+    return true;
+}
+
+
+static void apply_checksums(struct server_info* s_info, uint8_t* entries,
+    uint32_t n_entries)
+{
+    for (uint32_t i = 0; i < n_entries; i++)
+    {
+        uint8_t* e = entries + i * HANDOFF_CHECKSUM_SZ;
+        struct stat st = {0};
+        uint32_t crc;
+
+        st.st_dev = get_be64(e);
+        st.st_ino = get_be64(e + 8);
+        st.st_mtim.tv_sec = get_be64(e + 16);
+        st.st_mtim.tv_nsec = get_be64(e + 24);
+        st.st_size = get_be64(e + 32);
+        memcpy(&crc, e + 56, 4);
+
+        checksum_cache_put(s_info->checksums, &st, get_be64(e + 40),
+                        get_be64(e + 48), be32toh(crc));
+    }
+}
+
+
+// takes over the checksum cache and the listening sockets of the process
+// being replaced
+int receive_handoff_state(struct server_info* s_info)
+{
+    size_t cap = HANDOFF_HEADER_SZ + HANDOFF_ENTRIES * HANDOFF_SESSION_SZ;
+    uint8_t* buf = malloc(sizeof(*buf)*cap);
+    int fds[HANDOFF_BATCH];
+    size_t n_fds;
+    uint32_t n_entries;
+    int ret = -1;
+
+    while (true)
+    {
+        int type = recv_handoff_msg(s_info->handoff_fd, buf, cap,
+                                &n_entries, fds, &n_fds);
+
+        // an earlier version sends its session table, which is no longer
+        // kept
+        if (type == HANDOFF_SESSIONS)
+        {
+            continue;
+        }
+        else if (type == HANDOFF_CHECKSUMS)
+        {
+            apply_checksums(s_info, buf + HANDOFF_HEADER_SZ, n_entries);
+        }
+        else if (type == HANDOFF_LISTENERS)
+        {
+            s_info->n_nodes = 0;
+
+            for (size_t i = 0; i < n_fds && i < n_entries; i++)
+            {
+                if (buf[HANDOFF_HEADER_SZ + i] == HANDOFF_LISTENER_UNIX)
+                {
+                    s_info->unix_socket = fds[i];
+                }
+                else if (s_info->n_nodes < MAX_NUMA_NODES)
+                {
+                    s_info->node_sockets[s_info->n_nodes] = fds[i];
+                    s_info->n_nodes++;
+                }
+                else
+                {
+                    close(fds[i]);
+                }
+            }
+
+            s_info->server_socket = s_info->node_sockets[0];
+            ret = s_info->n_nodes > 0 ? 0 : -1;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+
+// reports to the process being replaced that this one is accepting, and
+// takes over its connections as it lets go of them
+void receive_handoff_connections(struct server_info* s_info)
+{
+    int fd = s_info->handoff_fd;
+    uint8_t buf[HANDOFF_HEADER_SZ + HANDOFF_BATCH * HANDOFF_CONNECTION_SZ];
+    int fds[HANDOFF_BATCH];
+    size_t n_fds;
+    uint32_t n_entries;
+
+    if (send_handoff_msg(fd, HANDOFF_READY, NULL, 0, 0, NULL, 0) < 0)
+    {
+        perror("failed to report ready");
+    }
+
+    while (recv_handoff_msg(fd, buf, sizeof(buf), &n_entries, fds,
+            &n_fds) == HANDOFF_CONNECTIONS)
+    {
+        for (size_t i = 0; i < n_fds; i++)
+        {
+            struct sockaddr_in addr = {0};
+            struct epoll_event event;
+
+            if (i >= n_entries)
+            {
+                close(fds[i]);
+                continue;
+            }
+
+            uint8_t* e = buf + HANDOFF_HEADER_SZ + i * HANDOFF_CONNECTION_SZ;
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_addr.s_addr, e + 2, 4);
+            memcpy(&addr.sin_port, e + 6, 2);
+
+            // which node received the connection is no longer known
+            if (!register_connection(&s_info->connections, fds[i], &addr,
+                    e[1], fds[i] % s_info->n_nodes))
+            {
+                reject_connection(fds[i]);
+                continue;
+            }
+
+            set_connection_flags(&s_info->connections, fds[i],
+                            e[0] & CONNECTION_FLAGS_MASK);
+
+            if (!e[1] && s_info->options.zerocopy_min_bytes > 0)
+            {
+                enable_connection_zerocopy(&s_info->connections, fds[i]);
+            }
+
+            // a request which arrived meanwhile is still waiting to be read
+            event.data.fd = fds[i];
+            event.events = EPOLLIN | EPOLLONESHOT;
+            epoll_ctl(s_info->epfd, EPOLL_CTL_ADD, fds[i], &event);
+        }
+    }
+
+    close(fd);
+    s_info->handoff_fd = -1;
+}
@@ -0,0 +1,72 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+#include "requests.h"
+
+
+// the successor finds its end of the handoff socket in this descriptor,
+// named by this environment variable
+#define HANDOFF_ENV "MT_HANDOFF_FD"
+#define HANDOFF_FD (3)
+
+// how long the successor may take to get ready before the restart is
+// called off
+#define HANDOFF_TIMEOUT_MS (10 * 1000)
+
+// descriptors, and checksum entries, sent in one message
+#define HANDOFF_BATCH (64)
+#define HANDOFF_ENTRIES (256)
+
+// every message starts with its type and the number of entries it holds
+#define HANDOFF_HEADER_SZ (1 + 4)
+#define HANDOFF_SESSIONS (0x1)
+#define HANDOFF_CHECKSUMS (0x2)
+#define HANDOFF_LISTENERS (0x3)
+#define HANDOFF_READY (0x4)
+#define HANDOFF_CONNECTIONS (0x5)
+#define HANDOFF_DONE (0x6)
+
+// session id, start offset, length and file name of a file request. Only
+// earlier versions send them, the entries are sized to take theirs in
+#define HANDOFF_SESSION_SZ (4 + 8 + 8 + MAX_FILE_NAME)
+
+// device, inode, mtime, file size, start offset and length of a range,
+// followed by its checksum
+#define HANDOFF_CHECKSUM_SZ (8 * 7 + 4)
+
+// flags, whether it's local, and the address of a connection
+#define HANDOFF_CONNECTION_SZ (1 + 1 + 4 + 2)
+
+// kinds of listening socket
+#define HANDOFF_LISTENER_TCP (0x0)
+#define HANDOFF_LISTENER_UNIX (0x1)
+
+
+
+int handoff_fd_from_env();
+
+void install_restart_handler(struct server_info* s_info);
+
+bool take_restart_request();
+
+bool graceful_restart(struct server_info* s_info);
+
+int receive_handoff_state(struct server_info* s_info);
+
+void receive_handoff_connections(struct server_info* s_info);
+
+#endif
@@ -0,0 +1,379 @@
+#include "hugepage.h"
+
+// This file contains the pool of huge pages large buffers are taken from.
+// The encode and decode buffers, file data and cached chunks run to
+// megabytes, and walking them through 4KB pages costs a TLB miss every few
+// thousand bytes. The pool is one region of 2MB pages, reserved ones if the
+// system has any set aside and transparent ones otherwise, handed out in
+// runs of whole pages. With the workers split between numa nodes it is one
+// region per node instead, bound to it, and a buffer is taken from the
+// region of the node it is allocated on. Buffers that are small, or don't
+// fit in what is left of it, come from the heap as before, and
+// free_buffer() takes either. Buffers of either kind can be held while the
+// kernel may still send from them, freeing a held buffer is put off until
+// its holds are released.
+
+
+static struct buffer_pool pools[MAX_NUMA_NODES];
+static size_t n_pools;
+static struct buffer_holds holds = {PTHREAD_MUTEX_INITIALIZER};
+
+
+// maps a region of the pool, from the reserved huge pages if there are
+// enough of them, otherwise as a 2MB aligned region the kernel is asked to
+// back with transparent huge pages. The region is bound to its node before
+// anything faults it in. Returns -1 if neither can be had
+static int map_pool(struct buffer_pool* pool, size_t n_pages, bool prefault,
+    struct numa_topology* topo, size_t node)
+{
+    size_t len = n_pages * HUGE_PAGE_SZ;
+
+    pool->base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (pool->base == MAP_FAILED)
+    {
+        uint8_t* region = mmap(NULL, len + HUGE_PAGE_SZ,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (region == MAP_FAILED)
+        {
+            perror("buffer pool could not be mapped");
+            pool->base = NULL;
+            return -1;
+        }
+
+        size_t lead = (HUGE_PAGE_SZ - (uintptr_t) region % HUGE_PAGE_SZ) %
+                    HUGE_PAGE_SZ;
+
+        if (lead > 0)
+        {
+            munmap(region, lead);
+        }
+
+        munmap(region + lead + len, HUGE_PAGE_SZ - lead);
+        pool->base = region + lead;
+
+        // without transparent huge pages the pool is still a pool, just of
+        // small pages
+        madvise(pool->base, len, MADV_HUGEPAGE);
+    }
+
+    pool->node_id = -1;
+
+    if (topo != NULL)
+    {
+        if (bind_to_node(topo, node, pool->base, len) == 0)
+        {
+            pool->node_id = numa_node_id(topo, node);
+        }
+        else
+        {
+            perror("buffer pool could not be bound to its node");
+        }
+    }
+
+    if (prefault)
+    {
+        memset(pool->base, 0, len);
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->n_pages = n_pages;
+    pool->run_pages = calloc(n_pages, sizeof(*pool->run_pages));
+    pool->used = calloc(n_pages, sizeof(*pool->used));
+
+    return 0;
+}
+
+
+// maps the pool, split evenly between the nodes of topo if it isn't NULL.
+// Nothing is pooled where it can't be mapped
+void init_buffer_pool(uint64_t bytes, bool prefault,
+    struct numa_topology* topo)
+{
+    size_t n_nodes = topo != NULL ? numa_nodes(topo) : 1;
+    size_t n_pages = bytes / HUGE_PAGE_SZ / n_nodes;
+
+    if (n_pages == 0)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+        if (map_pool(&pools[i], n_pages, prefault, topo, i) < 0)
+        {
+            break;
+        }
+
+        n_pools++;
+    }
+}
+
+
+// the region a buffer was taken from, NULL if it came from the heap
+static struct buffer_pool* pool_of(void* buffer)
+{
+    for (size_t i = 0; i < n_pools; i++)
+    {
+        if ((uint8_t*) buffer >= pools[i].base &&
+            (uint8_t*) buffer < pools[i].base + pools[i].n_pages *
+            HUGE_PAGE_SZ)
+        {
+            return &pools[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+// the region of the node the calling thread runs on, NULL if there is none
+static struct buffer_pool* local_pool()
+{
+    unsigned int node_id;
+
+    if (n_pools < 2)
+    {
+        return n_pools == 1 ? &pools[0] : NULL;
+    }
+
+    if (syscall(SYS_getcpu, NULL, &node_id, NULL) < 0)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n_pools; i++)
+    {
+        if (pools[i].node_id == (int) node_id)
+        {
+            return &pools[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+// takes the first run of free pages large enough for size, returns NULL if
+// there is none
+static void* pool_alloc(struct buffer_pool* pool, size_t size)
+{
+    size_t n_pages = (size + HUGE_PAGE_SZ - 1) / HUGE_PAGE_SZ;
+    size_t run = 0;
+    void* buffer = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (size_t i = 0; i < pool->n_pages; i++)
+    {
+        run = pool->used[i] ? 0 : run + 1;
+
+        if (run == n_pages)
+        {
+            size_t start = i + 1 - n_pages;
+
+            memset(pool->used + start, true, n_pages);
+            pool->run_pages[start] = n_pages;
+            buffer = pool->base + start * HUGE_PAGE_SZ;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return buffer;
+}
+
+
+// a buffer from the pool of the calling thread's node, the heap is used
+// rather than another node's pool, a malloc arena places it locally too
+void* alloc_buffer(size_t size)
+{
+    void* buffer = NULL;
+    struct buffer_pool* pool = size >= MIN_POOLED_BUFFER ? local_pool() :
+                                NULL;
+
+    if (pool != NULL)
+    {
+        buffer = pool_alloc(pool, size);
+    }
+
+    return buffer != NULL ? buffer : malloc(size > 0 ? size : 1);
+}
+
+
+void* alloc_zeroed_buffer(size_t size)
+{
+    void* buffer = NULL;
+    struct buffer_pool* pool = size >= MIN_POOLED_BUFFER ? local_pool() :
+                                NULL;
+
+    if (pool != NULL)
+    {
+        buffer = pool_alloc(pool, size);
+    }
+
+    if (buffer != NULL)
+    {
+        return memset(buffer, 0, size);
+    }
+
+    return calloc(size > 0 ? size : 1, 1);
+}
+
+
+// grows or shrinks a buffer of either kind. A pooled buffer stays where it
+// is as long as its pages have room
+void* realloc_buffer(void* buffer, size_t size)
+{
+    struct buffer_pool* pool = pool_of(buffer);
+
+    if (pool == NULL)
+    {
+        return realloc(buffer, size > 0 ? size : 1);
+    }
+
+    size_t page = ((uint8_t*) buffer - pool->base) / HUGE_PAGE_SZ;
+
+    pthread_mutex_lock(&pool->lock);
+    size_t cap = pool->run_pages[page] * HUGE_PAGE_SZ;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (size <= cap)
+    {
+        return buffer;
+    }
+
+    void* moved = alloc_buffer(size);
+    memcpy(moved, buffer, cap);
+    free_buffer(buffer);
+
+    return moved;
+}
+
+
+static struct buffer_hold** find_hold(void* buffer)
+{
+    struct buffer_hold** h = &holds.buckets[((uintptr_t) buffer >> 4) %
+                                            N_HOLD_BUCKETS];
+
+    while (*h != NULL && (*h)->buffer != buffer)
+    {
+        h = &(*h)->next;
+    }
+
+    return h;
+}
+
+
+// keeps a buffer from being reused until release_buffer() is called as
+// many times as it was held, freeing it in between is put off until then
+void hold_buffer(void* buffer)
+{
+    pthread_mutex_lock(&holds.lock);
+
+    struct buffer_hold** h = find_hold(buffer);
+
+    if (*h == NULL)
+    {
+        *h = calloc(1, sizeof(**h));
+        (*h)->buffer = buffer;
+        atomic_fetch_add(&holds.n_held, 1);
+    }
+
+    (*h)->n_holds++;
+
+    pthread_mutex_unlock(&holds.lock);
+}
+
+
+void release_buffer(void* buffer)
+{
+    bool freed = false;
+
+    pthread_mutex_lock(&holds.lock);
+
+    struct buffer_hold** h = find_hold(buffer);
+
+    if (*h != NULL && --(*h)->n_holds == 0)
+    {
+        struct buffer_hold* released = *h;
+
+        *h = released->next;
+        freed = released->freed;
+        free(released);
+        atomic_fetch_sub(&holds.n_held, 1);
+    }
+
+    pthread_mutex_unlock(&holds.lock);
+
+    if (freed)
+    {
+        free_buffer(buffer);
+    }
+}
+
+
+// puts off freeing a held buffer, returns false if it isn't held
+static bool defer_free(void* buffer)
+{
+    pthread_mutex_lock(&holds.lock);
+
+    struct buffer_hold** h = find_hold(buffer);
+    bool held = *h != NULL;
+
+    if (held)
+    {
+        (*h)->freed = true;
+    }
+
+    pthread_mutex_unlock(&holds.lock);
+
+    return held;
+}
+
+
+// gives a buffer back to the pool, or to the heap if it came from there
+void free_buffer(void* buffer)
+{
+    if (atomic_load(&holds.n_held) > 0 && defer_free(buffer))
+    {
+        return;
+    }
+
+    struct buffer_pool* pool = pool_of(buffer);
+
+    if (pool == NULL)
+    {
+        free(buffer);
+        return;
+    }
+
+    size_t page = ((uint8_t*) buffer - pool->base) / HUGE_PAGE_SZ;
+
+    pthread_mutex_lock(&pool->lock);
+
+    memset(pool->used + page, false, pool->run_pages[page]);
+    pool->run_pages[page] = 0;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void free_buffer_pool()
+{
+    for (size_t i = 0; i < n_pools; i++)
+    {
+        munmap(pools[i].base, pools[i].n_pages * HUGE_PAGE_SZ);
+        pthread_mutex_destroy(&pools[i].lock);
+        free(pools[i].run_pages);
+        free(pools[i].used);
+
+        pools[i].base = NULL;
+    }
+
+    n_pools = 0;
+}
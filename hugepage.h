@@ -0,0 +1,83 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "numa.h"
+
+
+#define HUGE_PAGE_SZ (2 * 1024 * 1024)
+
+// bytes of huge pages set aside for large buffers, 0 keeps them all on the
+// heap
+#define HUGEPAGE_POOL (0)
+
+// whether the pool is faulted in at startup rather than on first use
+#define HUGEPAGE_PREFAULT (false)
+
+// buffers smaller than this come from the heap, a huge page would mostly
+// go to waste on them
+#define MIN_POOLED_BUFFER (HUGE_PAGE_SZ / 2)
+
+#define N_HOLD_BUCKETS (64)
+
+
+// a region of huge pages handed out in runs of whole pages, placed on the
+// numa node of the given id, or anywhere if it is -1
+struct buffer_pool {
+    pthread_mutex_t lock;
+    int node_id;
+    uint8_t* base;
+    size_t n_pages;
+
+    // pages of the buffer starting at every page, 0 where none starts
+    uint32_t* run_pages;
+    bool* used;
+};
+
+// a buffer that must not be reused yet, e.g. while the kernel may still
+// send from it. Freeing it only takes effect once its last hold is released
+struct buffer_hold {
+    void* buffer;
+    uint32_t n_holds;
+    bool freed;
+    struct buffer_hold* next;
+};
+
+struct buffer_holds {
+    pthread_mutex_t lock;
+    struct buffer_hold* buckets[N_HOLD_BUCKETS];
+
+    // buffers held, free_buffer only looks them up when there are any
+    atomic_size_t n_held;
+};
+
+
+
+void init_buffer_pool(uint64_t bytes, bool prefault,
+    struct numa_topology* topo);
+
+void* alloc_buffer(size_t size);
+
+void* alloc_zeroed_buffer(size_t size);
+
+void* realloc_buffer(void* buffer, size_t size);
+
+void free_buffer(void* buffer);
+
+void hold_buffer(void* buffer);
+
+void release_buffer(void* buffer);
+
+void free_buffer_pool();
+
+#endif
@@ -0,0 +1,98 @@
+#include "memory.h"
+
+// This file contains the memory governor. Every buffer a request needs is
+// reserved against a server wide budget before it is allocated and released
+// once the request has been handled. A request that doesn't fit waits for
+// other requests to release theirs, and is rejected if that takes too long,
+// so a few huge requests can't take the server past its memory.
+
+
+struct memory_governor* create_memory_governor(uint64_t budget,
+    uint64_t wait_ms)
+{
+    struct memory_governor* g = calloc(1, sizeof(*g));
+
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->freed_cond, NULL);
+
+    if (budget == 0)
+    {
+        budget = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4;
+    }
+
+    g->budget = budget;
+    g->in_use = 0;
+    g->wait_ms = wait_ms;
+
+    return g;
+}
+
+
+// reserves bytes of the budget, waiting for them to be released by other
+// requests if need be. Returns false if they can't be had in time, or
+// ever, in which case nothing is reserved
+bool reserve_memory(struct memory_governor* g, uint64_t bytes)
+{
+    if (bytes > g->budget)
+    {
+        return false;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    deadline.tv_sec += g->wait_ms / 1000;
+    deadline.tv_nsec += (g->wait_ms % 1000) * 1000000;
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&g->lock);
+
+    while (g->in_use + bytes > g->budget)
+    {
+        if (pthread_cond_timedwait(&g->freed_cond, &g->lock, &deadline) ==
+            ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    bool reserved = g->in_use + bytes <= g->budget;
+
+    if (reserved)
+    {
+        g->in_use += bytes;
+    }
+
+    pthread_mutex_unlock(&g->lock);
+
+    return reserved;
+}
+
+
+void release_memory(struct memory_governor* g, uint64_t bytes)
+{
+    if (bytes == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g->lock);
+
+    g->in_use -= bytes;
+    pthread_cond_broadcast(&g->freed_cond);
+
+    pthread_mutex_unlock(&g->lock);
+}
+
+
+void free_memory_governor(struct memory_governor* g)
+{
+    pthread_cond_destroy(&g->freed_cond);
+    pthread_mutex_destroy(&g->lock);
+    free(g);
+}
@@ -0,0 +1,43 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+
+// bytes the buffers of all requests in flight may add up to, 0 picks a
+// quarter of the physical memory
+#define MEMORY_BUDGET (0)
+
+// how long a request waits for memory to be freed up before it is rejected
+#define MEMORY_WAIT_MS (1000)
+
+
+struct memory_governor {
+    pthread_mutex_t lock;
+    pthread_cond_t freed_cond;
+
+    uint64_t budget;
+    uint64_t in_use;
+    uint64_t wait_ms;
+};
+
+
+
+struct memory_governor* create_memory_governor(uint64_t budget,
+    uint64_t wait_ms);
+
+bool reserve_memory(struct memory_governor* g, uint64_t bytes);
+
+void release_memory(struct memory_governor* g, uint64_t bytes);
+
+void free_memory_governor(struct memory_governor* g);
+
+#endif
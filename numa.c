@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+
+// This file contains the numa placement. The nodes and their cpus are read
+// from sysfs. Each node gets its own workers, pinned to its cpus, and its
+// own listener in a SO_REUSEPORT group whose steering program hands a new
+// connection to the listener of the node whose cpu received it. The
+// connection is then handled entirely on that node, its buffers are
+// allocated and first touched by the node's workers and the file data it
+// reads is paged in there. The huge page pool is split between the nodes
+// too, every node's share is bound to it.
+
+
+// the nodes of the machine which have cpus this process may run on,
+// numbered from 0 in the order of their ids
+struct numa_topology {
+    size_t n_nodes;
+    cpu_set_t cpus[MAX_NUMA_NODES];
+
+    // the kernel's id of every node
+    int node_ids[MAX_NUMA_NODES];
+
+    // node of every cpu of the machine, -1 for cpus of no node or of one
+    // the process can't run on
+    int node_of_cpu[CPU_SETSIZE];
+};
+
+
+// reads a sysfs list such as "0-3,8-11" into a set, returns false if the
+// file can't be read
+static bool read_sysfs_list(char* path, cpu_set_t* set)
+{
+    char line[MAX_CPULIST_LINE];
+
+    CPU_ZERO(set);
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+
+    if (fgets(line, sizeof(line), f) == NULL)
+    {
+        line[0] = '\0';
+    }
+
+    fclose(f);
+
+    char* p = line;
+
+    while (*p >= '0' && *p <= '9')
+    {
+        unsigned long first = strtoul(p, &p, 10);
+        unsigned long last = first;
+
+        if (*p == '-')
+        {
+            last = strtoul(p + 1, &p, 10);
+        }
+
+        for (unsigned long i = first; i <= last && i < CPU_SETSIZE; i++)
+        {
+            CPU_SET(i, set);
+        }
+
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+
+    return true;
+}
+
+
+// returns the nodes of the machine, or NULL if there is only the one, in
+// which case nothing needs placing
+struct numa_topology* load_numa_topology()
+{
+    cpu_set_t online;
+    cpu_set_t allowed;
+    cpu_set_t cpus;
+    char path[128];
+
+    if (!read_sysfs_list(NUMA_SYSFS_DIR "/online", &online) ||
+        sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        return NULL;
+    }
+
+    struct numa_topology* topo = calloc(1, sizeof(*topo));
+
+    for (size_t i = 0; i < CPU_SETSIZE; i++)
+    {
+        topo->node_of_cpu[i] = -1;
+    }
+
+    for (size_t id = 0; id < CPU_SETSIZE; id++)
+    {
+        if (!CPU_ISSET(id, &online) || topo->n_nodes == MAX_NUMA_NODES)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), NUMA_SYSFS_DIR "/node%zu/cpulist", id);
+
+        if (!read_sysfs_list(path, &cpus))
+        {
+            continue;
+        }
+
+        // memory only nodes and ones the process is kept off have no
+        // workers to give connections to
+        CPU_AND(&cpus, &cpus, &allowed);
+
+        if (CPU_COUNT(&cpus) == 0)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < CPU_SETSIZE; i++)
+        {
+            if (CPU_ISSET(i, &cpus))
+            {
+                topo->node_of_cpu[i] = topo->n_nodes;
+            }
+        }
+
+        topo->cpus[topo->n_nodes] = cpus;
+        topo->node_ids[topo->n_nodes] = id;
+        topo->n_nodes++;
+    }
+
+    if (topo->n_nodes < 2)
+    {
+        free(topo);
+        return NULL;
+    }
+
+    return topo;
+}
+
+
+size_t numa_nodes(struct numa_topology* topo)
+{
+    return topo->n_nodes;
+}
+
+
+// the kernel's id of a node, which getcpu() reports
+int numa_node_id(struct numa_topology* topo, size_t node)
+{
+    return node < topo->n_nodes ? topo->node_ids[node] : -1;
+}
+
+
+// places the pages of a region not touched yet on a node, whichever thread
+// faults them in
+int bind_to_node(struct numa_topology* topo, size_t node, void* addr,
+    size_t len)
+{
+    unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+    size_t bits = 8 * sizeof(*mask);
+
+    if (node >= topo->n_nodes)
+    {
+        return -1;
+    }
+
+    mask[topo->node_ids[node] / bits] |= 1UL << (topo->node_ids[node] % bits);
+
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, mask, CPU_SETSIZE + 1,
+                0) == 0 ? 0 : -1;
+}
+
+
+// restricts the calling thread to the cpus of a node
+int pin_thread_to_node(struct numa_topology* topo, size_t node)
+{
+    if (node >= topo->n_nodes)
+    {
+        return -1;
+    }
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(topo->cpus[node]),
+                                &topo->cpus[node]) == 0 ? 0 : -1;
+}
+
+
+// attaches the program picking the listener of a SO_REUSEPORT group a new
+// connection goes to. The listeners must have joined the group in node
+// order, connections received on cpus of no node are spread by hash
+int attach_node_steering(struct numa_topology* topo, int listen_socket)
+{
+    size_t n_cpus = 0;
+
+    for (size_t i = 0; i < CPU_SETSIZE; i++)
+    {
+        n_cpus += topo->node_of_cpu[i] >= 0;
+    }
+
+    struct sock_filter* code = malloc(sizeof(*code)*(2 * n_cpus + 2));
+    size_t n_code = 0;
+
+    code[n_code++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                            SKF_AD_OFF + SKF_AD_CPU);
+
+    for (size_t i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (topo->node_of_cpu[i] < 0)
+        {
+            continue;
+        }
+
+        code[n_code++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ |
+                                                BPF_K, i, 0, 1);
+        code[n_code++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K,
+                                                topo->node_of_cpu[i]);
+    }
+
+    // an index past the group makes the kernel fall back to the hash
+    code[n_code++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K,
+                                                UINT32_MAX);
+
+    struct sock_fprog prog;
+    prog.len = n_code;
+    prog.filter = code;
+
+    int ret = setsockopt(listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                        &prog, sizeof(prog));
+    free(code);
+
+    return ret;
+}
+
+
+void free_numa_topology(struct numa_topology* topo)
+{
+    free(topo);
+}
@@ -0,0 +1,44 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+
+// whether the workers and listeners are split between the numa nodes by
+// default
+#define NUMA_AWARE (false)
+
+// nodes told apart, the cpus of any further ones are treated as nodeless
+#define MAX_NUMA_NODES (16)
+
+#define NUMA_SYSFS_DIR "/sys/devices/system/node"
+#define MAX_CPULIST_LINE (4096)
+
+
+// the nodes of the machine, kept opaque since cpu sets need _GNU_SOURCE
+// which the rest of the server isn't built with
+struct numa_topology;
+
+
+
+struct numa_topology* load_numa_topology();
+
+size_t numa_nodes(struct numa_topology* topo);
+
+int numa_node_id(struct numa_topology* topo, size_t node);
+
+int bind_to_node(struct numa_topology* topo, size_t node, void* addr,
+    size_t len);
+
+int pin_thread_to_node(struct numa_topology* topo, size_t node);
+
+int attach_node_steering(struct numa_topology* topo, int listen_socket);
+
+void free_numa_topology(struct numa_topology* topo);
+
+#endif
@@ -0,0 +1,371 @@
+#include "prefetch.h"
+#include "compression.h"
+#include "sidecar.h"
+
+// This file contains the read ahead of sequential chunked downloads.
+// Every file retrieval is noted against its (session, file) stream, and once
+// a stream is seen moving forward chunk by chunk the next chunk is handed to
+// a background thread. It asks the kernel to start reading that range and,
+// when the session wants compressed responses, builds the compressed payload
+// so that the worker only has to send it.
+
+
+struct prefetcher* create_prefetcher(struct server_info* s_info)
+{
+    struct prefetcher* p = calloc(1, sizeof(*p));
+
+    p->s_info = s_info;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->job_cond, NULL);
+
+    pthread_create(&p->thread, NULL, prefetch_thread, (void*) p);
+
+    return p;
+}
+
+
+static bool same_chunk(struct prefetch_job* job, uint32_t session_id,
+    char* file_name, uint64_t start_offset, uint64_t n_bytes)
+{
+    return job->session_id == session_id &&
+            job->start_offset == start_offset &&
+            job->n_bytes == n_bytes &&
+            strcmp(job->file_name, file_name) == 0;
+}
+
+
+// returns the stream of a session and file, recycling the least recently
+// used stream if it is not tracked yet
+static struct stream* find_stream(struct prefetcher* p, uint32_t session_id,
+    char* file_name)
+{
+    struct stream* oldest = &p->streams[0];
+
+    for (size_t i = 0; i < N_STREAMS; i++)
+    {
+        struct stream* s = &p->streams[i];
+
+        if (s->in_use && s->session_id == session_id &&
+            strcmp(s->file_name, file_name) == 0)
+        {
+            return s;
+        }
+
+        if (!s->in_use || (oldest->in_use && s->last_used < oldest->last_used))
+        {
+            oldest = s;
+        }
+    }
+
+    oldest->in_use = true;
+    oldest->session_id = session_id;
+    oldest->next_offset = UINT64_MAX;
+    oldest->hits = 0;
+    strcpy(oldest->file_name, file_name);
+
+    return oldest;
+}
+
+
+// checks whether the chunk is already queued or already prefetched
+static bool is_chunk_pending(struct prefetcher* p, struct prefetch_job* job)
+{
+    for (size_t i = 0; i < p->n_jobs; i++)
+    {
+        struct prefetch_job* queued =
+                &p->jobs[(p->job_head + i) % MAX_PREFETCH_JOBS];
+
+        if (same_chunk(queued, job->session_id, job->file_name,
+                        job->start_offset, job->n_bytes))
+        {
+            return true;
+        }
+    }
+
+    for (size_t i = 0; i < N_PREFETCHED; i++)
+    {
+        if (p->entries[i].in_use &&
+            same_chunk(&p->entries[i].job, job->session_id, job->file_name,
+                        job->start_offset, job->n_bytes))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// records a chunk being served and queues the following chunk for read ahead
+// once the stream looks sequential
+void prefetch_note_access(struct prefetcher* p, uint32_t session_id,
+    char* file_name, uint64_t start_offset, uint64_t n_bytes, bool compress,
+    uint64_t file_size)
+{
+    if (strlen(file_name) >= MAX_FILE_NAME || n_bytes == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    struct stream* s = find_stream(p, session_id, file_name);
+
+    if (s->next_offset == start_offset)
+    {
+        s->hits++;
+    }
+    else
+    {
+        s->hits = 0;
+    }
+
+    s->next_offset = start_offset + n_bytes;
+    s->last_used = ++p->clock;
+
+    // a download starting at the beginning of a file is assumed to carry on
+    bool sequential = s->hits >= SEQUENTIAL_HITS || start_offset == 0;
+
+    if (!sequential || s->next_offset >= file_size ||
+        p->n_jobs == MAX_PREFETCH_JOBS)
+    {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    struct prefetch_job job;
+    job.session_id = session_id;
+    job.start_offset = s->next_offset;
+    job.n_bytes = n_bytes;
+    job.compress = compress;
+    strcpy(job.file_name, file_name);
+
+    // the last chunk of a file is usually shorter
+    if (job.start_offset + job.n_bytes > file_size)
+    {
+        job.n_bytes = file_size - job.start_offset;
+    }
+
+    if (!is_chunk_pending(p, &job))
+    {
+        p->jobs[(p->job_head + p->n_jobs) % MAX_PREFETCH_JOBS] = job;
+        p->n_jobs++;
+
+        pthread_cond_signal(&p->job_cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+// hands over the pre-encoded payload of a chunk if one was built from the
+// current version of the file. The caller becomes the owner of the payload
+bool prefetch_take(struct prefetcher* p, uint32_t session_id, char* file_name,
+    uint64_t start_offset, uint64_t n_bytes, struct stat* st,
+    uint8_t** payload, uint64_t* payload_len)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (size_t i = 0; i < N_PREFETCHED; i++)
+    {
+        struct prefetched* e = &p->entries[i];
+
+        if (!e->in_use ||
+            !same_chunk(&e->job, session_id, file_name, start_offset, n_bytes))
+        {
+            continue;
+        }
+
+        // file has changed since the chunk was read
+        if (e->file_size == st->st_size &&
+            e->mtime.tv_sec == st->st_mtim.tv_sec &&
+            e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+        {
+            *payload = e->payload;
+            *payload_len = e->payload_len;
+            found = true;
+        }
+        else
+        {
+            free_buffer(e->payload);
+        }
+
+        p->cached_bytes -= e->payload_len;
+        e->in_use = false;
+        e->payload = NULL;
+        break;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return found;
+}
+
+
+// stores a pre-encoded chunk, evicting the least recently built chunks when
+// there isn't enough room
+static void store_prefetched(struct prefetcher* p, struct prefetch_job* job,
+    struct stat* st, uint8_t* payload, uint64_t payload_len)
+{
+    pthread_mutex_lock(&p->lock);
+
+    while (true)
+    {
+        struct prefetched* free_slot = NULL;
+        struct prefetched* oldest = NULL;
+
+        for (size_t i = 0; i < N_PREFETCHED; i++)
+        {
+            struct prefetched* e = &p->entries[i];
+
+            if (!e->in_use)
+            {
+                free_slot = e;
+            }
+            else if (oldest == NULL || e->last_used < oldest->last_used)
+            {
+                oldest = e;
+            }
+        }
+
+        if (free_slot != NULL &&
+            p->cached_bytes + payload_len <= MAX_PREFETCH_BYTES)
+        {
+            free_slot->in_use = true;
+            free_slot->job = *job;
+            free_slot->mtime = st->st_mtim;
+            free_slot->file_size = st->st_size;
+            free_slot->payload = payload;
+            free_slot->payload_len = payload_len;
+            free_slot->last_used = ++p->clock;
+
+            p->cached_bytes += payload_len;
+            break;
+        }
+
+        // nothing left to evict, the chunk is too large to keep
+        if (oldest == NULL)
+        {
+            free_buffer(payload);
+            break;
+        }
+
+        free_buffer(oldest->payload);
+        p->cached_bytes -= oldest->payload_len;
+        oldest->in_use = false;
+        oldest->payload = NULL;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+static void run_prefetch_job(struct prefetcher* p, struct prefetch_job* job)
+{
+    struct server_info* s_info = p->s_info;
+
+    struct stat st;
+    int fd = open_volume_file(s_info->volumes, job->file_name, &st);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+    // starts the read in the background without waiting for it
+    posix_fadvise(fd, job->start_offset, job->n_bytes, POSIX_FADV_WILLNEED);
+
+    if (!job->compress ||
+        job->n_bytes > MAX_PREFETCH_BYTES / N_PREFETCHED)
+    {
+        close(fd);
+        return;
+    }
+
+    // the worker will join the blocks of the sidecar instead
+    if (s_info->sidecars != NULL &&
+        sidecar_is_current(s_info->sidecars, job->file_name, &st))
+    {
+        close(fd);
+        return;
+    }
+
+    // a busy device turns the read away, the worker reads the chunk itself
+    uint8_t* file_data = alloc_buffer(sizeof(*file_data)*job->n_bytes);
+    ssize_t n_read = volume_pread(s_info->volumes, fd, st.st_dev, file_data,
+                                job->n_bytes, job->start_offset);
+
+    close(fd);
+
+    if (n_read != job->n_bytes)
+    {
+        free_buffer(file_data);
+        return;
+    }
+
+    uint64_t payload_len;
+    uint8_t* payload = create_file_payload(&job->session_id,
+                    &job->start_offset, &job->n_bytes, file_data,
+                    &payload_len);
+    free_buffer(file_data);
+
+    compress_payload(s_info->c_info, &payload, &payload_len);
+
+    store_prefetched(p, job, &st, payload, payload_len);
+}
+
+
+// background thread working through the queued read ahead jobs
+void* prefetch_thread(void* args)
+{
+    struct prefetcher* p = args;
+    struct prefetch_job job;
+
+    while (true)
+    {
+        pthread_mutex_lock(&p->lock);
+
+        while (p->n_jobs == 0 && !p->stop)
+        {
+            pthread_cond_wait(&p->job_cond, &p->lock);
+        }
+
+        if (p->stop)
+        {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+
+        job = p->jobs[p->job_head];
+        p->job_head = (p->job_head + 1) % MAX_PREFETCH_JOBS;
+        p->n_jobs--;
+
+        pthread_mutex_unlock(&p->lock);
+
+        run_prefetch_job(p, &job);
+    }
+
+    return (void*) NULL;
+}
+
+
+void free_prefetcher(struct prefetcher* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_signal(&p->job_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_join(p->thread, NULL);
+
+    for (size_t i = 0; i < N_PREFETCHED; i++)
+    {
+        free_buffer(p->entries[i].payload);
+    }
+
+    pthread_cond_destroy(&p->job_cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
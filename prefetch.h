@@ -0,0 +1,95 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "requests.h"
+
+
+// number of (session, file) download streams tracked at once
+#define N_STREAMS (64)
+
+// sequential chunks needed before a stream gets read ahead
+#define SEQUENTIAL_HITS (1)
+
+// number of pre-encoded chunks kept and the memory they may use
+#define N_PREFETCHED (16)
+#define MAX_PREFETCH_BYTES (64 * 1024 * 1024)
+
+#define MAX_PREFETCH_JOBS (32)
+
+
+struct stream {
+    bool in_use;
+    uint32_t session_id;
+    char file_name[MAX_FILE_NAME];
+    uint64_t next_offset;
+    uint32_t hits;
+    uint64_t last_used;
+};
+
+// a chunk expected to be requested next
+struct prefetch_job {
+    uint32_t session_id;
+    char file_name[MAX_FILE_NAME];
+    uint64_t start_offset;
+    uint64_t n_bytes;
+    bool compress;
+};
+
+// a chunk whose response payload has been built and compressed ahead of time
+struct prefetched {
+    bool in_use;
+    struct prefetch_job job;
+    struct timespec mtime;
+    off_t file_size;
+    uint8_t* payload;
+    uint64_t payload_len;
+    uint64_t last_used;
+};
+
+struct prefetcher {
+    struct server_info* s_info;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_t thread;
+    bool stop;
+    uint64_t clock;
+
+    struct stream streams[N_STREAMS];
+
+    struct prefetch_job jobs[MAX_PREFETCH_JOBS];
+    size_t job_head;
+    size_t n_jobs;
+
+    struct prefetched entries[N_PREFETCHED];
+    uint64_t cached_bytes;
+};
+
+
+
+struct prefetcher* create_prefetcher(struct server_info* s_info);
+
+void prefetch_note_access(struct prefetcher* p, uint32_t session_id,
+    char* file_name, uint64_t start_offset, uint64_t n_bytes, bool compress,
+    uint64_t file_size);
+
+bool prefetch_take(struct prefetcher* p, uint32_t session_id, char* file_name,
+    uint64_t start_offset, uint64_t n_bytes, struct stat* st,
+    uint8_t** payload, uint64_t* payload_len);
+
+void* prefetch_thread(void* args);
+
+void free_prefetcher(struct prefetcher* p);
+
+#endif
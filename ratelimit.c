@@ -0,0 +1,325 @@
+#include "ratelimit.h"
+
+// This file contains the per client rate limits. Every client address has a
+// token bucket for requests and one for bytes, and every file retrieval
+// session one for bytes, refilled at their configured rates. The accepter
+// checks a request against them before handing it to the scheduler. A
+// request that would overdraw a bucket isn't read at all, the connection is
+// put aside until the tokens it lacks have come in, so a throttled client
+// never ties up a worker.
+
+
+struct rate_limiter* create_rate_limiter(uint64_t requests_per_sec,
+    uint64_t bytes_per_sec, uint64_t session_bytes_per_sec, uint64_t burst_ms)
+{
+    struct rate_limiter* rl = calloc(1, sizeof(*rl));
+
+    rl->requests_per_sec = requests_per_sec;
+    rl->bytes_per_sec = bytes_per_sec;
+    rl->session_bytes_per_sec = session_bytes_per_sec;
+    rl->burst_ms = burst_ms > 0 ? burst_ms : 1;
+
+    rl->cap_deferred = STARTING_DEFERRED;
+    rl->deferred = malloc(sizeof(*rl->deferred)*rl->cap_deferred);
+    rl->n_deferred = 0;
+
+    return rl;
+}
+
+
+// whether any limit is set at all
+bool rate_limited(struct rate_limiter* rl)
+{
+    return rl->requests_per_sec > 0 || rl->bytes_per_sec > 0 ||
+        rl->session_bytes_per_sec > 0;
+}
+
+
+// tokens after elapsed ms at a rate, which is also the number of
+// thousandths earned per ms. A bucket holds at most a burst worth
+static int64_t refill_tokens(int64_t tokens, uint64_t rate, uint64_t elapsed,
+    uint64_t burst_ms)
+{
+    if (rate == 0)
+    {
+        return 0;
+    }
+
+    int64_t cap = rate * burst_ms;
+    uint64_t to_full = (cap - tokens + rate - 1) / rate;
+
+    if (elapsed >= to_full)
+    {
+        return cap;
+    }
+
+    return tokens + rate * elapsed;
+}
+
+
+static void refill_bucket(struct rate_limiter* rl, struct rate_bucket* b,
+    uint64_t requests_rate, uint64_t bytes_rate, uint64_t now)
+{
+    uint64_t elapsed = now - b->last_ms;
+
+    b->requests = refill_tokens(b->requests, requests_rate, elapsed,
+                                rl->burst_ms);
+    b->bytes = refill_tokens(b->bytes, bytes_rate, elapsed, rl->burst_ms);
+    b->last_ms = now;
+}
+
+
+// finds the bucket of a key, or gives it a slot which is free or whose
+// bucket has filled up again, forgetting a client that has been quiet for a
+// while loses nothing. Returns NULL if every slot it could take is in use
+static struct rate_bucket* find_bucket(struct rate_limiter* rl,
+    struct rate_bucket* buckets, uint32_t key, uint64_t requests_rate,
+    uint64_t bytes_rate, uint64_t now)
+{
+    struct rate_bucket* free_slot = NULL;
+    size_t start = (key * 2654435761u) % N_RATE_BUCKETS;
+
+    for (size_t i = 0; i < RATE_PROBE; i++)
+    {
+        struct rate_bucket* b = &buckets[(start + i) % N_RATE_BUCKETS];
+
+        if (!b->in_use)
+        {
+            if (free_slot == NULL)
+            {
+                free_slot = b;
+            }
+
+            continue;
+        }
+
+        refill_bucket(rl, b, requests_rate, bytes_rate, now);
+
+        if (b->key == key)
+        {
+            return b;
+        }
+
+        if (free_slot == NULL &&
+            b->requests == (int64_t) (requests_rate * rl->burst_ms) &&
+            b->bytes == (int64_t) (bytes_rate * rl->burst_ms))
+        {
+            free_slot = b;
+        }
+    }
+
+    if (free_slot != NULL)
+    {
+        free_slot->in_use = true;
+        free_slot->key = key;
+        free_slot->last_ms = now;
+        free_slot->requests = requests_rate * rl->burst_ms;
+        free_slot->bytes = bytes_rate * rl->burst_ms;
+    }
+
+    return free_slot;
+}
+
+
+// ms until a bucket is out of debt
+static uint64_t wait_for_tokens(int64_t tokens, uint64_t rate)
+{
+    if (rate == 0 || tokens >= 0)
+    {
+        return 0;
+    }
+
+    return (-tokens + rate - 1) / rate;
+}
+
+
+// checks a request of a client, and of a file retrieval session, against
+// their buckets and takes its tokens. cost is the estimated number of bytes
+// it moves. Returns 0 if it may go ahead, otherwise the number of ms until
+// it may, in which case nothing is taken
+uint64_t rate_limit_admit(struct rate_limiter* rl, bool has_client,
+    in_addr_t client, bool has_session, uint32_t session_id, uint64_t cost,
+    uint64_t now)
+{
+    struct rate_bucket* c = NULL;
+    struct rate_bucket* s = NULL;
+    uint64_t wait_ms = 0;
+    uint64_t ret;
+
+    // bogus lengths shouldn't overflow the buckets
+    if (cost > MAX_RATE_COST)
+    {
+        cost = MAX_RATE_COST;
+    }
+
+    if (has_client && (rl->requests_per_sec > 0 || rl->bytes_per_sec > 0))
+    {
+        c = find_bucket(rl, rl->clients, client, rl->requests_per_sec,
+                        rl->bytes_per_sec, now);
+    }
+
+    if (has_session && rl->session_bytes_per_sec > 0)
+    {
+        s = find_bucket(rl, rl->sessions, session_id, 0,
+                        rl->session_bytes_per_sec, now);
+    }
+
+    if (c != NULL)
+    {
+        wait_ms = wait_for_tokens(c->requests, rl->requests_per_sec);
+
+        ret = wait_for_tokens(c->bytes, rl->bytes_per_sec);
+        wait_ms = ret > wait_ms ? ret : wait_ms;
+    }
+
+    if (s != NULL)
+    {
+        ret = wait_for_tokens(s->bytes, rl->session_bytes_per_sec);
+        wait_ms = ret > wait_ms ? ret : wait_ms;
+    }
+
+    if (wait_ms > 0)
+    {
+        return wait_ms;
+    }
+
+    if (c != NULL && rl->requests_per_sec > 0)
+    {
+        c->requests -= TOKEN_SCALE;
+    }
+
+    if (c != NULL && rl->bytes_per_sec > 0)
+    {
+        c->bytes -= cost * TOKEN_SCALE;
+    }
+
+    if (s != NULL)
+    {
+        s->bytes -= cost * TOKEN_SCALE;
+    }
+
+    return 0;
+}
+
+
+static void swap_deferred(struct rate_limiter* rl, size_t i, size_t j)
+{
+    struct deferred tmp = rl->deferred[i];
+
+    rl->deferred[i] = rl->deferred[j];
+    rl->deferred[j] = tmp;
+}
+
+
+// puts a connection aside until due_ms, its one shot event stays disarmed
+// meanwhile so nothing else touches it
+void defer_request(struct rate_limiter* rl, int fd, uint64_t due_ms)
+{
+    if (rl->n_deferred == rl->cap_deferred)
+    {
+        rl->cap_deferred *= 2;
+        rl->deferred = realloc(rl->deferred,
+                            sizeof(*rl->deferred)*rl->cap_deferred);
+    }
+
+    size_t i = rl->n_deferred;
+    rl->deferred[i].fd = fd;
+    rl->deferred[i].due_ms = due_ms;
+    rl->n_deferred++;
+
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+
+        if (rl->deferred[parent].due_ms <= rl->deferred[i].due_ms)
+        {
+            break;
+        }
+
+        swap_deferred(rl, i, parent);
+        i = parent;
+    }
+}
+
+
+static void pop_deferred(struct rate_limiter* rl)
+{
+    rl->n_deferred--;
+    rl->deferred[0] = rl->deferred[rl->n_deferred];
+
+    size_t i = 0;
+
+    while (true)
+    {
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        size_t smallest = i;
+
+        if (left < rl->n_deferred &&
+            rl->deferred[left].due_ms < rl->deferred[smallest].due_ms)
+        {
+            smallest = left;
+        }
+
+        if (right < rl->n_deferred &&
+            rl->deferred[right].due_ms < rl->deferred[smallest].due_ms)
+        {
+            smallest = right;
+        }
+
+        if (smallest == i)
+        {
+            break;
+        }
+
+        swap_deferred(rl, i, smallest);
+        i = smallest;
+    }
+}
+
+
+// returns how long the event loop may wait before a deferred request is
+// due, capped at max_timeout
+int next_deferred_timeout(struct rate_limiter* rl, int max_timeout,
+    uint64_t now)
+{
+    if (rl->n_deferred == 0)
+    {
+        return max_timeout;
+    }
+
+    uint64_t due_ms = rl->deferred[0].due_ms;
+
+    if (due_ms <= now)
+    {
+        return 0;
+    }
+
+    return due_ms - now < max_timeout ? due_ms - now : max_timeout;
+}
+
+
+// takes up to max_fds connections whose requests are due
+size_t pop_due_requests(struct rate_limiter* rl, uint64_t now, int* fds,
+    size_t max_fds)
+{
+    size_t n_due = 0;
+
+    while (n_due < max_fds && rl->n_deferred > 0 &&
+        rl->deferred[0].due_ms <= now)
+    {
+        fds[n_due] = rl->deferred[0].fd;
+        n_due++;
+
+        pop_deferred(rl);
+    }
+
+    return n_due;
+}
+
+
+void free_rate_limiter(struct rate_limiter* rl)
+{
+    free(rl->deferred);
+    free(rl);
+}
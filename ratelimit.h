@@ -0,0 +1,90 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+
+// defaults for the limits of the options file, 0 leaves a rate unlimited
+#define CLIENT_REQUESTS_PER_SEC (0)
+#define CLIENT_BYTES_PER_SEC (0)
+#define SESSION_BYTES_PER_SEC (0)
+
+// how much of its rate a client that has been quiet can use up in one go
+#define RATE_BURST_MS (1000)
+
+// clients and sessions tracked at once, and the slots looked at to find
+// one. A client that can't be given a slot isn't limited
+#define N_RATE_BUCKETS (4096)
+#define RATE_PROBE (8)
+
+// tokens are kept in thousandths so that slow rates still refill every ms
+#define TOKEN_SCALE (1000)
+
+// the most bytes a single request is charged for
+#define MAX_RATE_COST (1ULL << 40)
+
+#define STARTING_DEFERRED (64)
+
+
+// the tokens of one client address or session
+struct rate_bucket {
+    bool in_use;
+    uint32_t key;
+    uint64_t last_ms;
+
+    // requests and bytes, in thousandths. The bytes can go below zero, a
+    // request larger than the burst is let through and paid off afterwards
+    int64_t requests;
+    int64_t bytes;
+};
+
+// a connection whose request waits for its client's tokens
+struct deferred {
+    int fd;
+    uint64_t due_ms;
+};
+
+// the per client limits, only ever used from the accepter's event loop
+struct rate_limiter {
+    uint64_t requests_per_sec;
+    uint64_t bytes_per_sec;
+    uint64_t session_bytes_per_sec;
+    uint64_t burst_ms;
+
+    struct rate_bucket clients[N_RATE_BUCKETS];
+    struct rate_bucket sessions[N_RATE_BUCKETS];
+
+    // min heap ordered by the time the request may go
+    struct deferred* deferred;
+    size_t n_deferred;
+    size_t cap_deferred;
+};
+
+
+
+struct rate_limiter* create_rate_limiter(uint64_t requests_per_sec,
+    uint64_t bytes_per_sec, uint64_t session_bytes_per_sec, uint64_t burst_ms);
+
+bool rate_limited(struct rate_limiter* rl);
+
+uint64_t rate_limit_admit(struct rate_limiter* rl, bool has_client,
+    in_addr_t client, bool has_session, uint32_t session_id, uint64_t cost,
+    uint64_t now);
+
+void defer_request(struct rate_limiter* rl, int fd, uint64_t due_ms);
+
+int next_deferred_timeout(struct rate_limiter* rl, int max_timeout,
+    uint64_t now);
+
+size_t pop_due_requests(struct rate_limiter* rl, uint64_t now, int* fds,
+    size_t max_fds);
+
+void free_rate_limiter(struct rate_limiter* rl);
+
+#endif
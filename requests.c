@@ -2,22 +2,59 @@
 #include "server.h"
 #include "thread_pool.h"
 #include "compression.h"
+#include "prefetch.h"
+#include "flight.h"
+#include "sidecar.h"
+#include "checksum.h"
+#include "training.h"
+#include "memory.h"
+#include "upstream.h"
 
 // This file contains all the logic behind handling each request.
 // Each request type has its own function: handle_[request].
 
 
+// rearms the client socket so that its next request is picked up by epoll
+void rearm_connection(struct server_info* s_info, int client_socket)
+{
+    struct epoll_event event;
+    event.data.fd = client_socket;
+    event.events = EPOLLIN | EPOLLONESHOT | EPOLLET;
+
+    epoll_ctl(s_info->epfd, EPOLL_CTL_MOD, client_socket, &event);
+}
+
+
+// reserves memory for a buffer of the request, it is released once the
+// request has been handled. Returns false if the server can't spare it
+bool reserve_request_memory(struct server_info* s_info, 
+    struct request* request, uint64_t bytes)
+{
+    if (!reserve_memory(s_info->memory, bytes))
+    {
+        return false;
+    }
+
+    *request->reserved += bytes;
+    return true;
+}
+
+
 // creates a request struct which stores all the information about relevant
-// information about the request
+// information about the request. The memory its buffers hold is added to
+// reserved
 struct request* construct_request(struct server_info* s_info,
-                                 int client_socket)
+                                 int client_socket, uint64_t* reserved)
 {
     struct request* r = malloc(sizeof(*r));
     r->client_socket =  client_socket;
+    r->payload = NULL;
+    r->payload_pending = false;
+    r->reserved = reserved;
     uint8_t msg_header;
     
 
-    int bytes_recv = recv(client_socket, &msg_header, 1, 0);
+    ssize_t bytes_recv = recv(client_socket, &msg_header, 1, 0);
     
     // case when the connection is closed from the client's side
     if (bytes_recv < 1)
@@ -27,61 +64,94 @@ struct request* construct_request(struct server_info* s_info,
     }  
         
     
-    bytes_recv = recv(client_socket, &(r->payload_len), 8, 0);
+    // a client stalling half way through a request runs into the socket's
+    // receive timeout, and the connection is dropped
+    bytes_recv = recv(client_socket, &(r->payload_len), 8, MSG_WAITALL);
     if (bytes_recv != 8)
+    {
         perror("Could not read payload length");
+        free(r);
+        return NULL;
+    }
 
     
     r->payload_len = be64toh(r->payload_len);
-    
+
+    r->has_id = IS_BIT_SET(msg_header, REQUEST_ID_BIT);
+
+    if (r->has_id)
+    {
+        bytes_recv = recv(client_socket, &r->request_id, REQUEST_ID_SZ, 
+                        MSG_WAITALL);
+        if (bytes_recv != REQUEST_ID_SZ)
+        {
+            perror("Could not read request id");
+            free(r);
+            return NULL;
+        }
+    }
+
+    // setting information from the messsage header
+    r->msg_type = msg_header >> 4; 
+
+    r->payload_compressed = IS_BIT_SET(msg_header, PAYLOAD_COMPRESSED_BIT);
+    r->compress_response = IS_BIT_SET(msg_header, COMPRESS_RESPONSE_BIT);
+    r->block_framed = IS_BIT_SET(msg_header, BLOCK_FRAMED_BIT);
+
+    // a large echo is read by its handler as it goes
+    if (r->msg_type == ECHO_REQUEST && r->payload_len > ECHO_STREAM_THRESHOLD)
+    {
+        r->payload_pending = true;
+        return r;
+    }
 
     if (r->payload_len > 0)
     {
-        r->payload = malloc(sizeof(*r->payload)*r->payload_len);
+        // the length comes from the client, so it has to fit the budget
+        // before anything is allocated for it
+        if (!reserve_request_memory(s_info, r, r->payload_len))
+        {
+            fputs("no memory to spare for a request payload\n", stderr);
+            free(r);
+            return NULL;
+        }
 
-        bytes_recv = recv(client_socket, r->payload, r->payload_len, 0);
+        r->payload = alloc_buffer(sizeof(*r->payload)*r->payload_len);
+
+        bytes_recv = recv(client_socket, r->payload, r->payload_len, 
+                            MSG_WAITALL);
         if (bytes_recv != r->payload_len)
+        {
             perror("Could not read all payload bytes");
+            free_buffer(r->payload);
+            free(r);
+            return NULL;
+        }
     }
     
     // rearming socket so that it is tracked by epoll
-    struct epoll_event event;
-    event.data.fd = client_socket;
-    event.events = EPOLLIN | EPOLLONESHOT | EPOLLET;
-
-    epoll_ctl(s_info->epfd, EPOLL_CTL_MOD, client_socket, &event);
-
-
-    // setting information from the messsage header
-    r->msg_type = msg_header >> 4; 
+    rearm_connection(s_info, client_socket);
 
-    r->payload_compressed = IS_BIT_SET(msg_header, PAYLOAD_COMPRESSED_BIT);
-    r->compress_response = IS_BIT_SET(msg_header, COMPRESS_RESPONSE_BIT);
     return r;
 }
 
 
 // checks type of the request and calls the appropiate function to handle it
-int handle_request(int client_socket, struct server_info* s_info)
+static int dispatch_request(int client_socket, struct request* r,
+    struct server_info* s_info)
 {
-    struct request* r = construct_request(s_info, client_socket);
-    
-    if (NULL == r)
+    // echoed payloads are sent back as they are, every other request is
+    // decoded before it is handled
+    if (r->msg_type != ECHO_REQUEST && decompress_request(s_info, r) < 0)
     {
-        handle_error(client_socket);
+        handle_error(s_info, client_socket, r);
+
+        free_buffer(r->payload);
         free(r);
         return 1;
     }
         
-    if (r->msg_type == SHUTDOWN_REQUEST)
-    {
-        if (r->payload_len > 0)
-            free(r->payload);
-
-        free(r);
-        return 2;
-    }
-    else if (r->msg_type == ECHO_REQUEST)
+    if (r->msg_type == ECHO_REQUEST)
     {
         handle_echo(r, s_info);
     }    
@@ -95,429 +165,2477 @@ int handle_request(int client_socket, struct server_info* s_info)
     {
         handle_file_size_query(r, s_info);
     }
+    else if (r->msg_type == FILE_STAT_BATCH_REQUEST)
+    {
+        handle_file_stat_batch(r, s_info);
+    }
     else if (r->msg_type == FILE_RETRIEVE_REQUEST)
     {
         handle_file_retrieval(r, s_info);
     }
+    else if (r->msg_type == FILE_MULTI_RETRIEVE_REQUEST)
+    {
+        handle_multi_file_retrieval(r, s_info);
+    }
+    else if (r->msg_type == EXTENDED_REQUEST)
+    {
+        handle_extended(r, s_info);
+    }
     else
     {
-        handle_error(client_socket);
+        handle_error(s_info, client_socket, r);
 
         if (r->payload_len > 0)
-            free(r->payload);
+            free_buffer(r->payload);
 
         free(r);
         return 1;
     }
 
     return 0;
-    
 }
 
 
-void handle_error(int client_socket)
+int handle_request(int client_socket, struct server_info* s_info)
 {
-    size_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ;
-    char* response = malloc(sizeof(char)*response_size);
+    uint64_t reserved = 0;
+    struct request* r = construct_request(s_info, client_socket, &reserved);
+    
+    if (NULL == r)
+    {
+        handle_error(s_info, client_socket, NULL);
+        release_memory(s_info->memory, reserved);
+        free(r);
+        return 1;
+    }
+        
+    if (r->msg_type == SHUTDOWN_REQUEST)
+    {
+        if (r->payload_len > 0)
+            free_buffer(r->payload);
 
-    // setting message header byte
-    response[0] = ERROR_RESPONSE << 4;
+        free(r);
+        release_memory(s_info->memory, reserved);
+        return 2;
+    }
 
-    // setting payload length to zero
-    uint64_t host_len = htobe64(0);
-    memcpy(response+1, &host_len, PAYLOAD_LEN_SZ);
+    // the dictionary the connection selected is held until the request has
+    // been handled, even if a newer one is published meanwhile
+    struct compression_info* c_info = acquire_dictionary(s_info->trainer,
+            connection_dictionary(&s_info->connections, client_socket));
 
-    int bytes_sent = send(client_socket, response, response_size, 0);
+    // the selected dictionary has been retired
+    if (c_info == NULL)
+    {
+        handle_error(s_info, client_socket, r);
 
-    if (bytes_sent != response_size)
-        perror("failed to send all bytes\n");
+        free_buffer(r->payload);
+        free(r);
+        release_memory(s_info->memory, reserved);
+        return 1;
+    }
 
-    close(client_socket);
-    
-    free(response);
+    r->c_info = c_info;
+
+    int ret = dispatch_request(client_socket, r, s_info);
+
+    release_dictionary(s_info->trainer, c_info);
+    release_memory(s_info->memory, reserved);
+
+    return ret;
 }
 
 
-void handle_echo(struct request* request, struct server_info* s_info)
+// turns a request away with an ERROR response instead of handling it,
+// because the server is overloaded. The request is read and its payload
+// thrown away unread so that the connection carries on with the next one.
+// Returns 1 if the request couldn't be read and the connection has to be
+// closed, 0 otherwise
+int shed_request(int client_socket, struct server_info* s_info)
 {
-    
-    if (request->compress_response && !request->payload_compressed)
+    struct request r = {0};
+    uint8_t msg_header;
+
+    r.client_socket = client_socket;
+
+    if (recv(client_socket, &msg_header, 1, 0) < 1 ||
+        recv(client_socket, &r.payload_len, PAYLOAD_LEN_SZ, MSG_WAITALL) != 
+            PAYLOAD_LEN_SZ)
     {
-        compress_payload(s_info->c_info, &request->payload,
-                 &request->payload_len);   
+        return 1;
     }
-        
-    size_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + 
-    request->payload_len;
-    uint8_t* response = malloc(sizeof(*response)*response_size);
 
-    // copying message header byte
-    response[0] = ECHO_RESPONSE << 4;
+    r.payload_len = be64toh(r.payload_len);
+    r.has_id = IS_BIT_SET(msg_header, REQUEST_ID_BIT);
 
-    if (request->payload_compressed || request->compress_response)
-    {   
-        SET_BIT(response[0], PAYLOAD_COMPRESSED_BIT);
-        
+    if (r.has_id && recv(client_socket, &r.request_id, REQUEST_ID_SZ, 
+            MSG_WAITALL) != REQUEST_ID_SZ)
+    {
+        return 1;
     }
 
-    // copying payload len 
-    uint64_t be_len = htobe64(request->payload_len);
-    memcpy(response+1, &be_len, PAYLOAD_LEN_SZ);
+    uint8_t* discard = malloc(sizeof(*discard)*STREAM_CHUNK_SZ);
+    uint64_t remaining = r.payload_len;
 
-    // copying payload
-    memcpy(response + 9, request->payload, request->payload_len);
-    
-    int bytes_sent = send(request->client_socket, response, response_size, 0);
+    while (remaining > 0)
+    {
+        ssize_t n = recv(client_socket, discard, remaining < STREAM_CHUNK_SZ ?
+                        remaining : STREAM_CHUNK_SZ, 0);
 
-    if (bytes_sent != response_size)
-        perror("failed to send all bytes");
+        if (n <= 0)
+        {
+            break;
+        }
 
-    
-    free(response);
-    if (request->payload_len > 0)
-        free(request->payload);
-    free(request);
-    
-}
+        remaining -= n;
+    }
 
-// returns a list of regular file names, separated by null bytes
-uint8_t* get_list_of_files(char* target_dir, uint64_t* files_len)
-{
-    *files_len = 0;
-    size_t max_len = 50;
-    uint8_t* files = malloc(sizeof(*files)*max_len);
-    size_t name_len = 0;
+    free(discard);
+
+    if (remaining > 0)
+    {
+        return 1;
+    }
+
+    rearm_connection(s_info, client_socket);
+    send_error(s_info, client_socket, &r);
 
+    return 0;
+}
 
-    struct dirent* dir;
-    DIR* d = opendir(target_dir);
 
-    if (d == NULL)
-        perror("couldn't open target directory ");
-    
-    while ((dir = readdir(d)) != NULL)
+// takes the completions of a connection's MSG_ZEROCOPY sends off the error
+// queue of its socket without waiting for any, letting go of the responses
+// the kernel is done with. copied is set if the kernel reported it copied
+// the bytes after all, as it does over loopback. Returns the number of
+// completions taken
+int reap_zerocopy(struct server_info* s_info, int client_socket, 
+    bool* copied)
+{
+    int n_reaped = 0;
+
+    // only TCP sockets have an error queue, on a unix domain socket this
+    // would read the next request instead
+    while (has_zerocopy_sends(&s_info->connections, client_socket))
     {
-        // only including regular files
-        if (strcmp(dir->d_name, ".") == 0 || 
-            strcmp(dir->d_name, "..") == 0 || 
-            dir->d_type != DT_REG)
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        // completions carry no bytes, only their control message
+        if (recvmsg(client_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ||
+            !(msg.msg_flags & MSG_ERRQUEUE))
         {
-            continue;
+            break;
         }
 
-        if (*files_len >= max_len)
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+            cm = CMSG_NXTHDR(&msg, cm))
         {
-            max_len *= 2;
-            files = realloc(files, sizeof(char)*max_len);
+            struct sock_extended_err* err = (void*) CMSG_DATA(cm);
+
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR ||
+                err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+            {
+                continue;
+            }
+
+            // a completion covers a range of sends
+            complete_zerocopy_sends(&s_info->connections, client_socket,
+                                    err->ee_info, err->ee_data);
+            n_reaped++;
+
+            if (copied != NULL && (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED))
+            {
+                *copied = true;
+            }
         }
-        
-        name_len = strlen(dir->d_name);
+    }
 
-        memcpy(files + *files_len, dir->d_name, name_len);
-        *files_len += name_len;
+    return n_reaped;
+}
 
-        files[*files_len] = NULL_BYTE;
-        *files_len += 1;
-        
-    }
 
-    closedir(d);
+// holds the buffers of a response about to be sent with MSG_ZEROCOPY until
+// the kernel is done with them. Parts of no more than ZEROCOPY_COPY_MAX
+// bytes, such as headers on the stack, are copied and iov pointed at the
+// copy instead. Larger parts are held as the buffers they start, the first
+// one being the start of the message given to send_response_msg
+static struct zerocopy_send* hold_response(struct iovec* iov, size_t n_iov,
+    void* first)
+{
+    struct zerocopy_send* zs = calloc(1, sizeof(*zs));
+    size_t copied_len = 0;
 
-    // if no files in directory - setting null byte
-    if (*files_len == 0)
+    for (size_t i = 0; i < n_iov; i++)
     {
-        files[0] = NULL_BYTE;
-        *files_len += 1;
+        if (iov[i].iov_len <= ZEROCOPY_COPY_MAX)
+        {
+            copied_len += iov[i].iov_len;
+        }
     }
 
+    zs->copied = malloc(sizeof(*zs->copied)*(copied_len > 0 ? copied_len : 1));
+    copied_len = 0;
 
-    return files;
+    for (size_t i = 0; i < n_iov; i++)
+    {
+        if (iov[i].iov_len <= ZEROCOPY_COPY_MAX)
+        {
+            memcpy(zs->copied + copied_len, iov[i].iov_base, iov[i].iov_len);
+            iov[i].iov_base = zs->copied + copied_len;
+            copied_len += iov[i].iov_len;
+        }
+        else
+        {
+            // the rest of the first buffer goes right after the header
+            void* buffer = iov[i].iov_base == (uint8_t*) first + 
+                        MSG_HEADER_SZ + PAYLOAD_LEN_SZ ? first : 
+                        iov[i].iov_base;
+
+            hold_buffer(buffer);
+            zs->buffers[zs->n_buffers] = buffer;
+            zs->n_buffers++;
+        }
+    }
+
+    return zs;
 }
 
-// handles directory listing request - sends file names 
-void handle_dir_listing(struct request* request, struct server_info* s_info)
+
+// sends a whole response to the client of a request. The first buffer of
+// the message starts with the message header and payload length, and the
+// request id goes right after them if the request carried one. Responses of
+// a connection's requests are sent one at a time. Large responses may be
+// sent with MSG_ZEROCOPY, so buffers of the message larger than
+// ZEROCOPY_COPY_MAX have to come from alloc_buffer and be freed with
+// free_buffer, which puts it off until the kernel is done with them.
+// Returns the number of bytes sent not counting the id, or -1 if not all of
+// them could be sent
+ssize_t send_response_msg(struct server_info* s_info, struct request* request,
+    struct msghdr* msg)
 {
-    uint64_t payload_len = 0;
-    
-    uint8_t* payload = get_list_of_files(s_info->target_dir, &payload_len);
+    uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ + REQUEST_ID_SZ];
+    struct iovec iov[MAX_RESPONSE_IOV + 1];
+    size_t n_iov = 0;
+    size_t header_len = MSG_HEADER_SZ + PAYLOAD_LEN_SZ;
+    size_t id_len = request->has_id ? REQUEST_ID_SZ : 0;
+    uint8_t* first = msg->msg_iov[0].iov_base;
+
+    memcpy(header, first, header_len);
 
-   if (request->compress_response)
+    if (request->has_id)
     {
-        compress_payload(s_info->c_info, &payload, &payload_len);
+        SET_BIT(header[0], REQUEST_ID_BIT);
+        memcpy(header + header_len, &request->request_id, REQUEST_ID_SZ);
     }
 
-    uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
-    uint8_t* response = malloc(sizeof(*response)*response_size);
-
-    // construct response
-    response[0] = DIR_LIST_RESPONSE << 4;
+    iov[n_iov].iov_base = header;
+    iov[n_iov].iov_len = header_len + id_len;
+    n_iov++;
 
-    if (request->compress_response)
+    if (msg->msg_iov[0].iov_len > header_len)
     {
-        SET_BIT(response[0], PAYLOAD_COMPRESSED_BIT);
+        iov[n_iov].iov_base = first + header_len;
+        iov[n_iov].iov_len = msg->msg_iov[0].iov_len - header_len;
+        n_iov++;
     }
 
-    uint64_t be_len = htobe64(payload_len);
-
-    memcpy(response + 1, &be_len, PAYLOAD_LEN_SZ);
-    memcpy(response + 9, payload, payload_len);
-
-    int bytes_sent = send(request->client_socket, response, response_size, 0);
+    for (size_t i = 1; i < msg->msg_iovlen && n_iov <= MAX_RESPONSE_IOV; i++)
+    {
+        iov[n_iov] = msg->msg_iov[i];
+        n_iov++;
+    }
 
-    if (bytes_sent != response_size)
-        perror("failed to send all bytes");
+    size_t remaining = 0;
+    for (size_t i = 0; i < n_iov; i++)
+    {
+        remaining += iov[i].iov_len;
+    }
 
-    free(payload);
-    free(response);
-    free(request);
-}
+    size_t total = remaining;
 
+    struct msghdr out = *msg;
+    out.msg_iov = iov;
+    out.msg_iovlen = n_iov;
 
-void handle_file_size_query(struct request* request, struct server_info* s_info)
-{      
-    size_t file_name_len = strlen(s_info->target_dir) + 
-                                request->payload_len + 5;
-    char* file_name = malloc(sizeof(char)*file_name_len);
+    struct connection* c = lock_connection_send(&s_info->connections, 
+                                            request->client_socket);
 
-    sprintf(file_name, "%s/%s", s_info->target_dir, request->payload);
+    // large responses are sent straight from the caller's buffers, which
+    // are held past the caller freeing them for as long as the kernel may
+    // still send from them
+    bool zerocopy = c != NULL && c->zerocopy &&
+                    s_info->options.zerocopy_min_bytes > 0 &&
+                    total >= s_info->options.zerocopy_min_bytes &&
+                    n_iov <= MAX_ZEROCOPY_BUFFERS;
+    uint32_t n_zerocopy = 0;
+    struct zerocopy_send* zs = NULL;
 
-    FILE* f = fopen(file_name, "r");
-    
-    // file doesnt exist
-    if (NULL == f)
+    if (zerocopy)
     {
-        handle_error(request->client_socket);   
+        zs = hold_response(iov, n_iov, first);
+        add_zerocopy_send(c, zs);
     }
-    else
+
+    // a send cut short by the socket's timeout is carried on from where it
+    // stopped, the next response can't start half way through this one
+    while (remaining > 0)
     {
-        fseek(f, 0, SEEK_END); 
-        uint64_t file_size = ftell(f);
-        uint64_t be_file_size = htobe64(file_size);
+        ssize_t ret = sendmsg(request->client_socket, &out, 
+                            MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
 
-        uint64_t payload_len = 8;
-        uint8_t* payload = malloc(sizeof(*payload)*payload_len);
-        
-        memcpy(payload, &be_file_size, 8);
+        // no more pages can be pinned for the socket, the rest is copied
+        if (ret < 0 && zerocopy && errno == ENOBUFS)
+        {
+            zerocopy = false;
+            continue;
+        }
 
-        if (request->compress_response)
+        if (ret <= 0)
         {
-            compress_payload(s_info->c_info, &payload, &payload_len);   
+            break;
         }
 
-        
-        uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
-        char* response = malloc(sizeof(*response)*response_size);
+        remaining -= ret;
+        n_zerocopy += zerocopy;
 
-        uint64_t be_len = htobe64(payload_len);
-    
-        // constructing response
-        response[0] = FILE_SIZE_RESPONSE << 4;
+        // anything passed along goes with the first bytes only
+        out.msg_control = NULL;
+        out.msg_controllen = 0;
 
-        if (request->compress_response)
+        while (ret > 0)
         {
-            SET_BIT(response[0], PAYLOAD_COMPRESSED_BIT);
+            if ((size_t) ret >= out.msg_iov->iov_len)
+            {
+                ret -= out.msg_iov->iov_len;
+                out.msg_iov++;
+                out.msg_iovlen--;
+            }
+            else
+            {
+                out.msg_iov->iov_base = (uint8_t*) out.msg_iov->iov_base + 
+                                        ret;
+                out.msg_iov->iov_len -= ret;
+                ret = 0;
+            }
         }
-    
-        memcpy(response + 1, &be_len, PAYLOAD_LEN_SZ);
-        memcpy(response + 9, payload, payload_len);
+    }
 
-        int bytes_sent = send(request->client_socket, response,
-                             response_size, 0);
+    // the buffers are let go of once the client has acknowledged them. The
+    // completions that are in by now are taken here, later ones from the
+    // event loop
+    if (zs != NULL)
+    {
+        bool copied = false;
 
-        if (bytes_sent != response_size)
-            perror("failed to send all bytes");
+        seal_zerocopy_send(c, zs, n_zerocopy);
+        reap_zerocopy(s_info, request->client_socket, &copied);
 
-        free(response);
-        free(payload);
+        // waiting for completions of copied sends only costs time
+        if (copied)
+        {
+            c->zerocopy = false;
+        }
     }
-        
-    
-    free(file_name);
-    free(request->payload);
-    free(request);
-    
-}
 
-               
-// updates the shared list of current file requests appropiately 
-int update_file_requests(struct server_info* s_info, uint32_t* session_id, 
-                uint64_t* start_offset, uint64_t* n_bytes, char* file_name)
-{
-    pthread_mutex_lock(&s_info->f_requests_lock);
-    struct file_request curr;
+    unlock_connection_send(c);
 
-    for (size_t i = 0; i < s_info->n_file_requests; i++)
+    if (remaining > 0)
     {
-        curr = s_info->file_requests[i];
-        if (*session_id == curr.session_id && 
-            *start_offset == curr.start_offset &&
-            *n_bytes == curr.n_bytes &&
-            (strcmp(file_name, curr.file_name) == 0) && 
-            curr.completed)
-        {
-            // indicating that the file request has already been handled 
-            // by another thread
-            *n_bytes = 0;
-            return 1;
-        }
+        return -1;
     }
 
-    // creating a new file request since the it doesnt already exist in the
-    // shared list
-    size_t j = s_info->n_file_requests;
-    curr = s_info->file_requests[j];
-
-    s_info->file_requests[j].session_id = *session_id;
-    s_info->file_requests[j].start_offset = *start_offset;
-    s_info->file_requests[j].n_bytes = *n_bytes;
-    s_info->file_requests[j].completed = true;
+    return total - id_len;
+}
 
-    memcpy(&s_info->file_requests[j].file_name, file_name, strlen(file_name)+1);
 
-    s_info->n_file_requests++;
+// sends a response held in a single buffer
+ssize_t send_response(struct server_info* s_info, struct request* request,
+    uint8_t* response, size_t response_size)
+{
+    struct iovec iov;
+    iov.iov_base = response;
+    iov.iov_len = response_size;
 
-    pthread_mutex_unlock(&s_info->f_requests_lock);
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
 
-    return 0;
+    return send_response_msg(s_info, request, &msg);
 }
 
-void send_file(struct server_info* s_info, struct request* request, FILE* f, 
-    uint64_t* file_data_size, uint32_t* session_id, uint64_t* start_offset, 
-    uint64_t* n_bytes)
+
+// sends an ERROR response to a client, with the id of the request it
+// answers if the request carried one. request is NULL if it couldn't be
+// read. The response is sent under the connection's send lock so that it
+// can't end up in the middle of another request's response
+void send_error(struct server_info* s_info, int client_socket,
+    struct request* request)
 {
-    fseek(f, *start_offset, SEEK_SET);
+    uint8_t response[MSG_HEADER_SZ + PAYLOAD_LEN_SZ + REQUEST_ID_SZ] = {0};
+    size_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ;
 
-    // copying file data
-    uint8_t* file_data = malloc(sizeof(char)*(*n_bytes));
-    
-    for (size_t i = 0; i < *n_bytes; i++)
+    // the payload length is left at zero
+    response[0] = ERROR_RESPONSE << 4;
+
+    if (request != NULL && request->has_id)
     {
-        file_data[i] = fgetc(f);
+        SET_BIT(response[0], REQUEST_ID_BIT);
+        memcpy(response + response_size, &request->request_id, 
+                REQUEST_ID_SZ);
+        response_size += REQUEST_ID_SZ;
     }
 
-    uint64_t payload_len = 4 + 8 + 8 + *n_bytes;
-    uint8_t* payload = malloc(sizeof(*payload)*payload_len);
+    struct connection* c = lock_connection_send(&s_info->connections,
+                                            client_socket);
 
-    uint64_t be_start_offset = htobe64(*start_offset);
-    uint64_t be_n_bytes = htobe64(*file_data_size);
+    ssize_t bytes_sent = send(client_socket, response, response_size, 
+                            MSG_NOSIGNAL);
 
-    memcpy(payload, session_id, 4);
-    memcpy(payload + 4, &be_start_offset, 8);
-    memcpy(payload + 12, &be_n_bytes, 8);
-    memcpy(payload + 20, file_data, *n_bytes);
+    unlock_connection_send(c);
 
-    if (request->compress_response)
-    {
-        compress_payload(s_info->c_info, &payload, &payload_len);
-    }
-        
+    if (bytes_sent != response_size)
+        perror("failed to send all bytes\n");
+}
 
-    uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + 
-                        payload_len;
-    uint8_t* response = malloc(sizeof(*response)*response_size);
-    
-    uint64_t be_payload_len = htobe64(payload_len);    
 
-    // constructnig response
-    response[0] = FILE_RETRIEVE_RESPONSE << 4;
+// answers a request with an ERROR response and shuts the connection down
+void handle_error(struct server_info* s_info, int client_socket,
+    struct request* request)
+{
+    send_error(s_info, client_socket, request);
 
-    if (request->compress_response)
+    // the fd is left for the worker to close, so that it isn't reused
+    // while the connection is still registered
+    shutdown(client_socket, SHUT_RDWR);
+}
+
+
+// decompresses the payload of a request if it is compressed, returns -1 if
+// it is a malformed frame or there is no memory to spare to decode it
+int decompress_request(struct server_info* s_info, struct request* request)
+{
+    if (!request->payload_compressed)
     {
-        SET_BIT(response[0], PAYLOAD_COMPRESSED_BIT);
+        return 0;
     }
-    
+
+    if (!reserve_request_memory(s_info, request, 
+            decompressed_bound(request->c_info, request->payload_len)))
+    {
+        return -1;
+    }
+
+    if (request->block_framed)
+    {
+        if (decompress_payload_framed(request->c_info, &request->payload, 
+                                    &request->payload_len) < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        decompress_payload(request->c_info, &request->payload, 
+                            &request->payload_len);
+    }
+
+    request->payload_compressed = false;
+    return 0;
+}
+
+// compresses a response payload in the format the client asked for
+void compress_response_payload(struct server_info* s_info, 
+    struct request* request, uint8_t** payload, uint64_t* payload_len)
+{
+    trainer_sample(s_info->trainer, *payload, *payload_len);
+
+    if (request->block_framed)
+    {
+        compress_payload_framed(request->c_info, payload, payload_len);
+    }
+    else
+    {
+        compress_payload(request->c_info, payload, payload_len);
+    }
+}
+
+// sets the bits of a response header that describe a compressed payload
+void set_compressed_bits(struct request* request, uint8_t* msg_header)
+{
+    SET_BIT(*msg_header, PAYLOAD_COMPRESSED_BIT);
+
+    if (request->block_framed)
+    {
+        SET_BIT(*msg_header, BLOCK_FRAMED_BIT);
+    }
+}
+
+// the most memory a response built around a payload of payload_len bytes
+// takes on top of the payload: its compressed copy, if asked for, and the
+// response the payload is copied into
+static uint64_t response_memory(struct request* request, uint64_t payload_len)
+{
+    if (!request->compress_response)
+    {
+        return MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
+    }
+
+    uint64_t bound = compressed_bound(request->c_info, payload_len);
+
+    if (bound > (UINT64_MAX - MSG_HEADER_SZ - PAYLOAD_LEN_SZ) / 2)
+    {
+        return UINT64_MAX;
+    }
+
+    return MSG_HEADER_SZ + PAYLOAD_LEN_SZ + 2 * bound;
+}
+
+
+// holds back partial segments while a response goes out in several sends.
+// Only needed on sockets of the latency profile, which have Nagle's
+// algorithm off
+static void cork_response(struct server_info* s_info, int client_socket,
+    bool cork)
+{
+    int option = cork;
+
+    if (s_info->options.latency_profile)
+    {
+        setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &option, 
+                    sizeof(option));
+    }
+}
+
+
+// sends all of a buffer, returns -1 if the client stopped taking it
+static int send_all(int client_socket, uint8_t* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = send(client_socket, buf, len, MSG_NOSIGNAL);
+
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+
+// writes the header of a streamed echo response, followed by the request
+// id if the request carried one, and returns its length
+static size_t stream_echo_header(struct request* request, uint8_t* header,
+    uint64_t payload_len, bool compressed)
+{
+    size_t header_len = MSG_HEADER_SZ + PAYLOAD_LEN_SZ;
+
+    header[0] = ECHO_RESPONSE << 4;
+
+    if (compressed)
+    {
+        set_compressed_bits(request, &header[0]);
+    }
+
+    uint64_t be_len = htobe64(payload_len);
+    memcpy(header + 1, &be_len, PAYLOAD_LEN_SZ);
+
+    if (request->has_id)
+    {
+        SET_BIT(header[0], REQUEST_ID_BIT);
+        memcpy(header + header_len, &request->request_id, REQUEST_ID_SZ);
+        header_len += REQUEST_ID_SZ;
+    }
+
+    return header_len;
+}
+
+
+// moves len bytes from a client socket back into it through a pipe, so
+// that they are never copied into the server. Returns -1 if the client
+// stopped sending or taking them
+static int splice_echo(int client_socket, uint64_t len)
+{
+    int pipe_fds[2];
+    int ret = 0;
+
+    if (pipe(pipe_fds) < 0)
+    {
+        return -1;
+    }
+
+    while (ret == 0 && len > 0)
+    {
+        size_t want = len < STREAM_CHUNK_SZ ? len : STREAM_CHUNK_SZ;
+        long n_in = syscall(SYS_splice, client_socket, NULL, pipe_fds[1], 
+                        NULL, want, SPLICE_F_MOVE);
+
+        if (n_in <= 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        len -= n_in;
+
+        while (n_in > 0)
+        {
+            long n_out = syscall(SYS_splice, pipe_fds[0], NULL, 
+                            client_socket, NULL, n_in, 
+                            SPLICE_F_MOVE | (len > 0 ? SPLICE_F_MORE : 0));
+
+            if (n_out <= 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            n_in -= n_out;
+        }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    return ret;
+}
+
+
+// echoes a payload too large to be held whole straight back as it comes in.
+// The connection's send lock is held all along, and the connection is only
+// rearmed once the whole payload has been read
+static void stream_echo(struct request* request, struct server_info* s_info)
+{
+    uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ + REQUEST_ID_SZ];
+    int client_socket = request->client_socket;
+
+    size_t header_len = stream_echo_header(request, header, 
+                            request->payload_len, request->payload_compressed);
+
+    struct connection* c = lock_connection_send(&s_info->connections,
+                                            client_socket);
+    cork_response(s_info, client_socket, true);
+
+    int ret = send_all(client_socket, header, header_len);
+
+    if (ret == 0)
+    {
+        ret = splice_echo(client_socket, request->payload_len);
+    }
+
+    cork_response(s_info, client_socket, false);
+    unlock_connection_send(c);
+
+    // the response has been cut short, nothing can follow it
+    if (ret < 0)
+    {
+        perror("failed to stream echo payload");
+        shutdown(client_socket, SHUT_RDWR);
+    }
+
+    rearm_connection(s_info, client_socket);
+
+    free(request);
+}
+
+
+// reads an echo payload a block at a time and writes its compressed form
+// to spool, framed if the request asks for it, so that no more than a
+// block of it is ever held. bits has to hold the compressed form of a
+// block along with a carried over byte. Returns the length of the
+// compressed payload, or -1 if the payload couldn't be read or written out
+static int64_t spool_compressed_echo(struct request* request,
+    struct server_info* s_info, uint8_t* block, uint8_t* bits, int spool)
+{
+    struct compression_info* c_info = request->c_info;
+    uint64_t remaining = request->payload_len;
+    uint64_t n_blocks = (remaining + FRAME_BLOCK_SIZE - 1) / FRAME_BLOCK_SIZE;
+    uint64_t out_len = 0;
+    uint64_t n_bits = 0;
+
+    // the frame header and index go first, the length of each block is
+    // filled in once it has been encoded
+    if (request->block_framed)
+    {
+        uint8_t frame_header[FRAME_HEADER_SZ];
+        uint64_t be_raw_len = htobe64(remaining);
+        uint32_t be_block_size = htobe32(FRAME_BLOCK_SIZE);
+        uint32_t be_n_blocks = htobe32(n_blocks);
+
+        memcpy(frame_header, &be_raw_len, 8);
+        memcpy(frame_header + 8, &be_block_size, 4);
+        memcpy(frame_header + 12, &be_n_blocks, 4);
+
+        if (pwrite(spool, frame_header, FRAME_HEADER_SZ, 0) != 
+            FRAME_HEADER_SZ)
+        {
+            return -1;
+        }
+
+        out_len = FRAME_HEADER_SZ + n_blocks * FRAME_INDEX_ENTRY_SZ;
+    }
+
+    for (uint64_t i = 0; remaining > 0; i++)
+    {
+        size_t len = remaining < FRAME_BLOCK_SIZE ? remaining : 
+                    FRAME_BLOCK_SIZE;
+
+        if (recv(request->client_socket, block, len, MSG_WAITALL) != len)
+        {
+            return -1;
+        }
+
+        remaining -= len;
+        trainer_sample(s_info->trainer, block, len);
+
+        if (request->block_framed)
+        {
+            uint64_t block_len = finish_compressed(bits, 
+                                encode_bytes(c_info, block, len, bits, 0));
+            uint32_t be_len = htobe32(block_len);
+
+            if (pwrite(spool, &be_len, FRAME_INDEX_ENTRY_SZ, 
+                    FRAME_HEADER_SZ + i * FRAME_INDEX_ENTRY_SZ) != 
+                    FRAME_INDEX_ENTRY_SZ ||
+                pwrite(spool, bits, block_len, out_len) != block_len)
+            {
+                return -1;
+            }
+
+            out_len += block_len;
+            continue;
+        }
+
+        n_bits = encode_bytes(c_info, block, len, bits, n_bits);
+
+        if (pwrite(spool, bits, n_bits / 8, out_len) != n_bits / 8)
+        {
+            return -1;
+        }
+
+        out_len += n_bits / 8;
+
+        // the partly written byte is carried over to the next block
+        bits[0] = bits[n_bits / 8];
+        n_bits %= 8;
+    }
+
+    if (!request->block_framed)
+    {
+        uint64_t tail_len = finish_compressed(bits, n_bits);
+
+        if (pwrite(spool, bits, tail_len, out_len) != tail_len)
+        {
+            return -1;
+        }
+
+        out_len += tail_len;
+    }
+
+    return out_len;
+}
+
+
+// compresses an echo payload too large to be held whole into a spool file
+// as it comes in, and sends the response from there once it has all been
+// read, as its length has to go first
+static void stream_compressed_echo(struct request* request, 
+    struct server_info* s_info)
+{
+    uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ + REQUEST_ID_SZ];
+    int client_socket = request->client_socket;
+    int64_t payload_len = -1;
+
+    // unframed blocks are encoded after the up to 7 bits carried over from
+    // the one before, which can take a byte more than a block on its own
+    uint64_t bits_cap = compressed_bound(request->c_info, FRAME_BLOCK_SIZE) +
+                        1;
+
+    if (!reserve_request_memory(s_info, request, FRAME_BLOCK_SIZE + bits_cap))
+    {
+        handle_error(s_info, client_socket, request);
+        rearm_connection(s_info, client_socket);
+
+        free(request);
+        return;
+    }
+
+    FILE* spool = tmpfile();
+    uint8_t* block = malloc(sizeof(*block)*FRAME_BLOCK_SIZE);
+    uint8_t* bits = malloc(sizeof(*bits)*bits_cap);
+
+    if (spool != NULL)
+    {
+        payload_len = spool_compressed_echo(request, s_info, block, bits, 
+                                        fileno(spool));
+    }
+
+    free(block);
+    free(bits);
+
+    // what is left of the payload can't be told apart from the next request
+    if (payload_len < 0)
+    {
+        perror("failed to compress echo payload");
+        handle_error(s_info, client_socket, request);
+    }
+
+    rearm_connection(s_info, client_socket);
+
+    if (payload_len >= 0)
+    {
+        size_t header_len = stream_echo_header(request, header, payload_len,
+                                            true);
+        off_t offset = 0;
+        int ret;
+
+        struct connection* c = lock_connection_send(&s_info->connections,
+                                                client_socket);
+        cork_response(s_info, client_socket, true);
+
+        ret = send_all(client_socket, header, header_len);
+
+        while (ret == 0 && offset < payload_len)
+        {
+            if (sendfile(client_socket, fileno(spool), &offset, 
+                    payload_len - offset) <= 0)
+            {
+                ret = -1;
+            }
+        }
+
+        cork_response(s_info, client_socket, false);
+        unlock_connection_send(c);
+
+        if (ret < 0)
+        {
+            perror("failed to send compressed echo payload");
+            shutdown(client_socket, SHUT_RDWR);
+        }
+    }
+
+    if (spool != NULL)
+    {
+        fclose(spool);
+    }
+
+    free(request);
+}
+
+
+void handle_echo(struct request* request, struct server_info* s_info)
+{
+    if (request->payload_pending && request->compress_response &&
+        !request->payload_compressed)
+    {
+        stream_compressed_echo(request, s_info);
+        return;
+    }
+
+    if (request->payload_pending)
+    {
+        stream_echo(request, s_info);
+        return;
+    }
+    
+    if (request->compress_response && !request->payload_compressed)
+    {
+        if (!reserve_request_memory(s_info, request, 
+                compressed_bound(request->c_info, request->payload_len)))
+        {
+            handle_error(s_info, request->client_socket, request);
+
+            free_buffer(request->payload);
+            free(request);
+            return;
+        }
+
+        compress_response_payload(s_info, request, &request->payload,
+                 &request->payload_len);   
+    }
+        
+    uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ];
+
+    // copying message header byte
+    header[0] = ECHO_RESPONSE << 4;
+
+    if (request->payload_compressed || request->compress_response)
+    {   
+        set_compressed_bits(request, &header[0]);
+        
+    }
+
+    // copying payload len 
+    uint64_t be_len = htobe64(request->payload_len);
+    memcpy(header + 1, &be_len, PAYLOAD_LEN_SZ);
+
+    // the payload is sent from where it was read into
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = request->payload;
+    iov[1].iov_len = request->payload_len;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    
+    ssize_t bytes_sent = send_response_msg(s_info, request, &msg);
+
+    if (bytes_sent != sizeof(header) + request->payload_len)
+        perror("failed to send all bytes");
+
+    
+    if (request->payload_len > 0)
+        free_buffer(request->payload);
+    free(request);
+    
+}
+
+// returns a list of the regular file names of every target directory,
+// separated by null bytes. A name held by several directories is listed once
+uint8_t* get_list_of_files(struct volume_set* vs, uint64_t* files_len)
+{
+    *files_len = 0;
+    size_t max_len = LIST_PAGE_SZ;
+    uint8_t* files = alloc_buffer(sizeof(*files)*max_len);
+    struct list_cursor cursor = {0};
+    size_t page_len;
+    int ret;
+
+    // growing the buffer whenever the next name doesn't fit
+    while ((ret = list_volume_files(vs, &cursor, files + *files_len, 
+                    max_len - *files_len, &page_len)) == 0)
+    {
+        *files_len += page_len;
+        max_len *= 2;
+        files = realloc_buffer(files, sizeof(*files)*max_len);
+    }
+
+    *files_len += page_len;
+
+    if (ret < 0)
+    {
+        perror("couldn't read target directory ");
+    }
+
+    // if no files in directory - setting null byte
+    if (*files_len == 0)
+    {
+        files[0] = NULL_BYTE;
+        *files_len += 1;
+    }
+
+
+    return files;
+}
+
+// handles directory listing request - sends file names 
+void handle_dir_listing(struct request* request, struct server_info* s_info)
+{
+    uint64_t payload_len = 0;
+    
+    uint8_t* payload = get_list_of_files(s_info->volumes, &payload_len);
+
+    if (s_info->upstream != NULL)
+    {
+        if (upstream_merge_listing(s_info->upstream, s_info, request,
+                &payload, &payload_len) < 0)
+        {
+            handle_error(s_info, request->client_socket, request);
+
+            free_buffer(payload);
+            free(request);
+            return;
+        }
+    }
+
+    // the listing grows with the directories, so it is only known here
+    if (!reserve_request_memory(s_info, request,
+            payload_len + response_memory(request, payload_len)))
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(payload);
+        free(request);
+        return;
+    }
+
+    if (request->compress_response)
+    {
+        compress_response_payload(s_info, request, &payload, &payload_len);
+    }
+
+    uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
+    uint8_t* response = alloc_buffer(sizeof(*response)*response_size);
+
+    // construct response
+    response[0] = DIR_LIST_RESPONSE << 4;
+
+    if (request->compress_response)
+    {
+        set_compressed_bits(request, &response[0]);
+    }
+
+    uint64_t be_len = htobe64(payload_len);
+
+    memcpy(response + 1, &be_len, PAYLOAD_LEN_SZ);
+    memcpy(response + 9, payload, payload_len);
+
+    ssize_t bytes_sent = send_response(s_info, request, response,
+                                        response_size);
+
+    if (bytes_sent != response_size)
+        perror("failed to send all bytes");
+
+    free_buffer(payload);
+    free_buffer(response);
+    free(request);
+}
+
+
+// looks up a regular file in the target directories relative to their
+// cached directory fds, so no path has to be built and nothing is opened.
+// Files they don't have are looked up on the upstream server, if any
+int stat_target_file(struct server_info* s_info, char* file_name, 
+    struct stat* st)
+{
+    if (find_volume_file(s_info->volumes, file_name, st) < 0 &&
+        (s_info->upstream == NULL ||
+        upstream_stat(s_info->upstream, file_name, st) < 0))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// opens a file of the target directories for reading, or the cached copy
+// of one of the upstream server's. Returns -1 if neither has it
+int open_target_file(struct server_info* s_info, char* file_name, 
+    struct stat* st)
+{
+    int fd = open_volume_file(s_info->volumes, file_name, st);
+
+    if (fd < 0 && s_info->upstream != NULL)
+    {
+        fd = upstream_open_file(s_info->upstream, file_name, st);
+    }
+
+    return fd;
+}
+
+
+void handle_file_size_query(struct request* request, struct server_info* s_info)
+{      
+    struct stat st;
+
+    // the file name isn't necessarily null terminated
+    char* file_name = malloc(sizeof(char)*(request->payload_len + 1));
+    memcpy(file_name, request->payload, request->payload_len);
+    file_name[request->payload_len] = NULL_BYTE;
+
+    // file doesnt exist
+    if (request->payload_len == 0 || 
+        stat_target_file(s_info, file_name, &st) < 0)
+    {
+        handle_error(s_info, request->client_socket, request);   
+    }
+    else
+    {
+        uint64_t file_size = st.st_size;
+        uint64_t be_file_size = htobe64(file_size);
+
+        uint64_t payload_len = 8;
+        uint8_t* payload = alloc_buffer(sizeof(*payload)*payload_len);
+        
+        memcpy(payload, &be_file_size, 8);
+
+        if (request->compress_response)
+        {
+            compress_response_payload(s_info, request, &payload, 
+                                    &payload_len);
+        }
+
+        
+        uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
+        uint8_t* response = alloc_buffer(sizeof(*response)*response_size);
+
+        uint64_t be_len = htobe64(payload_len);
+    
+        // constructing response
+        response[0] = FILE_SIZE_RESPONSE << 4;
+
+        if (request->compress_response)
+        {
+            set_compressed_bits(request, &response[0]);
+        }
+    
+        memcpy(response + 1, &be_len, PAYLOAD_LEN_SZ);
+        memcpy(response + 9, payload, payload_len);
+
+        ssize_t bytes_sent = send_response(s_info, request, response,
+                                        response_size);
+
+        if (bytes_sent != response_size)
+            perror("failed to send all bytes");
+
+        free_buffer(response);
+        free_buffer(payload);
+    }
+        
+    
+    free(file_name);
+    free_buffer(request->payload);
+    free(request);
+    
+}
+
+
+// handles a size query for many files at once. The payload is a list of
+// file names separated by null bytes, the same format as a directory listing.
+// For every name, in order, the response holds a status byte, the file size
+// and the modification time in nanoseconds since the epoch
+void handle_file_stat_batch(struct request* request, struct server_info* s_info)
+{
+    struct stat st;
+
+    if (request->payload_len == 0)
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free(request);
+        return;
+    }
+
+    uint64_t n_names = 0;
+    for (uint64_t i = 0; i < request->payload_len; i++)
+    {
+        if (request->payload[i] == NULL_BYTE)
+        {
+            n_names++;
+        }
+    }
+
+    // a trailing name without a null byte
+    if (request->payload[request->payload_len - 1] != NULL_BYTE)
+    {
+        n_names++;
+    }
+
+    uint64_t payload_len = n_names * FILE_STAT_ENTRY_SZ;
+
+    // every name, even an empty one, gets an entry many times its size, so
+    // the entries are reserved along with the null terminated copy of the list
+    if (!reserve_request_memory(s_info, request, request->payload_len + 1 +
+            payload_len + response_memory(request, payload_len)))
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(request->payload);
+        free(request);
+        return;
+    }
+
+    // the list is null terminated so that the last name is too
+    request->payload = realloc_buffer(request->payload,
+                                    request->payload_len + 1);
+    request->payload[request->payload_len] = NULL_BYTE;
+
+    uint8_t* payload = alloc_buffer(sizeof(*payload)*payload_len);
+
+    char* name = (char*) request->payload;
+    for (uint64_t i = 0; i < n_names; i++)
+    {
+        uint8_t* entry = payload + i*FILE_STAT_ENTRY_SZ;
+        uint64_t be_file_size = 0;
+        uint64_t be_mtime = 0;
+
+        if (stat_target_file(s_info, name, &st) == 0)
+        {
+            entry[0] = FILE_STAT_OK;
+            be_file_size = htobe64(st.st_size);
+            be_mtime = htobe64((uint64_t) st.st_mtim.tv_sec * 1000000000 + 
+                                st.st_mtim.tv_nsec);
+        }
+        else
+        {
+            entry[0] = FILE_STAT_MISSING;
+        }
+
+        memcpy(entry + 1, &be_file_size, 8);
+        memcpy(entry + 9, &be_mtime, 8);
+
+        name += strlen(name) + 1;
+    }
+
+    if (request->compress_response)
+    {
+        compress_response_payload(s_info, request, &payload, &payload_len);
+    }
+
+    uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
+    uint8_t* response = alloc_buffer(sizeof(*response)*response_size);
+
+    uint64_t be_len = htobe64(payload_len);
+
+    // constructing response
+    response[0] = FILE_STAT_BATCH_RESPONSE << 4;
+
+    if (request->compress_response)
+    {
+        set_compressed_bits(request, &response[0]);
+    }
+
+    memcpy(response + 1, &be_len, PAYLOAD_LEN_SZ);
+    memcpy(response + 9, payload, payload_len);
+
+    ssize_t bytes_sent = send_response(s_info, request, response,
+                                        response_size);
+
+    if (bytes_sent != response_size)
+        perror("failed to send all bytes");
+
+    free_buffer(response);
+    free_buffer(payload);
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// builds the payload of a file retrieval response around the file data
+uint8_t* create_file_payload(uint32_t* session_id, uint64_t* start_offset,
+    uint64_t* n_bytes, uint8_t* file_data, uint64_t* payload_len)
+{
+    *payload_len = 4 + 8 + 8 + *n_bytes;
+    uint8_t* payload = alloc_buffer(sizeof(*payload)*(*payload_len));
+
+    uint64_t be_start_offset = htobe64(*start_offset);
+    uint64_t be_n_bytes = htobe64(*n_bytes);
+
+    memcpy(payload, session_id, 4);
+    memcpy(payload + 4, &be_start_offset, 8);
+    memcpy(payload + 12, &be_n_bytes, 8);
+    memcpy(payload + 20, file_data, *n_bytes);
+
+    return payload;
+}
+
+// reads the range of a flight this worker leads, encoding it when the
+// flight is for a compressed response, and hands it to the waiting workers.
+// The checksum of the range is taken while the bytes are at hand
+static void read_flight(struct server_info* s_info, struct flight* flight, 
+    FILE* f, struct stat* st)
+{
+    // copying file data, on the I/O queue of the file's device
+    uint8_t* file_data = alloc_buffer(sizeof(char)*flight->n_bytes);
+
+    if (volume_pread(s_info->volumes, fileno(f), st->st_dev, file_data, 
+            flight->n_bytes, flight->start_offset) != flight->n_bytes)
+    {
+        perror("could not read all file bytes");
+
+        free_buffer(file_data);
+        complete_flight(s_info->flights, flight, true);
+        return;
+    }
+
+    flight->crc = crc32c(0, file_data, flight->n_bytes);
+    checksum_cache_put(s_info->checksums, st, flight->start_offset, 
+                    flight->n_bytes, flight->crc);
+
+    trainer_sample(s_info->trainer, file_data, flight->n_bytes);
+
+    if (flight->c_info != NULL)
+    {
+        uint64_t bits_cap = compressed_bound(flight->c_info, flight->n_bytes);
+        flight->data = alloc_zeroed_buffer(bits_cap);
+        flight->n_bits = encode_bytes(flight->c_info, file_data, 
+                                    flight->n_bytes, flight->data, 0);
+        free_buffer(file_data);
+    }
+    else
+    {
+        flight->data = file_data;
+    }
+
+    complete_flight(s_info->flights, flight, false);
+}
+
+// sends the shared result of a flight with this request's own session id.
+// Uncompressed data is sent straight from the shared buffer, compressed data
+// only needs the header encoded and the shared bits shifted in behind it.
+// The checksum of the range follows the file bytes when asked for
+static void send_flight(struct server_info* s_info, struct request* request,
+    struct flight* flight, uint32_t* session_id, bool checksum)
+{
+    uint8_t file_header[4 + 8 + 8];
+    uint64_t be_start_offset = htobe64(flight->start_offset);
+    uint64_t be_n_bytes = htobe64(flight->n_bytes);
+    uint64_t be_payload_len;
+    ssize_t bytes_sent;
+
+    memcpy(file_header, session_id, 4);
+    memcpy(file_header + 4, &be_start_offset, 8);
+    memcpy(file_header + 12, &be_n_bytes, 8);
+
+    uint32_t be_crc = htobe32(flight->crc);
+    uint64_t trailer_len = checksum ? CHECKSUM_SZ : 0;
+
+    // framed blocks can't be shifted behind the header, so the shared file
+    // bytes are copied into a payload of their own and framed as a whole
+    if (flight->c_info == NULL && request->compress_response)
+    {
+        uint64_t payload_len = sizeof(file_header) + flight->n_bytes + 
+                            trailer_len;
+        uint8_t* payload = alloc_buffer(sizeof(*payload)*payload_len);
+
+        memcpy(payload, file_header, sizeof(file_header));
+        memcpy(payload + sizeof(file_header), flight->data, flight->n_bytes);
+        memcpy(payload + sizeof(file_header) + flight->n_bytes, &be_crc, 
+                trailer_len);
+
+        compress_response_payload(s_info, request, &payload, &payload_len);
+
+        uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ];
+        header[0] = FILE_RETRIEVE_RESPONSE << 4;
+        set_compressed_bits(request, &header[0]);
+
+        be_payload_len = htobe64(payload_len);
+        memcpy(header + 1, &be_payload_len, 8);
+
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = payload;
+        iov[1].iov_len = payload_len;
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        bytes_sent = send_response_msg(s_info, request, &msg);
+
+        if (bytes_sent != sizeof(header) + payload_len)
+            perror("failed to send all bytes");
+
+        free_buffer(payload);
+        return;
+    }
+
+    if (flight->c_info == NULL)
+    {
+        uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ + sizeof(file_header)];
+        uint64_t response_size = sizeof(header) + flight->n_bytes + 
+                                trailer_len;
+        
+        be_payload_len = htobe64(sizeof(file_header) + flight->n_bytes + 
+                                trailer_len);
+
+        header[0] = FILE_RETRIEVE_RESPONSE << 4;
+        memcpy(header + 1, &be_payload_len, 8);
+        memcpy(header + 9, file_header, sizeof(file_header));
+
+        struct iovec iov[3];
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = flight->data;
+        iov[1].iov_len = flight->n_bytes;
+        iov[2].iov_base = &be_crc;
+        iov[2].iov_len = trailer_len;
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = checksum ? 3 : 2;
+
+        bytes_sent = send_response_msg(s_info, request, &msg);
+
+        if (bytes_sent != response_size)
+            perror("failed to send all bytes");
+
+        return;
+    }
+
+    uint64_t response_cap = MSG_HEADER_SZ + PAYLOAD_LEN_SZ +
+            compressed_bound(flight->c_info, sizeof(file_header)) +
+            (flight->n_bits + 7) / 8 + 
+            compressed_bound(flight->c_info, trailer_len);
+    uint8_t* response = alloc_zeroed_buffer(sizeof(*response)*response_cap);
+    uint8_t* payload = response + MSG_HEADER_SZ + PAYLOAD_LEN_SZ;
+
+    uint64_t n_bits = encode_bytes(flight->c_info, file_header, 
+                                sizeof(file_header), payload, 0);
+    copy_bits(payload, n_bits, flight->data, flight->n_bits);
+
+    n_bits = encode_bytes(flight->c_info, (uint8_t*) &be_crc, trailer_len,
+                        payload, n_bits + flight->n_bits);
+
+    uint64_t payload_len = finish_compressed(payload, n_bits);
+    uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + payload_len;
+
+    // constructnig response
+    response[0] = FILE_RETRIEVE_RESPONSE << 4;
+    set_compressed_bits(request, &response[0]);
+
+    be_payload_len = htobe64(payload_len);
     memcpy(response + 1, &be_payload_len, 8);
-    memcpy(response + 9, payload, payload_len);
- 
-    int bytes_sent = send(request->client_socket, response,
-                        response_size, 0);
+
+    bytes_sent = send_response(s_info, request, response, response_size);
+
+    if (bytes_sent != response_size)
+        perror("failed to send all bytes");
+
+    free_buffer(response);
+}
+
+// sends a large uncompressed file range with sendfile, straight from the
+// page cache without it ever being held in a buffer of the server
+static void stream_file_range(struct server_info* s_info, 
+    struct request* request, int fd, struct stat* st, uint32_t* session_id,
+    uint64_t start_offset, uint64_t n_bytes, bool checksum)
+{
+    int client_socket = request->client_socket;
+    uint32_t crc = 0;
+
+    if (checksum && checksum_file_range(s_info->checksums, s_info->volumes, 
+            fd, st, start_offset, n_bytes, &crc) < 0)
+    {
+        handle_error(s_info, client_socket, request);
+        return;
+    }
+
+    uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ + REQUEST_ID_SZ + 4 + 8 + 8];
+    size_t header_len = MSG_HEADER_SZ + PAYLOAD_LEN_SZ;
+    uint64_t trailer_len = checksum ? CHECKSUM_SZ : 0;
+    uint64_t be_payload_len = htobe64(4 + 8 + 8 + n_bytes + trailer_len);
+    uint64_t be_start_offset = htobe64(start_offset);
+    uint64_t be_n_bytes = htobe64(n_bytes);
+    uint32_t be_crc = htobe32(crc);
+
+    header[0] = FILE_RETRIEVE_RESPONSE << 4;
+    memcpy(header + 1, &be_payload_len, 8);
+
+    if (request->has_id)
+    {
+        SET_BIT(header[0], REQUEST_ID_BIT);
+        memcpy(header + header_len, &request->request_id, REQUEST_ID_SZ);
+        header_len += REQUEST_ID_SZ;
+    }
+
+    memcpy(header + header_len, session_id, 4);
+    memcpy(header + header_len + 4, &be_start_offset, 8);
+    memcpy(header + header_len + 12, &be_n_bytes, 8);
+    header_len += 4 + 8 + 8;
+
+    // the range is read by sendfile rather than an I/O thread, but it still
+    // takes a place on the queue of its device while it is streamed
+    if (volume_io_begin(s_info->volumes, st->st_dev) < 0)
+    {
+        handle_error(s_info, client_socket, request);
+        return;
+    }
+
+    struct connection* c = lock_connection_send(&s_info->connections,
+                                            client_socket);
+    cork_response(s_info, client_socket, true);
+
+    int ret = send_all(client_socket, header, header_len);
+    off_t offset = start_offset;
+    uint64_t remaining = n_bytes;
+
+    while (ret == 0 && remaining > 0)
+    {
+        ssize_t n_sent = sendfile(client_socket, fd, &offset, remaining);
+
+        if (n_sent <= 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        remaining -= n_sent;
+    }
+
+    if (ret == 0)
+    {
+        ret = send_all(client_socket, (uint8_t*) &be_crc, trailer_len);
+    }
+
+    cork_response(s_info, client_socket, false);
+    unlock_connection_send(c);
+
+    volume_io_end(s_info->volumes, st->st_dev);
+
+    // the response has been cut short, nothing can follow it
+    if (ret < 0)
+    {
+        perror("failed to send file range");
+        shutdown(client_socket, SHUT_RDWR);
+    }
+}
+
+
+// the most memory sending a range can take: the range, and when it is
+// compressed its encoded bits and the response built around them. Saturates
+// at UINT64_MAX rather than wrapping
+static uint64_t file_range_memory(struct request* request, uint64_t n_bytes)
+{
+    uint64_t header_len = 4 + 8 + 8 + CHECKSUM_SZ;
+
+    if (!request->compress_response)
+    {
+        return n_bytes;
+    }
+
+    if (n_bytes > UINT64_MAX - header_len)
+    {
+        return UINT64_MAX;
+    }
+
+    uint64_t bound = compressed_bound(request->c_info, header_len + n_bytes);
+
+    if (bound > (UINT64_MAX - n_bytes) / 2)
+    {
+        return UINT64_MAX;
+    }
+
+    return n_bytes + 2 * bound;
+}
+
+
+void send_file(struct server_info* s_info, struct request* request, FILE* f, 
+    char* target_file, uint64_t* file_data_size, uint32_t* session_id, 
+    uint64_t* start_offset, uint64_t* n_bytes)
+{
+    uint64_t payload_len;
+    uint8_t* payload = NULL;
+    struct stat st;
+
+    fstat(fileno(f), &st);
+
+    bool checksum = connection_flags(&s_info->connections, 
+            request->client_socket) & CONNECTION_RETRIEVAL_CHECKSUM;
+
+    if (!request->compress_response && *n_bytes > FILE_STREAM_THRESHOLD)
+    {
+        stream_file_range(s_info, request, fileno(f), &st, session_id,
+                        *start_offset, *n_bytes, checksum);
+        return;
+    }
+
+    if (!reserve_request_memory(s_info, request, 
+            file_range_memory(request, *n_bytes)))
+    {
+        handle_error(s_info, request->client_socket, request);
+        return;
+    }
+
+    // the chunk may have been read and compressed ahead of time, or be
+    // pre-encoded in the file's sidecar. Both only use the dictionary the
+    // server started with and are never framed
+    if (request->compress_response && !request->block_framed &&
+        request->c_info == s_info->c_info &&
+        (prefetch_take(s_info->prefetcher, *session_id, target_file, 
+                *start_offset, *n_bytes, &st, &payload, &payload_len) ||
+        (s_info->sidecars != NULL &&
+        sidecar_build_payload(s_info->sidecars, fileno(f), &st, target_file,
+                session_id, *start_offset, *n_bytes, &payload, 
+                &payload_len) == 0)))
+    {
+        uint32_t crc;
+
+        if (checksum)
+        {
+            if (checksum_file_range(s_info->checksums, s_info->volumes, 
+                    fileno(f), &st, *start_offset, *n_bytes, &crc) < 0)
+            {
+                handle_error(s_info, request->client_socket, request);
+
+                free_buffer(payload);
+                return;
+            }
+
+            uint32_t be_crc = htobe32(crc);
+            append_compressed(request->c_info, &payload, &payload_len, 
+                            (uint8_t*) &be_crc, CHECKSUM_SZ);
+        }
+
+        uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + 
+                            payload_len;
+        uint8_t* response = alloc_buffer(sizeof(*response)*response_size);
+        
+        uint64_t be_payload_len = htobe64(payload_len);    
+
+        // constructnig response
+        response[0] = FILE_RETRIEVE_RESPONSE << 4;
+        set_compressed_bits(request, &response[0]);
+        
+        memcpy(response + 1, &be_payload_len, 8);
+        memcpy(response + 9, payload, payload_len);
+    
+        ssize_t bytes_sent = send_response(s_info, request, response,
+                                        response_size);
+
+        if (bytes_sent != response_size)
+            perror("failed to send all bytes");
+
+        free_buffer(payload);
+        free_buffer(response);   
+        return;
+    }
+
+    // concurrent requests for the same range share one read and encode
+    bool leader;
+    struct flight* flight = join_flight(s_info->flights, target_file, &st,
+            *start_offset, *file_data_size, 
+            request->compress_response && !request->block_framed ? 
+            request->c_info : NULL, &leader);
+
+    if (leader)
+    {
+        read_flight(s_info, flight, f, &st);
+    }
+    else
+    {
+        wait_flight(s_info->flights, flight);
+    }
+
+    if (flight->failed)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        send_flight(s_info, request, flight, session_id, checksum);
+    }
+
+    release_flight(s_info->flights, flight);
+}
+
+void handle_file_retrieval(struct request* request, struct server_info* s_info)
+{
+    uint32_t session_id;
+    uint64_t start_offset;
+    uint64_t n_bytes_file;
+    char* target_file;
+    
+    if (request->payload_len < 4+8+8)
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(request->payload);
+        free(request);
+        return;
+    }
+
+    // the file name isn't necessarily null terminated
+    request->payload = realloc_buffer(request->payload,
+                                    request->payload_len + 1);
+    request->payload[request->payload_len] = NULL_BYTE;
+
+    memcpy(&session_id, request->payload, 4);
+    memcpy(&start_offset, request->payload + 4, 8);
+    memcpy(&n_bytes_file, request->payload + 12, 8);
+    target_file = (char*) (request->payload + 20);
+    // memcpy(target_file, request->payload + 20, t;arget_file_len);
+
+    start_offset = be64toh(start_offset);
+    n_bytes_file = be64toh(n_bytes_file);
+
+    // a retrieval identical to one in progress joins its flight, rather
+    // than being turned away, whatever session it belongs to. An empty
+    // range has nothing to send
+    if (n_bytes_file == 0)
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(request->payload);
+        free(request);
+        return;
+    }
+    
+    struct stat st;
+    int fd = open_target_file(s_info, target_file, &st);
+    FILE* f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    
+    uint64_t file_data_size = n_bytes_file;
+    
+
+    if (NULL == f)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        
+        handle_error(s_info, request->client_socket, request);
+    }
+    else 
+    {
+        uint64_t file_size = st.st_size;
+
+        // checking for out of range offset and lengths
+        if (start_offset > file_size ||
+            n_bytes_file > file_size - start_offset)
+        {
+            handle_error(s_info, request->client_socket, request);
+        }
+        else
+        {
+            // the next chunk is read ahead while this one is being sent
+            bool base_compressed = request->compress_response && 
+                !request->block_framed && request->c_info == s_info->c_info;
+
+            if (base_compressed)
+            {
+                sidecar_note_access(s_info->sidecars, target_file, file_size);
+            }
+
+            prefetch_note_access(s_info->prefetcher, session_id, target_file,
+                start_offset, n_bytes_file, base_compressed, file_size);
+
+            send_file(s_info, request, f, target_file, &file_data_size, 
+                        &session_id, &start_offset, &n_bytes_file);
+        }
+
+        fclose(f);
+    }    
+
+    free_buffer(request->payload);
+    free(request);
+    
+
+}
+
+
+static int compare_ranges(const void* a, const void* b)
+{
+    const struct file_range* r1 = a;
+    const struct file_range* r2 = b;
+
+    if (r1->file_index != r2->file_index)
+    {
+        return r1->file_index < r2->file_index ? -1 : 1;
+    }
+
+    if (r1->start_offset != r2->start_offset)
+    {
+        return r1->start_offset < r2->start_offset ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// sorts the ranges by file and offset and merges the ranges which overlap or
+// touch each other. Returns the number of ranges left
+size_t coalesce_ranges(struct file_range* ranges, size_t n_ranges)
+{
+    if (n_ranges == 0)
+    {
+        return 0;
+    }
+
+    qsort(ranges, n_ranges, sizeof(*ranges), compare_ranges);
+
+    size_t n_merged = 0;
+
+    for (size_t i = 1; i < n_ranges; i++)
+    {
+        struct file_range* curr = &ranges[n_merged];
+        uint64_t curr_end = curr->start_offset + curr->n_bytes;
+
+        if (ranges[i].file_index == curr->file_index &&
+            ranges[i].start_offset <= curr_end)
+        {
+            uint64_t end = ranges[i].start_offset + ranges[i].n_bytes;
+
+            if (end > curr_end)
+            {
+                curr->n_bytes = end - curr->start_offset;
+            }
+        }
+        else
+        {
+            n_merged++;
+            ranges[n_merged] = ranges[i];
+        }
+    }
+
+    return n_merged + 1;
+}
+
+// parses the file names and ranges of a multi range retrieval request. 
+// Returns the number of ranges or -1 if the payload is malformed
+static ssize_t parse_multi_retrieval(struct request* request, 
+    uint32_t* session_id, char** file_names, uint16_t* n_files,
+    struct file_range** ranges)
+{
+    uint8_t* payload = request->payload;
+    uint64_t len = request->payload_len;
+    uint64_t pos = 0;
+    uint16_t be_n_files;
+    uint32_t n_ranges;
+
+    if (len < 4 + 2)
+    {
+        return -1;
+    }
+
+    memcpy(session_id, payload, 4);
+    memcpy(&be_n_files, payload + 4, 2);
+    *n_files = be16toh(be_n_files);
+    pos = 6;
+
+    if (*n_files == 0 || *n_files > MAX_MULTI_FILES)
+    {
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < *n_files; i++)
+    {
+        uint8_t* end = memchr(payload + pos, NULL_BYTE, len - pos);
+
+        if (end == NULL || end - (payload + pos) >= MAX_FILE_NAME)
+        {
+            return -1;
+        }
+
+        file_names[i] = (char*) (payload + pos);
+        pos = end - payload + 1;
+    }
+
+    if (len - pos < 4)
+    {
+        return -1;
+    }
+
+    memcpy(&n_ranges, payload + pos, 4);
+    n_ranges = be32toh(n_ranges);
+    pos += 4;
+
+    if (n_ranges == 0 || n_ranges > MAX_MULTI_RANGES ||
+        len - pos != (uint64_t) n_ranges * (2 + 8 + 8))
+    {
+        return -1;
+    }
+
+    *ranges = malloc(sizeof(**ranges)*n_ranges);
+
+    for (uint32_t i = 0; i < n_ranges; i++)
+    {
+        uint16_t file_index;
+        uint64_t start_offset;
+        uint64_t n_bytes;
+
+        memcpy(&file_index, payload + pos, 2);
+        memcpy(&start_offset, payload + pos + 2, 8);
+        memcpy(&n_bytes, payload + pos + 10, 8);
+        pos += 18;
+
+        (*ranges)[i].file_index = be16toh(file_index);
+        (*ranges)[i].start_offset = be64toh(start_offset);
+        (*ranges)[i].n_bytes = be64toh(n_bytes);
+
+        if ((*ranges)[i].file_index >= *n_files ||
+            (*ranges)[i].start_offset + (*ranges)[i].n_bytes < 
+                (*ranges)[i].start_offset)
+        {
+            free(*ranges);
+            return -1;
+        }
+    }
+
+    return n_ranges;
+}
+
+// handles a request for many ranges, possibly across several files. The
+// ranges are coalesced and each one is framed like a single file retrieval
+// payload prefixed with the index of its file. The frames follow the
+// coalesced order, not the order the ranges were asked for in
+void handle_multi_file_retrieval(struct request* request, 
+    struct server_info* s_info)
+{
+    uint32_t session_id;
+    uint16_t n_files = 0;
+    char* file_names[MAX_MULTI_FILES];
+    struct file_range* ranges = NULL;
+    int fds[MAX_MULTI_FILES];
+    uint64_t file_sizes[MAX_MULTI_FILES];
+    dev_t file_devs[MAX_MULTI_FILES];
+    bool failed = false;
+
+    ssize_t n_ranges = parse_multi_retrieval(request, &session_id, file_names,
+                                &n_files, &ranges);
+
+    if (n_ranges < 0)
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(request->payload);
+        free(request);
+        return;
+    }
+
+    n_ranges = coalesce_ranges(ranges, n_ranges);
+
+    for (uint16_t i = 0; i < n_files; i++)
+    {
+        fds[i] = -1;
+    }
+
+    // opening each file once and checking every range is within it
+    uint64_t payload_len = 4;
+
+    for (ssize_t i = 0; i < n_ranges && !failed; i++)
+    {
+        uint16_t index = ranges[i].file_index;
+
+        if (fds[index] < 0)
+        {
+            struct stat st;
+            fds[index] = open_target_file(s_info, file_names[index],
+                                        &st);
+
+            if (fds[index] < 0)
+            {
+                failed = true;
+                break;
+            }
+
+            file_sizes[index] = st.st_size;
+            file_devs[index] = st.st_dev;
+        }
+
+        // sparse files can add up to more than the length counts
+        if (ranges[i].start_offset + ranges[i].n_bytes > file_sizes[index] ||
+            ranges[i].n_bytes > UINT64_MAX - payload_len - (2 + 4 + 8 + 8))
+        {
+            failed = true;
+            break;
+        }
+
+        payload_len += 2 + 4 + 8 + 8 + ranges[i].n_bytes;
+    }
+
+    uint8_t* payload = NULL;
+
+    uint64_t bound = request->compress_response ?
+                    compressed_bound(request->c_info, payload_len) : 0;
+
+    if (!failed && (bound > UINT64_MAX - payload_len ||
+            !reserve_request_memory(s_info, request, payload_len + bound)))
+    {
+        failed = true;
+    }
+
+    if (!failed)
+    {
+        payload = alloc_buffer(sizeof(*payload)*payload_len);
+
+        uint32_t be_n_frames = htobe32(n_ranges);
+        memcpy(payload, &be_n_frames, 4);
+
+        uint64_t pos = 4;
+
+        for (ssize_t i = 0; i < n_ranges && !failed; i++)
+        {
+            uint16_t be_index = htobe16(ranges[i].file_index);
+            uint64_t be_start_offset = htobe64(ranges[i].start_offset);
+            uint64_t be_n_bytes = htobe64(ranges[i].n_bytes);
+
+            memcpy(payload + pos, &be_index, 2);
+            memcpy(payload + pos + 2, &session_id, 4);
+            memcpy(payload + pos + 6, &be_start_offset, 8);
+            memcpy(payload + pos + 14, &be_n_bytes, 8);
+            pos += 22;
+
+            // reading the range straight into the response payload
+            uint16_t index = ranges[i].file_index;
+
+            if (volume_pread(s_info->volumes, fds[index], file_devs[index], 
+                    payload + pos, ranges[i].n_bytes, 
+                    ranges[i].start_offset) != ranges[i].n_bytes)
+            {
+                failed = true;
+            }
+
+            pos += ranges[i].n_bytes;
+        }
+    }
+
+    for (uint16_t i = 0; i < n_files; i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+
+    if (failed)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        if (request->compress_response)
+        {
+            compress_response_payload(s_info, request, &payload, 
+                                    &payload_len);
+        }
+
+        uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ];
+        uint64_t be_payload_len = htobe64(payload_len);
+
+        // constructing response
+        header[0] = FILE_MULTI_RETRIEVE_RESPONSE << 4;
+
+        if (request->compress_response)
+        {
+            set_compressed_bits(request, &header[0]);
+        }
+
+        memcpy(header + 1, &be_payload_len, 8);
+
+        // the payload is sent from where the ranges were read into
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = payload;
+        iov[1].iov_len = payload_len;
+
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        ssize_t bytes_sent = send_response_msg(s_info, request, &msg);
+
+        if (bytes_sent != sizeof(header) + payload_len)
+            perror("failed to send all bytes");
+    }
+
+    free_buffer(payload);
+    free(ranges);
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// sends the response of an extended request, the payload is prefixed with
+// the operation and compressed as a whole when the client asked for it
+void send_extended_response(struct server_info* s_info, 
+    struct request* request, uint8_t op, uint8_t* payload, 
+    uint64_t payload_len)
+{
+    send_extended_response_fd(s_info, request, op, payload, payload_len, -1);
+}
+
+
+// sends the response of an extended request with a file descriptor passed
+// along with it, when fd isn't -1. Only works on unix domain sockets
+void send_extended_response_fd(struct server_info* s_info, 
+    struct request* request, uint8_t op, uint8_t* payload, 
+    uint64_t payload_len, int fd)
+{
+    uint64_t body_len = EXT_OP_SZ + payload_len;
+
+    if (!reserve_request_memory(s_info, request,
+            body_len + response_memory(request, body_len)))
+    {
+        handle_error(s_info, request->client_socket, request);
+        return;
+    }
+
+    uint8_t* body = alloc_buffer(sizeof(*body)*body_len);
+
+    body[0] = op;
+    memcpy(body + EXT_OP_SZ, payload, payload_len);
+
+    if (request->compress_response)
+    {
+        compress_response_payload(s_info, request, &body, &body_len);
+    }
+
+    uint64_t response_size = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + body_len;
+    uint8_t* response = alloc_buffer(sizeof(*response)*response_size);
+
+    uint64_t be_len = htobe64(body_len);
+
+    // constructing response
+    response[0] = EXTENDED_RESPONSE << 4;
+
+    if (request->compress_response)
+    {
+        set_compressed_bits(request, &response[0]);
+    }
+
+    memcpy(response + 1, &be_len, PAYLOAD_LEN_SZ);
+    memcpy(response + 9, body, body_len);
+
+    struct iovec iov;
+    iov.iov_base = response;
+    iov.iov_len = response_size;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // the descriptor rides along with the first byte of the response
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if (fd >= 0)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t bytes_sent = send_response_msg(s_info, request, &msg);
 
     if (bytes_sent != response_size)
         perror("failed to send all bytes");
 
-    free(file_data);
-    free(payload);
-    free(response);   
+    free_buffer(response);
+    free_buffer(body);
 }
 
-void handle_file_retrieval(struct request* request, struct server_info* s_info)
+
+// handles a checksum request for a range of a file. The request holds the
+// start offset and length of the range followed by the file name, the
+// response holds the range and its CRC-32C
+void handle_checksum(struct request* request, struct server_info* s_info)
 {
-    uint32_t session_id;
+    uint8_t* args = request->payload + EXT_OP_SZ;
+    uint64_t args_len = request->payload_len - EXT_OP_SZ;
     uint64_t start_offset;
-    uint64_t n_bytes_file;
-    char* target_file;
-    
-
-    uint64_t file_name_len = request->payload_len - (4+8+8) +
-                                 strlen(s_info->target_dir) + 5;
-    char* file_name = malloc(sizeof(char)*file_name_len);
+    uint64_t n_bytes;
+    uint32_t crc;
+    struct stat st;
 
-    // decompressing
-    if (request->payload_compressed)
+    if (args_len <= 8 + 8)
     {
-        decompress_payload(s_info->c_info, &request->payload, 
-                            &request->payload_len);
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(request->payload);
+        free(request);
+        return;
     }
-    
-    memcpy(&session_id, request->payload, 4);
-    memcpy(&start_offset, request->payload + 4, 8);
-    memcpy(&n_bytes_file, request->payload + 12, 8);
-    target_file = (char*) (request->payload + 20);
-    // memcpy(target_file, request->payload + 20, t;arget_file_len);
 
+    memcpy(&start_offset, args, 8);
+    memcpy(&n_bytes, args + 8, 8);
     start_offset = be64toh(start_offset);
-    n_bytes_file = be64toh(n_bytes_file);
+    n_bytes = be64toh(n_bytes);
 
-    update_file_requests(s_info, &session_id, &start_offset,
-                         &n_bytes_file, target_file);
+    // the file name isn't necessarily null terminated
+    char* file_name = malloc(sizeof(char)*(args_len - 16 + 1));
+    memcpy(file_name, args + 16, args_len - 16);
+    file_name[args_len - 16] = NULL_BYTE;
 
-    // file request has already been handled by another thead
-    if (n_bytes_file == 0)
+    int fd = open_target_file(s_info, file_name, &st);
+
+    if (fd < 0 || 
+        start_offset > st.st_size || n_bytes > st.st_size - start_offset ||
+        checksum_file_range(s_info->checksums, s_info->volumes, fd, &st, 
+                            start_offset, n_bytes, &crc) < 0)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        uint8_t payload[8 + 8 + CHECKSUM_SZ];
+        uint64_t be_start_offset = htobe64(start_offset);
+        uint64_t be_n_bytes = htobe64(n_bytes);
+        uint32_t be_crc = htobe32(crc);
+
+        memcpy(payload, &be_start_offset, 8);
+        memcpy(payload + 8, &be_n_bytes, 8);
+        memcpy(payload + 16, &be_crc, CHECKSUM_SZ);
+
+        send_extended_response(s_info, request, EXT_CHECKSUM, payload, 
+                            sizeof(payload));
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    free(file_name);
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// sets the per connection settings from the flags byte of the request and
+// responds with the flags now in effect. With CONNECTION_RETRIEVAL_CHECKSUM
+// set, every FILE_RETRIEVE response has the CRC-32C of its range appended
+void handle_connection_flags(struct request* request, 
+    struct server_info* s_info)
+{
+    if (request->payload_len != EXT_OP_SZ + 1)
     {
-        handle_error(request->client_socket);
+        handle_error(s_info, request->client_socket, request);
 
-        free(file_name);
-        free(request->payload);
+        free_buffer(request->payload);
         free(request);
         return;
     }
-    
 
-    sprintf(file_name, "%s/%s", s_info->target_dir, request->payload + 20);   
+    uint8_t flags = request->payload[EXT_OP_SZ] & CONNECTION_FLAGS_MASK;
 
-    FILE* f = fopen(file_name, "r");
-    
-    uint64_t file_data_size = n_bytes_file;
-    
+    set_connection_flags(&s_info->connections, request->client_socket, 
+                        flags);
 
-    if (NULL == f)
+    send_extended_response(s_info, request, EXT_CONNECTION_FLAGS, &flags, 1);
+
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// sends a dictionary version in the compression.dict format, prefixed with
+// its id. An empty request asks for the latest version
+void handle_get_dictionary(struct request* request, 
+    struct server_info* s_info)
+{
+    uint64_t args_len = request->payload_len - EXT_OP_SZ;
+    uint32_t id;
+
+    if (args_len == 0)
     {
-        
-        handle_error(request->client_socket);
+        id = latest_dictionary_id(s_info->trainer);
     }
-    else 
+    else if (args_len == DICTIONARY_ID_SZ)
     {
-        
-        fseek(f, 0, SEEK_END); 
-        uint64_t file_size = ftell(f);
-        fseek(f, 0, SEEK_SET);
+        memcpy(&id, request->payload + EXT_OP_SZ, DICTIONARY_ID_SZ);
+        id = be32toh(id);
+    }
+    else
+    {
+        id = UINT32_MAX;
+    }
 
-        // checking for out of range offset and lengths
-        if (start_offset < 0 || (start_offset + n_bytes_file) > file_size)
-        {
-            handle_error(request->client_socket);
-        }
-        else
+    struct compression_info* c_info = acquire_dictionary(s_info->trainer, id);
+
+    if (c_info == NULL)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        size_t dict_len;
+        uint8_t* dict = write_dictionary(c_info->codes, &dict_len);
+
+        uint64_t payload_len = DICTIONARY_ID_SZ + dict_len;
+        uint8_t* payload = alloc_buffer(sizeof(*payload)*payload_len);
+        uint32_t be_id = htobe32(id);
+
+        memcpy(payload, &be_id, DICTIONARY_ID_SZ);
+        memcpy(payload + DICTIONARY_ID_SZ, dict, dict_len);
+
+        release_dictionary(s_info->trainer, c_info);
+
+        send_extended_response(s_info, request, EXT_GET_DICTIONARY, payload,
+                            payload_len);
+
+        free_buffer(payload);
+        free(dict);
+    }
+
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// selects the dictionary version used for the payloads of the following
+// requests of the connection. The response itself still uses the previous one
+void handle_select_dictionary(struct request* request, 
+    struct server_info* s_info)
+{
+    uint32_t id;
+    struct compression_info* c_info = NULL;
+
+    if (request->payload_len == EXT_OP_SZ + DICTIONARY_ID_SZ)
+    {
+        memcpy(&id, request->payload + EXT_OP_SZ, DICTIONARY_ID_SZ);
+        id = be32toh(id);
+
+        c_info = acquire_dictionary(s_info->trainer, id);
+    }
+
+    if (c_info == NULL)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        release_dictionary(s_info->trainer, c_info);
+        set_connection_dictionary(&s_info->connections, 
+                                request->client_socket, id);
+
+        uint32_t be_id = htobe32(id);
+        send_extended_response(s_info, request, EXT_SELECT_DICTIONARY,
+                            (uint8_t*) &be_id, DICTIONARY_ID_SZ);
+    }
+
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// sends one page of the directory listing. The request holds the cursor the
+// previous page ended at, or nothing for the first page, and the response
+// holds the cursor of the next page followed by the file names separated by
+// null bytes. The cursor of the last page has the directory LIST_END_VOLUME
+void handle_list_files(struct request* request, struct server_info* s_info)
+{
+    uint64_t args_len = request->payload_len - EXT_OP_SZ;
+    struct list_cursor cursor = {0};
+
+    if (args_len != 0 && args_len != LIST_CURSOR_SZ)
+    {
+        handle_error(s_info, request->client_socket, request);
+
+        free_buffer(request->payload);
+        free(request);
+        return;
+    }
+
+    if (args_len == LIST_CURSOR_SZ)
+    {
+        memcpy(&cursor.volume, request->payload + EXT_OP_SZ, 2);
+        memcpy(&cursor.position, request->payload + EXT_OP_SZ + 2, 8);
+        cursor.volume = be16toh(cursor.volume);
+        cursor.position = be64toh(cursor.position);
+    }
+
+    uint8_t* payload = alloc_buffer(sizeof(*payload)*(LIST_CURSOR_SZ + 
+                                                LIST_PAGE_SZ));
+    size_t names_len = 0;
+    int ret = 1;
+
+    if (cursor.volume != LIST_END_VOLUME)
+    {
+        ret = list_volume_files(s_info->volumes, &cursor, 
+                    payload + LIST_CURSOR_SZ, LIST_PAGE_SZ, &names_len);
+    }
+
+    if (ret < 0)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        if (ret == 1)
         {
-            send_file(s_info, request, f, &file_data_size, &session_id,
-                         &start_offset, &n_bytes_file);
+            cursor.volume = LIST_END_VOLUME;
+            cursor.position = 0;
         }
 
-    }    
+        uint16_t be_volume = htobe16(cursor.volume);
+        uint64_t be_position = htobe64(cursor.position);
 
-    free(file_name);
-    free(request->payload);
+        memcpy(payload, &be_volume, 2);
+        memcpy(payload + 2, &be_position, 8);
+
+        send_extended_response(s_info, request, EXT_LIST_FILES, payload,
+                            LIST_CURSOR_SZ + names_len);
+    }
+
+    free_buffer(payload);
+    free_buffer(request->payload);
     free(request);
-    
+}
+
+
+// hands a read only descriptor of a file to a client on the same host, so
+// that it can read or map the file itself without any of it going through
+// the socket. The request holds the file name and the response holds the
+// size of the file, with the descriptor passed alongside
+void handle_open_file(struct request* request, struct server_info* s_info)
+{
+    uint64_t args_len = request->payload_len - EXT_OP_SZ;
+    struct stat st;
+    int fd = -1;
+
+    // descriptors can only be passed over the unix domain socket
+    if (args_len > 0 && args_len < MAX_FILE_NAME &&
+        connection_is_local(&s_info->connections, request->client_socket))
+    {
+        char file_name[MAX_FILE_NAME];
+        memcpy(file_name, request->payload + EXT_OP_SZ, args_len);
+        file_name[args_len] = NULL_BYTE;
+
+        fd = open_target_file(s_info, file_name, &st);
+    }
+
+    if (fd < 0)
+    {
+        handle_error(s_info, request->client_socket, request);
+    }
+    else
+    {
+        uint64_t be_file_size = htobe64(st.st_size);
+
+        send_extended_response_fd(s_info, request, EXT_OPEN_FILE, 
+                            (uint8_t*) &be_file_size, 8, fd);
+        close(fd);
+    }
+
+    free_buffer(request->payload);
+    free(request);
+}
+
+
+// handles the operations that don't have a message type of their own
+void handle_extended(struct request* request, struct server_info* s_info)
+{
+    uint8_t op = request->payload_len >= EXT_OP_SZ ? request->payload[0] : 0;
+
+    if (op == EXT_CHECKSUM)
+    {
+        handle_checksum(request, s_info);
+    }
+    else if (op == EXT_CONNECTION_FLAGS)
+    {
+        handle_connection_flags(request, s_info);
+    }
+    else if (op == EXT_GET_DICTIONARY)
+    {
+        handle_get_dictionary(request, s_info);
+    }
+    else if (op == EXT_SELECT_DICTIONARY)
+    {
+        handle_select_dictionary(request, s_info);
+    }
+    else if (op == EXT_LIST_FILES)
+    {
+        handle_list_files(request, s_info);
+    }
+    else if (op == EXT_OPEN_FILE)
+    {
+        handle_open_file(request, s_info);
+    }
+    else
+    {
+        handle_error(s_info, request->client_socket, request);
 
-}
\ No newline at end of file
+        free_buffer(request->payload);
+        free(request);
+    }
+}
@@ -18,6 +18,12 @@
 #include <stdint.h>
 #include <endian.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/errqueue.h>
 
 #include "server.h"
 
@@ -35,6 +41,17 @@
 #define PAYLOAD_COMPRESSED_BIT (4)
 #define COMPRESS_RESPONSE_BIT (5)
 
+// compressed payloads use the block framed format, see compression.c
+#define BLOCK_FRAMED_BIT (6)
+
+// a request id follows the payload length, and is sent back the same way
+// with the response. Requests with ids can be answered out of order
+#define REQUEST_ID_BIT (7)
+#define REQUEST_ID_SZ (4)
+
+// buffers a response may be sent from
+#define MAX_RESPONSE_IOV (4)
+
 // defining all types digits for message headers
 #define ERROR_RESPONSE (0xf)
 #define ECHO_REQUEST (0x0)
@@ -46,10 +63,78 @@
 #define FILE_RETRIEVE_REQUEST (0x6)
 #define FILE_RETRIEVE_RESPONSE (0x7)
 #define SHUTDOWN_REQUEST (0x8)
+
+// a multi range retrieval asks for ranges of several files. Its response
+// isn't in request order: it holds the number of frames, then one frame per
+// range left once each file's ranges are sorted by offset and those which
+// overlap or touch are merged, by file index and then offset. A frame is
+// the file index, session id, start offset and length of its range, then
+// its bytes, and every requested range lies within the one frame of its
+// file which covers its start
+#define FILE_MULTI_RETRIEVE_REQUEST (0x9)
+#define FILE_MULTI_RETRIEVE_RESPONSE (0xa)
+#define FILE_STAT_BATCH_REQUEST (0xb)
+#define FILE_STAT_BATCH_RESPONSE (0xc)
+#define EXTENDED_REQUEST (0xd)
+#define EXTENDED_RESPONSE (0xe)
 #define NULL_BYTE (0x00)
 
 #define MAX_FILE_NAME (160)
 
+// status byte, size and mtime of each file in a batched size query
+#define FILE_STAT_ENTRY_SZ (1 + 8 + 8)
+#define FILE_STAT_OK (0x0)
+#define FILE_STAT_MISSING (0x1)
+
+// the first payload byte of an extended request, and of its response, is the
+// operation it carries
+#define EXT_OP_SZ (1)
+#define EXT_CHECKSUM (0x01)
+#define EXT_CONNECTION_FLAGS (0x02)
+#define EXT_GET_DICTIONARY (0x03)
+#define EXT_SELECT_DICTIONARY (0x04)
+
+#define DICTIONARY_ID_SZ (4)
+
+#define EXT_LIST_FILES (0x05)
+
+// a listing page holds at most this many bytes of file names, and a cursor
+// is the directory index followed by the offset within it
+#define LIST_PAGE_SZ (64 * 1024)
+#define LIST_CURSOR_SZ (2 + 8)
+#define LIST_END_VOLUME (0xffff)
+
+#define EXT_OPEN_FILE (0x06)
+
+// echo payloads larger than this are never held in memory whole. They are
+// spliced straight back as they come in, a client has to read the response
+// while it is still sending one, or compressed a chunk at a time into a
+// spool file the response is sent from
+#define ECHO_STREAM_THRESHOLD (16 * 1024 * 1024)
+#define STREAM_CHUNK_SZ (64 * 1024)
+
+// splice flags, which the C library only declares along with _GNU_SOURCE
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE (0x01)
+#define SPLICE_F_MORE (0x04)
+#endif
+
+// uncompressed file ranges larger than this are sent straight from the page
+// cache
+#define FILE_STREAM_THRESHOLD (1024 * 1024)
+
+// responses built in memory of at least this many bytes are sent with
+// MSG_ZEROCOPY to clients over TCP, 0 always copies them
+#define ZEROCOPY_MIN_BYTES (0)
+
+// parts of a response sent with MSG_ZEROCOPY this small are copied rather
+// than held until the kernel is done with them
+#define ZEROCOPY_COPY_MAX (256)
+
+// limits on a single multi range retrieval
+#define MAX_MULTI_FILES (1024)
+#define MAX_MULTI_RANGES (1 << 20)
+
 
 
 struct request {
@@ -57,45 +142,127 @@ struct request {
     uint8_t msg_type;
     bool payload_compressed;
     bool compress_response;
+    bool block_framed;
+
+    // id of a multiplexed request, kept in network order
+    bool has_id;
+    uint32_t request_id;
+
+    // dictionary of the connection, held while the request is handled
+    struct compression_info* c_info;
+
     uint64_t payload_len;
     uint8_t* payload;
+
+    // the payload is left in the socket to be streamed, the connection is
+    // only rearmed once it has been read
+    bool payload_pending;
+
+    // bytes of the memory budget held by the request's buffers, released
+    // once it has been handled
+    uint64_t* reserved;
 };
 
-struct file_request{
-    uint32_t session_id;
+// a range of a file in a multi range retrieval, file_index refers to the
+// list of file names sent with the request
+struct file_range {
+    uint16_t file_index;
     uint64_t start_offset;
     uint64_t n_bytes;
-    char file_name[MAX_FILE_NAME];
-    bool completed;
 };
 
 
 
 
 struct request* construct_request(struct server_info* s_info,
-                         int client_socket);
+                         int client_socket, uint64_t* reserved);
 
 int handle_request(int client_socket, struct server_info* info);
 
-void handle_error(int client_socket);
+int shed_request(int client_socket, struct server_info* s_info);
+
+ssize_t send_response_msg(struct server_info* s_info, struct request* request,
+    struct msghdr* msg);
+
+ssize_t send_response(struct server_info* s_info, struct request* request,
+    uint8_t* response, size_t response_size);
+
+void rearm_connection(struct server_info* s_info, int client_socket);
+
+int reap_zerocopy(struct server_info* s_info, int client_socket, 
+    bool* copied);
+
+void send_error(struct server_info* s_info, int client_socket,
+    struct request* request);
+
+void handle_error(struct server_info* s_info, int client_socket,
+    struct request* request);
+
+bool reserve_request_memory(struct server_info* s_info, 
+    struct request* request, uint64_t bytes);
+
+int decompress_request(struct server_info* s_info, struct request* request);
+
+void compress_response_payload(struct server_info* s_info, 
+    struct request* request, uint8_t** payload, uint64_t* payload_len);
+
+void set_compressed_bits(struct request* request, uint8_t* msg_header);
 
 void handle_echo(struct request* request, struct server_info* s_info);
 
-uint8_t* get_list_of_files(char* target_dir, uint64_t* files_len);
+uint8_t* get_list_of_files(struct volume_set* vs, uint64_t* files_len);
 
 void handle_dir_listing(struct request* request, struct server_info* info);
 
+int stat_target_file(struct server_info* s_info, char* file_name, 
+    struct stat* st);
+
+int open_target_file(struct server_info* s_info, char* file_name, 
+    struct stat* st);
+
 void handle_file_size_query(struct request* request, struct server_info* s_info);
 
-int update_file_requests(struct server_info* s_info, uint32_t* session_id, 
-        uint64_t* start_offset, uint64_t* n_bytes, char* file_name);
+void handle_file_stat_batch(struct request* request, struct server_info* s_info);
+
+uint8_t* create_file_payload(uint32_t* session_id, uint64_t* start_offset,
+    uint64_t* n_bytes, uint8_t* file_data, uint64_t* payload_len);
 
 void send_file(struct server_info* s_info, struct request* request, 
-    FILE* f, uint64_t* file_data_size, uint32_t* session_id, 
-    uint64_t* start_offset, uint64_t* n_bytes);
+    FILE* f, char* target_file, uint64_t* file_data_size, 
+    uint32_t* session_id, uint64_t* start_offset, uint64_t* n_bytes);
 
 void handle_file_retrieval(struct request* request, struct server_info* s_info);
 
+size_t coalesce_ranges(struct file_range* ranges, size_t n_ranges);
+
+void handle_multi_file_retrieval(struct request* request, 
+    struct server_info* s_info);
+
+void send_extended_response(struct server_info* s_info, 
+    struct request* request, uint8_t op, uint8_t* payload, 
+    uint64_t payload_len);
+
+void send_extended_response_fd(struct server_info* s_info, 
+    struct request* request, uint8_t op, uint8_t* payload, 
+    uint64_t payload_len, int fd);
+
+void handle_checksum(struct request* request, struct server_info* s_info);
+
+void handle_connection_flags(struct request* request, 
+    struct server_info* s_info);
+
+void handle_get_dictionary(struct request* request, 
+    struct server_info* s_info);
+
+void handle_select_dictionary(struct request* request, 
+    struct server_info* s_info);
+
+void handle_list_files(struct request* request, struct server_info* s_info);
+
+void handle_open_file(struct request* request, struct server_info* s_info);
+
+void handle_extended(struct request* request, struct server_info* s_info);
+
 
 
 
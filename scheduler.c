@@ -0,0 +1,427 @@
+#include "scheduler.h"
+#include "requests.h"
+
+// This file contains the scheduler sitting between the accepter thread and
+// the workers. Small requests go through a fifo priority lane, everything
+// else is shared out between connections by deficit round robin on bytes.
+// Each lane runs CoDel on the time requests wait in it: once waits have
+// stayed above the target for an interval, requests leaving the lane are
+// shed at an increasing rate until the lane drains, instead of every
+// request being served too late to be of use.
+
+
+void init_scheduler(struct scheduler* s, uint64_t shed_target_ms,
+    uint64_t shed_interval_ms)
+{
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work_cond, NULL);
+
+    s->prio_head = NULL;
+    s->prio_tail = NULL;
+    s->bulk_head = NULL;
+    s->bulk_tail = NULL;
+
+    s->cap_flows = 64;
+    s->flows = calloc(s->cap_flows, sizeof(*s->flows));
+
+    s->n_queued = 0;
+    s->closed = false;
+
+    s->shed_target_ms = shed_target_ms;
+    s->shed_interval_ms = shed_interval_ms;
+    memset(&s->prio_codel, 0, sizeof(s->prio_codel));
+    memset(&s->bulk_codel, 0, sizeof(s->bulk_codel));
+}
+
+
+// adds up the lengths a client announced, which can be anything, saturating
+// instead of wrapping round to a small cost
+static uint64_t add_cost(uint64_t a, uint64_t b)
+{
+    return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+}
+
+
+// peeks at the pending request without consuming it and estimates how many
+// bytes serving it will move. Small requests belong in the priority lane
+void classify_request(int client_socket, struct request_class* rc)
+{
+    uint8_t peek[CLASSIFY_PEEK_SZ];
+    uint64_t payload_len;
+    uint64_t n_bytes;
+
+    int bytes_peeked = recv(client_socket, peek, CLASSIFY_PEEK_SZ,
+                            MSG_PEEK | MSG_DONTWAIT);
+
+    rc->closed = false;
+    rc->has_session = false;
+
+    // closed connections are cheap to deal with
+    if (bytes_peeked == 0)
+    {
+        rc->cost = 0;
+        rc->priority = true;
+        rc->closed = true;
+        return;
+    }
+
+    // header not fully arrived yet, so keep it out of the way of small requests
+    if (bytes_peeked < MSG_HEADER_SZ + PAYLOAD_LEN_SZ)
+    {
+        rc->cost = DRR_QUANTUM;
+        rc->priority = false;
+        return;
+    }
+
+    uint8_t msg_type = peek[0] >> 4;
+    memcpy(&payload_len, peek + 1, PAYLOAD_LEN_SZ);
+    payload_len = be64toh(payload_len);
+
+    // where the payload starts, behind the id of a multiplexed request
+    int p = MSG_HEADER_SZ + PAYLOAD_LEN_SZ + 
+            (IS_BIT_SET(peek[0], REQUEST_ID_BIT) ? REQUEST_ID_SZ : 0);
+
+    rc->cost = payload_len;
+
+    if (msg_type == ECHO_REQUEST)
+    {
+        // the payload comes back out again
+        rc->cost = add_cost(payload_len, payload_len);
+    }
+    else if (msg_type == DIR_LIST_REQUEST)
+    {
+        // the listing size is unknown until the directory is read
+        rc->cost = PRIORITY_THRESHOLD;
+    }
+    else if (msg_type == FILE_RETRIEVE_REQUEST)
+    {
+        // a compressed request hides the range length, so assume it is large
+        if (IS_BIT_SET(peek[0], PAYLOAD_COMPRESSED_BIT) ||
+            bytes_peeked < p + 20)
+        {
+            rc->cost = DRR_QUANTUM;
+        }
+        else
+        {
+            memcpy(&n_bytes, peek + p + 12, 8);
+            rc->cost = add_cost(payload_len, be64toh(n_bytes));
+
+            memcpy(&rc->session_id, peek + p, 4);
+            rc->session_id = be32toh(rc->session_id);
+            rc->has_session = true;
+        }
+    }
+    else if (msg_type == EXTENDED_REQUEST && bytes_peeked >= p + 1 + 16 &&
+            peek[p] == EXT_CHECKSUM && 
+            !IS_BIT_SET(peek[0], PAYLOAD_COMPRESSED_BIT))
+    {
+        // the whole range gets read unless its checksum is cached
+        memcpy(&n_bytes, peek + p + 1 + 8, 8);
+        rc->cost = add_cost(payload_len, be64toh(n_bytes));
+    }
+    else if (msg_type == FILE_MULTI_RETRIEVE_REQUEST)
+    {
+        // the ranges only get added up once the whole payload is read
+        rc->cost = DRR_QUANTUM;
+    }
+
+    rc->cost = rc->cost < MAX_REQUEST_COST ? rc->cost : MAX_REQUEST_COST;
+    rc->priority = rc->cost < PRIORITY_THRESHOLD;
+}
+
+
+static struct flow* get_flow(struct scheduler* s, int fd)
+{
+    if (fd >= s->cap_flows)
+    {
+        size_t new_cap = s->cap_flows;
+        while (fd >= new_cap)
+        {
+            new_cap *= 2;
+        }
+
+        s->flows = realloc(s->flows, sizeof(*s->flows)*new_cap);
+        memset(s->flows + s->cap_flows, 0,
+                sizeof(*s->flows)*(new_cap - s->cap_flows));
+        s->cap_flows = new_cap;
+    }
+
+    if (s->flows[fd] == NULL)
+    {
+        s->flows[fd] = calloc(1, sizeof(struct flow));
+        s->flows[fd]->fd = fd;
+    }
+
+    return s->flows[fd];
+}
+
+
+static void push_flow(struct flow** head, struct flow** tail, struct flow* f)
+{
+    f->next = NULL;
+
+    if (*tail == NULL)
+    {
+        *head = f;
+    }
+    else
+    {
+        (*tail)->next = f;
+    }
+
+    *tail = f;
+}
+
+
+static struct flow* pop_flow(struct flow** head, struct flow** tail)
+{
+    struct flow* f = *head;
+
+    *head = f->next;
+    if (*head == NULL)
+    {
+        *tail = NULL;
+    }
+
+    f->next = NULL;
+    return f;
+}
+
+
+// queues a client socket which has a request waiting to be read, as
+// classified by classify_request
+void scheduler_enqueue(struct scheduler* s, int client_socket,
+    struct request_class* rc)
+{
+    pthread_mutex_lock(&s->lock);
+
+    struct flow* f = get_flow(s, client_socket);
+
+    if (s->closed || f->queued)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    f->queued = true;
+    f->priority = rc->priority;
+    f->cost = rc->cost;
+    f->enqueued_ms = now_ms();
+
+    if (rc->priority)
+    {
+        push_flow(&s->prio_head, &s->prio_tail, f);
+    }
+    else
+    {
+        f->deficit = 0;
+        push_flow(&s->bulk_head, &s->bulk_tail, f);
+    }
+
+    s->n_queued++;
+
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+// picks the next bulk connection using deficit round robin. Each visit
+// hands a connection a quantum of credit and it is served once its credit
+// covers the cost of its request. Rounds in which nobody could be served
+// are skipped in one go so that huge requests don't spin the lock
+static struct flow* next_bulk_flow(struct scheduler* s)
+{
+    struct flow* f;
+    uint64_t rounds;
+    uint64_t min_rounds;
+
+    while (true)
+    {
+        min_rounds = UINT64_MAX;
+
+        for (f = s->bulk_head; f != NULL; f = f->next)
+        {
+            f->deficit += DRR_QUANTUM;
+
+            if (f->deficit >= (int64_t) f->cost)
+            {
+                break;
+            }
+
+            rounds = (f->cost - f->deficit + DRR_QUANTUM - 1) / DRR_QUANTUM;
+            if (rounds < min_rounds)
+            {
+                min_rounds = rounds;
+            }
+        }
+
+        if (f != NULL)
+        {
+            break;
+        }
+
+        for (f = s->bulk_head; f != NULL; f = f->next)
+        {
+            f->deficit += (min_rounds - 1) * DRR_QUANTUM;
+        }
+    }
+
+    // connections visited before f go to the back of the ring
+    while (s->bulk_head != f)
+    {
+        push_flow(&s->bulk_head, &s->bulk_tail,
+                    pop_flow(&s->bulk_head, &s->bulk_tail));
+    }
+
+    pop_flow(&s->bulk_head, &s->bulk_tail);
+
+    // a connection only ever has one request queued, so its credit is
+    // dropped once it has been served
+    f->deficit = 0;
+
+    return f;
+}
+
+
+// the next shed of a lane, sooner the longer it has been shedding
+static uint64_t codel_control_law(struct scheduler* s, uint64_t t,
+    uint32_t count)
+{
+    return t + (uint64_t) (s->shed_interval_ms / sqrt(count));
+}
+
+
+// decides whether a request leaving a lane after waiting since enqueued_ms
+// is shed, following the CoDel dequeue logic. A lane that is left empty
+// isn't backed up however long the request waited
+static bool codel_shed(struct scheduler* s, struct codel* c,
+    uint64_t enqueued_ms, bool lane_empty)
+{
+    if (s->shed_target_ms == 0)
+    {
+        return false;
+    }
+
+    uint64_t now = now_ms();
+    uint64_t sojourn = now - enqueued_ms;
+    bool above_target = false;
+
+    if (sojourn < s->shed_target_ms || lane_empty)
+    {
+        c->first_above_ms = 0;
+    }
+    else if (c->first_above_ms == 0)
+    {
+        c->first_above_ms = now + s->shed_interval_ms;
+    }
+    else if (now >= c->first_above_ms)
+    {
+        above_target = true;
+    }
+
+    if (c->shedding)
+    {
+        if (!above_target)
+        {
+            c->shedding = false;
+            return false;
+        }
+
+        if (now < c->shed_next_ms)
+        {
+            return false;
+        }
+
+        c->count++;
+        c->shed_next_ms = codel_control_law(s, c->shed_next_ms, c->count);
+        return true;
+    }
+
+    if (!above_target)
+    {
+        return false;
+    }
+
+    // a lane which was shedding a moment ago picks up near the rate it
+    // left off at
+    uint32_t delta = c->count - c->last_count;
+
+    c->shedding = true;
+    c->count = delta > 1 &&
+            now - c->shed_next_ms < 16 * s->shed_interval_ms ? delta : 1;
+    c->last_count = c->count;
+    c->shed_next_ms = codel_control_law(s, now, c->count);
+
+    return true;
+}
+
+
+// blocks until there is a request for the calling worker to handle and returns
+// its client socket, or -1 once the scheduler has been closed and nothing the
+// worker could take is left. shed is set if the request should be turned away
+// rather than served, because its lane is backed up
+int scheduler_next(struct scheduler* s, bool priority_only, bool* shed)
+{
+    struct flow* f = NULL;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (true)
+    {
+        if (s->prio_head != NULL)
+        {
+            f = pop_flow(&s->prio_head, &s->prio_tail);
+            *shed = codel_shed(s, &s->prio_codel, f->enqueued_ms,
+                            s->prio_head == NULL);
+            break;
+        }
+
+        if (!priority_only && s->bulk_head != NULL)
+        {
+            f = next_bulk_flow(s);
+            *shed = codel_shed(s, &s->bulk_codel, f->enqueued_ms,
+                            s->bulk_head == NULL);
+            break;
+        }
+
+        if (s->closed)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+
+        pthread_cond_wait(&s->work_cond, &s->lock);
+    }
+
+    f->queued = false;
+    s->n_queued--;
+
+    int fd = f->fd;
+    pthread_mutex_unlock(&s->lock);
+
+    return fd;
+}
+
+
+// wakes up every waiting worker so that they can exit once the queued
+// requests have been handled
+void scheduler_close(struct scheduler* s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->closed = true;
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+void free_scheduler(struct scheduler* s)
+{
+    for (size_t i = 0; i < s->cap_flows; i++)
+    {
+        free(s->flows[i]);
+    }
+
+    free(s->flows);
+    pthread_cond_destroy(&s->work_cond);
+    pthread_mutex_destroy(&s->lock);
+}
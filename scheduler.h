@@ -0,0 +1,123 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <endian.h>
+#include <math.h>
+
+
+// requests whose estimated cost (bytes moved) is below this are put in the
+// priority lane and skip ahead of bulk transfers
+#define PRIORITY_THRESHOLD (4096)
+
+// bytes of credit a bulk connection earns per deficit round robin round
+#define DRR_QUANTUM (65536)
+
+// the largest cost a request is charged, so that the credit it builds up
+// waiting never overflows
+#define MAX_REQUEST_COST ((uint64_t) INT64_MAX / 2)
+
+// number of workers which only ever serve the priority lane
+#define N_PRIORITY_WORKERS (1)
+
+// a lane sheds requests once they have waited longer than the target for
+// a whole interval, 0 turns shedding off. It is off by default, bulk
+// transfers of a few MB can keep a lane waiting for longer than any target
+// that suits small requests
+#define SHED_TARGET_MS (0)
+#define SHED_INTERVAL_MS (500)
+
+// header + request id + session_id + start_offset + n_bytes of a file
+// retrieval request
+#define CLASSIFY_PEEK_SZ (9 + 4 + 20)
+
+
+// what the accepter learns about a pending request by peeking at it
+struct request_class {
+    // estimated number of bytes serving it moves
+    uint64_t cost;
+    bool priority;
+
+    // the connection has been closed, nothing is pending
+    bool closed;
+
+    // session of a file retrieval
+    bool has_session;
+    uint32_t session_id;
+};
+
+struct flow {
+    int fd;
+    bool queued;
+    bool priority;
+    uint64_t cost;
+    int64_t deficit;
+
+    // when the pending request was queued
+    uint64_t enqueued_ms;
+    struct flow* next;
+};
+
+// CoDel state of a lane, the time a request has waited is checked as it
+// leaves the lane
+struct codel {
+    // when the wait has been above the target for a whole interval, 0 while
+    // it is below
+    uint64_t first_above_ms;
+
+    bool shedding;
+    uint64_t shed_next_ms;
+    uint32_t count;
+    uint32_t last_count;
+};
+
+struct scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+
+    // fifo of small requests
+    struct flow* prio_head;
+    struct flow* prio_tail;
+
+    // deficit round robin ring of bulk requests
+    struct flow* bulk_head;
+    struct flow* bulk_tail;
+
+    // per connection state, indexed by the client fd
+    struct flow** flows;
+    size_t cap_flows;
+
+    size_t n_queued;
+    bool closed;
+
+    uint64_t shed_target_ms;
+    uint64_t shed_interval_ms;
+    struct codel prio_codel;
+    struct codel bulk_codel;
+};
+
+
+
+void init_scheduler(struct scheduler* s, uint64_t shed_target_ms,
+    uint64_t shed_interval_ms);
+
+void classify_request(int client_socket, struct request_class* rc);
+
+void scheduler_enqueue(struct scheduler* s, int client_socket,
+    struct request_class* rc);
+
+int scheduler_next(struct scheduler* s, bool priority_only, bool* shed);
+
+void scheduler_close(struct scheduler* s);
+
+void free_scheduler(struct scheduler* s);
+
+#endif
@@ -1,6 +1,336 @@
 #include "server.h"
 #include "requests.h"
 #include "thread_pool.h"
+#include "prefetch.h"
+#include "flight.h"
+#include "sidecar.h"
+#include "checksum.h"
+#include "training.h"
+#include "handoff.h"
+#include "ratelimit.h"
+#include "memory.h"
+#include "upstream.h"
+
+void default_server_options(struct server_options* options)
+{
+    options->max_connections = MAX_CONNECTIONS;
+    options->idle_timeout_ms = IDLE_TIMEOUT_MS;
+    options->request_timeout_ms = REQUEST_TIMEOUT_MS;
+    options->dictionary = NULL;
+    options->sidecar_dir = NULL;
+    options->dictionary_training_ms = TRAINING_INTERVAL_MS;
+    options->n_target_dirs = 0;
+    options->io_queue_depth = IO_QUEUE_DEPTH;
+    options->unix_socket = NULL;
+    options->client_requests_per_sec = CLIENT_REQUESTS_PER_SEC;
+    options->client_bytes_per_sec = CLIENT_BYTES_PER_SEC;
+    options->session_bytes_per_sec = SESSION_BYTES_PER_SEC;
+    options->rate_burst_ms = RATE_BURST_MS;
+    options->shed_target_ms = SHED_TARGET_MS;
+    options->shed_interval_ms = SHED_INTERVAL_MS;
+    options->memory_budget = MEMORY_BUDGET;
+    options->memory_wait_ms = MEMORY_WAIT_MS;
+    options->numa_aware = NUMA_AWARE;
+    options->hugepage_pool = HUGEPAGE_POOL;
+    options->hugepage_prefault = HUGEPAGE_PREFAULT;
+    options->zerocopy_min_bytes = ZEROCOPY_MIN_BYTES;
+    options->listen_backlog = LISTEN_BACKLOG;
+    options->latency_profile = LATENCY_PROFILE;
+    options->busy_poll_us = BUSY_POLL_US;
+    options->upstream = NULL;
+    options->upstream_cache_dir = NULL;
+    options->upstream_cache_bytes = UPSTREAM_CACHE_BYTES;
+    options->upstream_ttl_ms = UPSTREAM_TTL_MS;
+}
+
+
+// reads the options file, which holds one "key value" setting per line.
+// Blank lines and lines starting with '#' are skipped
+int load_server_options(char* options_file, struct server_options* options)
+{
+    FILE* f = fopen(options_file, "r");
+    if (NULL == f)
+    {
+        perror("could not open options file");
+        return -1;
+    }
+
+    char line[MAX_OPTION_LINE];
+    char key[MAX_OPTION_LINE];
+    char value[MAX_OPTION_LINE];
+
+    while (fgets(line, MAX_OPTION_LINE, f) != NULL)
+    {
+        if (sscanf(line, "%s %s", key, value) != 2 || key[0] == '#')
+        {
+            continue;
+        }
+
+        if (strcmp(key, "max_connections") == 0)
+        {
+            options->max_connections = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "idle_timeout_ms") == 0)
+        {
+            options->idle_timeout_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "request_timeout_ms") == 0)
+        {
+            options->request_timeout_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "dictionary") == 0)
+        {
+            free(options->dictionary);
+            options->dictionary = strdup(value);
+        }
+        else if (strcmp(key, "dictionary_training_ms") == 0)
+        {
+            options->dictionary_training_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "target_dir") == 0)
+        {
+            // the directory of the config file always comes first
+            if (options->n_target_dirs < MAX_VOLUMES - 1)
+            {
+                options->target_dirs[options->n_target_dirs] = strdup(value);
+                options->n_target_dirs++;
+            }
+            else
+            {
+                fprintf(stderr, "too many target directories: %s\n", value);
+            }
+        }
+        else if (strcmp(key, "io_queue_depth") == 0)
+        {
+            options->io_queue_depth = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "unix_socket") == 0)
+        {
+            free(options->unix_socket);
+            options->unix_socket = strdup(value);
+        }
+        else if (strcmp(key, "client_requests_per_sec") == 0)
+        {
+            options->client_requests_per_sec = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "client_bytes_per_sec") == 0)
+        {
+            options->client_bytes_per_sec = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "session_bytes_per_sec") == 0)
+        {
+            options->session_bytes_per_sec = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "rate_burst_ms") == 0)
+        {
+            options->rate_burst_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "shed_target_ms") == 0)
+        {
+            options->shed_target_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "shed_interval_ms") == 0)
+        {
+            options->shed_interval_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "memory_budget") == 0)
+        {
+            options->memory_budget = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "memory_wait_ms") == 0)
+        {
+            options->memory_wait_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "numa_aware") == 0)
+        {
+            options->numa_aware = strtoull(value, NULL, 10) != 0;
+        }
+        else if (strcmp(key, "hugepage_pool") == 0)
+        {
+            options->hugepage_pool = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "hugepage_prefault") == 0)
+        {
+            options->hugepage_prefault = strtoull(value, NULL, 10) != 0;
+        }
+        else if (strcmp(key, "zerocopy_min_bytes") == 0)
+        {
+            options->zerocopy_min_bytes = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "listen_backlog") == 0)
+        {
+            options->listen_backlog = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "latency_profile") == 0)
+        {
+            options->latency_profile = strtoull(value, NULL, 10) != 0;
+        }
+        else if (strcmp(key, "busy_poll_us") == 0)
+        {
+            options->busy_poll_us = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "upstream") == 0)
+        {
+            free(options->upstream);
+            options->upstream = strdup(value);
+        }
+        else if (strcmp(key, "upstream_cache_dir") == 0)
+        {
+            free(options->upstream_cache_dir);
+            options->upstream_cache_dir = strdup(value);
+        }
+        else if (strcmp(key, "upstream_cache_bytes") == 0)
+        {
+            options->upstream_cache_bytes = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "upstream_ttl_ms") == 0)
+        {
+            options->upstream_ttl_ms = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "sidecar_dir") == 0)
+        {
+            free(options->sidecar_dir);
+            options->sidecar_dir = strdup(value);
+        }
+        else
+        {
+            fprintf(stderr, "unknown option: %s\n", key);
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+
+// creates the non blocking TCP socket clients connect to, returns -1 if it
+// can't be created
+int listen_tcp_socket(struct sockaddr_in* server_addr,
+    struct server_options* options)
+{
+    int option = 1; 
+
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (server_fd < 0)
+    {
+        puts("failed to create server socket");
+        return -1;
+    }
+
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
+                 &option, sizeof(int));
+
+    int flags = fcntl(server_fd,F_GETFL,0);
+    if (flags < -1)
+    {
+        perror("cannot set to non-blocking\n");
+    }
+    fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
+    
+    if (bind(server_fd, (struct sockaddr*) server_addr, 
+            sizeof(struct sockaddr_in))) 
+    {
+		perror("server fd could not be binded");
+        close(server_fd);
+		return -1;
+	}
+
+    // a connection is only accepted once its first request is in, and a
+    // returning client can send that request along with its SYN
+    if (options->latency_profile)
+    {
+        int defer_s = DEFER_ACCEPT_S;
+        int fastopen_queue = FASTOPEN_QUEUE;
+
+        setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_s,
+                    sizeof(defer_s));
+        setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue,
+                    sizeof(fastopen_queue));
+    }
+
+    listen(server_fd, options->listen_backlog);
+
+    return server_fd;
+}
+
+
+// creates a non blocking unix domain socket listening at a path, replacing
+// whatever a previous run left there. Returns -1 if it can't be created
+int listen_unix_socket(char* path, size_t backlog)
+{
+    struct sockaddr_un addr = {0};
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        perror("failed to create unix socket");
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(fd, backlog) < 0)
+    {
+        perror("unix socket could not be binded");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+// adds a listener for every numa node past the first to the SO_REUSEPORT
+// group of the server socket, and steers new connections to the listener of
+// the node which received them. Stays with the one listener if that can't
+// be done
+static void listen_node_sockets(struct server_info* info)
+{
+    size_t n_nodes = numa_nodes(info->numa);
+    size_t n_listening = 1;
+
+    while (n_listening < n_nodes)
+    {
+        info->node_sockets[n_listening] = listen_tcp_socket(&info->addr,
+                                                        &info->options);
+
+        if (info->node_sockets[n_listening] < 0)
+        {
+            break;
+        }
+
+        n_listening++;
+    }
+
+    if (n_listening == n_nodes &&
+        attach_node_steering(info->numa, info->server_socket) == 0)
+    {
+        info->n_nodes = n_nodes;
+        return;
+    }
+
+    perror("numa node listeners could not be set up");
+
+    for (size_t i = 1; i < n_listening; i++)
+    {
+        close(info->node_sockets[i]);
+    }
+
+    free_numa_topology(info->numa);
+    info->numa = NULL;
+}
+
 
 // reads the config file and creates a server socket based of that info
 // creates a server_info struct which is passed to must functions - 'helper'
@@ -21,12 +351,12 @@ void init_server(char* config_file, struct server_info* info)
  */ 
     
     uint16_t port;
-    char target_dir[MAX_FILEPATH];
+    size_t cap_target_dir = 64;
+    char* target_dir = malloc(sizeof(char)*cap_target_dir);
     int server_fd = -1;
     struct sockaddr_in server_addr;
     // struct in_addr addr;
     in_addr_t ip_addr;
-   	int option = 1; 
 
     
     fread(&ip_addr, 1, sizeof(in_addr_t), f);
@@ -40,58 +370,176 @@ void init_server(char* config_file, struct server_info* info)
             target_dir[i-1] = '\0';
             break;
         }
+        if (i == cap_target_dir)
+        {
+            cap_target_dir *= 2;
+            target_dir = realloc(target_dir, sizeof(char)*cap_target_dir);
+        }
+
         target_dir[i] = fgetc(f);
         i++;
     }
     fclose(f);
-    
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (server_fd < 0)
-    {
-        puts("failed to create server socket");
-        return;
-    }
 
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = ip_addr;
     server_addr.sin_port = port;
 
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-                 &option, sizeof(int));
-
-    int flags = fcntl(server_fd,F_GETFL,0);
-    if (flags < -1)
+    // a successor is handed the listening sockets of the process it
+    // replaces instead
+    if (info->handoff_fd < 0)
     {
-        perror("cannot set to non-blocking\n");
+        server_fd = listen_tcp_socket(&server_addr, &info->options);
+
+        if (server_fd < 0)
+        {
+            return;
+        }
     }
-    fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
-    
-    if (bind(server_fd, (struct sockaddr*) &server_addr, 
-            sizeof(struct sockaddr_in))) 
-    {
-		perror("server fd could not be binded");
-		return;
-	}
 
-    listen(server_fd, MAX_LISTENING);
+    // the namespace is the config's directory followed by the ones of the
+    // options file
+    char* dirs[MAX_VOLUMES];
+    dirs[0] = target_dir;
+    memcpy(dirs + 1, info->options.target_dirs, 
+            sizeof(*dirs)*info->options.n_target_dirs);
 
-    info->target_dir = strdup(target_dir);
-    info->c_info = create_compression_info();
+    info->volumes = create_volume_set(dirs, info->options.n_target_dirs + 1,
+                                    info->options.io_queue_depth, 
+                                    thread_pool_size() - 1);
+    free(target_dir);
+
+    init_codec_pool();
+    info->c_info = create_compression_info(info->options.dictionary);
+    info->trainer = create_trainer(info->c_info, 
+                                info->options.dictionary_training_ms);
     info->addr = server_addr;
     info->server_socket = server_fd;
-    info->cap_file_requests = 20;
-    info->n_file_requests = 0;
-    info->file_requests = malloc(sizeof(*info->file_requests)*20);
+    info->node_sockets[0] = server_fd;
+    info->n_nodes = 1;
+    info->numa = info->options.numa_aware ? load_numa_topology() : NULL;
+    info->unix_socket = -1;
+
+    if (info->numa != NULL && info->handoff_fd < 0)
+    {
+        listen_node_sockets(info);
+    }
+
+    if (info->options.unix_socket != NULL && info->handoff_fd < 0)
+    {
+        info->unix_socket = listen_unix_socket(info->options.unix_socket,
+                                            info->options.listen_backlog);
+    }
+
+    info->flights = create_flight_table();
+    init_connection_table(&info->connections, info->options.max_connections,
+                            info->options.idle_timeout_ms);
+    info->prefetcher = create_prefetcher(info);
+    info->sidecars = create_sidecar_store(info, info->options.sidecar_dir);
+    info->checksums = create_checksum_cache();
+    info->limiter = create_rate_limiter(info->options.client_requests_per_sec,
+                                    info->options.client_bytes_per_sec,
+                                    info->options.session_bytes_per_sec,
+                                    info->options.rate_burst_ms);
+    info->memory = create_memory_governor(info->options.memory_budget,
+                                        info->options.memory_wait_ms);
+    info->upstream = NULL;
+
+    if (info->options.upstream != NULL)
+    {
+        info->upstream = create_upstream(info->options.upstream,
+                                    info->options.upstream_cache_dir,
+                                    info->options.upstream_cache_bytes,
+                                    info->options.upstream_ttl_ms);
+    }
+
     sem_init(&info->shutdown_sem, 0, 0);
+    atomic_init(&info->stop_accepting, false);
+    info->handed_off = false;
+
+    // the session table, caches and listening sockets of the process being
+    // replaced
+    if (info->handoff_fd >= 0 && receive_handoff_state(info) < 0)
+    {
+        fputs("failed to take over from the previous process\n", stderr);
+        exit(1);
+    }
+
+    // the workers are only pinned if the listeners handed over are those
+    // of this machine's nodes
+    if (info->numa != NULL && numa_nodes(info->numa) != info->n_nodes)
+    {
+        free_numa_topology(info->numa);
+        info->numa = NULL;
+    }
+
+    // split between the nodes the workers are pinned to, if they are
+    init_buffer_pool(info->options.hugepage_pool,
+                    info->options.hugepage_prefault, info->numa);
+
+    info->schedulers = malloc(sizeof(*info->schedulers)*info->n_nodes);
+
+    for (size_t i = 0; i < info->n_nodes; i++)
+    {
+        init_scheduler(&info->schedulers[i], info->options.shed_target_ms,
+                    info->options.shed_interval_ms);
+    }
 }
 
 
 void shutdown_server(struct server_info* s_info)
 {
-    free(s_info->target_dir);
-    free(s_info->file_requests);
+    free_volume_set(s_info->volumes);
+
+    // the listening sockets of a process which has handed off live on in
+    // its successor
+    if (s_info->unix_socket >= 0)
+    {
+        close(s_info->unix_socket);
+
+        if (!s_info->handed_off)
+        {
+            unlink(s_info->options.unix_socket);
+        }
+    }
+
+    free_flight_table(s_info->flights);
+
+    for (size_t i = 0; i < s_info->n_nodes; i++)
+    {
+        free_scheduler(&s_info->schedulers[i]);
+    }
+
+    free(s_info->schedulers);
+
+    if (s_info->numa != NULL)
+    {
+        free_numa_topology(s_info->numa);
+    }
+
+    free_connection_table(&s_info->connections);
+    free_prefetcher(s_info->prefetcher);
+    free_sidecar_store(s_info->sidecars);
+    free_checksum_cache(s_info->checksums);
+    free_rate_limiter(s_info->limiter);
+    free_memory_governor(s_info->memory);
+    free_upstream(s_info->upstream);
+    free_trainer(s_info->trainer);
     free_compression_info(s_info->c_info);
+    free_codec_pool();
+    free(s_info->options.dictionary);
+    free(s_info->options.sidecar_dir);
+    free(s_info->options.unix_socket);
+    free(s_info->options.upstream);
+    free(s_info->options.upstream_cache_dir);
+    free(s_info->exe_path);
+    free_buffer_pool();
+
+    for (size_t i = 0; i < s_info->options.n_target_dirs; i++)
+    {
+        free(s_info->options.target_dirs[i]);
+    }
+
     free(s_info);
 
     exit(0);
@@ -101,12 +549,28 @@ void shutdown_server(struct server_info* s_info)
 
 int main (int argc, char** argv)
 {
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
         puts("Provide config file!");
         return 1;
     }
     struct server_info* server_info = malloc(sizeof(*server_info));
+
+    // what a graceful restart execs, the binary at this path may have been
+    // replaced by a newer one by then
+    server_info->argv = argv;
+    server_info->exe_path = realpath("/proc/self/exe", NULL);
+    server_info->handoff_fd = handoff_fd_from_env();
+
+    default_server_options(&server_info->options);
+    if (argc == 3 && load_server_options(argv[2], &server_info->options) < 0)
+    {
+        return 1;
+    }
+
+    // clients going away mid response shouldn't take the server down
+    signal(SIGPIPE, SIG_IGN);
+
     init_server(argv[1], server_info);
     
         
@@ -117,22 +581,66 @@ int main (int argc, char** argv)
 
     server_info->epfd = epfd;
 
+    // the accepter spins on the device queues for a while before sleeping,
+    // kernels without epoll busy polling turn it down
+    if (server_info->options.latency_profile)
+    {
+        struct epoll_params params = {0};
+        params.busy_poll_usecs = server_info->options.busy_poll_us;
+        params.busy_poll_budget = BUSY_POLL_BUDGET;
+
+        ioctl(epfd, EPIOCSPARAMS, &params);
+    }
+
     int ret;
 
     struct epoll_event event;
     
-    event.data.fd = server_info->server_socket;
-    event.events = EPOLLIN;
+    for (size_t i = 0; i < server_info->n_nodes; i++)
+    {
+        event.data.fd = server_info->node_sockets[i];
+        event.events = EPOLLIN;
+
+        ret = epoll_ctl(epfd, EPOLL_CTL_ADD, server_info->node_sockets[i],
+                        &event);
+        if (ret < 0)
+            perror("epoll ctl of server socket failed");
+    }
 
-    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, server_info->server_socket, &event);
-    if (ret < 0)
-        perror("epoll ctl of server socket failed");
+    if (server_info->unix_socket >= 0)
+    {
+        event.data.fd = server_info->unix_socket;
+        event.events = EPOLLIN;
+
+        ret = epoll_ctl(epfd, EPOLL_CTL_ADD, server_info->unix_socket, 
+                        &event);
+        if (ret < 0)
+            perror("epoll ctl of unix socket failed");
+    }
 
 
     create_thread_pool(server_info);
+
+    if (server_info->handoff_fd >= 0)
+    {
+        receive_handoff_connections(server_info);
+    }
+
+    install_restart_handler(server_info);
     
-    // waiting for signal from worker threads to shutdown
-    sem_wait(&server_info->shutdown_sem);
+    // waiting for signal from worker threads to shutdown, or for a restart
+    // which is carried on with if it fails
+    while (true)
+    {
+        while (sem_wait(&server_info->shutdown_sem) < 0 && errno == EINTR)
+        {
+        }
+
+        if (!take_restart_request() || graceful_restart(server_info))
+        {
+            break;
+        }
+    }
 
     cleanup_thread_pool(server_info);        
     shutdown_server(server_info);
@@ -21,41 +21,176 @@
 #include <sys/sysinfo.h>
 #include <semaphore.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <stdatomic.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
 
 
 #include "compression.h"
+#include "scheduler.h"
+#include "connection.h"
+#include "volume.h"
+#include "numa.h"
 
 
-#define MAX_FILEPATH (30)
-#define MAX_LISTENING (10)
 #define STARTING_CLIENTS (5)
 #define TIMEOUT (100)
 
+// defaults for the settings of the optional options file
+#define MAX_CONNECTIONS (1024)
+#define IDLE_TIMEOUT_MS (60 * 1000)
+#define REQUEST_TIMEOUT_MS (10 * 1000)
+#define MAX_OPTION_LINE (256)
+#define LISTEN_BACKLOG (SOMAXCONN)
+
+// the latency profile, off by default. How long a socket read or the event
+// loop spins on the device queue before sleeping, how long the kernel
+// holds a new connection until its first request arrives, and how many
+// TCP fast open requests may be pending
+#define LATENCY_PROFILE (false)
+#define BUSY_POLL_US (50)
+#define BUSY_POLL_BUDGET (8)
+#define DEFER_ACCEPT_S (1)
+#define FASTOPEN_QUEUE (256)
+
+// busy polling of an epoll instance, which older C library headers lack
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+
+
+
+
+// settings read from the optional options file, one "key value" per line
+struct server_options {
+    size_t max_connections;
+    uint64_t idle_timeout_ms;
+    uint64_t request_timeout_ms;
+
+    // dictionary used instead of the one compiled into the binary
+    char* dictionary;
+
+    // directory of the pre-compressed sidecar files, none are kept if unset
+    char* sidecar_dir;
+
+    // how often a dictionary is trained on the traffic, 0 turns it off
+    uint64_t dictionary_training_ms;
+
+    // directories served after the one of the config file, in order
+    char* target_dirs[MAX_VOLUMES];
+    size_t n_target_dirs;
+    size_t io_queue_depth;
+
+    // path of a unix domain socket for clients on the same host, none is
+    // listened on if unset
+    char* unix_socket;
+
+    // limits of every client address and file retrieval session, 0 leaves
+    // them unlimited. Local clients aren't limited
+    uint64_t client_requests_per_sec;
+    uint64_t client_bytes_per_sec;
+    uint64_t session_bytes_per_sec;
+    uint64_t rate_burst_ms;
 
+    // CoDel target and interval of the scheduler lanes, requests are shed
+    // once they have waited longer than the target for an interval. A target
+    // of 0 never sheds
+    uint64_t shed_target_ms;
+    uint64_t shed_interval_ms;
 
+    // bytes the buffers of requests in flight may add up to, and how long a
+    // request waits for some to be freed up before it is rejected
+    uint64_t memory_budget;
+    uint64_t memory_wait_ms;
 
+    // whether every numa node gets its own listener and workers pinned to
+    // its cpus, which handle the connections the node received
+    bool numa_aware;
+
+    // bytes of huge pages large buffers are pooled in, split between the
+    // nodes with numa_aware, and whether they are faulted in at startup
+    uint64_t hugepage_pool;
+    bool hugepage_prefault;
+
+    // responses built in memory of at least this many bytes are sent
+    // without being copied into the socket, 0 turns it off
+    uint64_t zerocopy_min_bytes;
+
+    // pending connections the listeners queue up
+    size_t listen_backlog;
+
+    // tunes the sockets for small requests at the cost of cpu time: TCP
+    // fast open and deferred accepts on the listeners, no Nagle and busy
+    // polling for busy_poll_us on the clients and the event loop, and
+    // corking around responses sent in several parts
+    bool latency_profile;
+    uint64_t busy_poll_us;
+
+    // "ip:port" of a server whose files are served along with those of the
+    // target directories, kept in upstream_cache_dir once fetched. None is
+    // asked if unset. The cache holds up to upstream_cache_bytes
+    char* upstream;
+    char* upstream_cache_dir;
+    uint64_t upstream_cache_bytes;
+    uint64_t upstream_ttl_ms;
+};
 
 struct server_info {
     int server_socket;
+    int unix_socket;
+
+    // the listeners of a SO_REUSEPORT group, one per numa node, the first
+    // is server_socket. There is just the one unless numa_aware is set
+    int node_sockets[MAX_NUMA_NODES];
+    size_t n_nodes;
+    struct numa_topology* numa;
+
+    // socket to the process this one replaces or is replaced by, -1 if
+    // there is none
+    int handoff_fd;
+    bool handed_off;
+    char* exe_path;
+    char** argv;
+    atomic_bool stop_accepting;
     struct sockaddr_in addr;
-    char* target_dir;
+    struct volume_set* volumes;
     int epfd;
     
     sem_t shutdown_sem;
-    int read_fd;
-    int write_fd;
+
+    // the requests of the connections of every node
+    struct scheduler* schedulers;
+
+    struct server_options options;
+    struct connection_table connections;
 
     pthread_t* ptids;
+    struct worker* workers;
     int n_threads;
     struct epoll_event* events;
 
-    struct file_request* file_requests;
-    size_t n_file_requests;
-    size_t cap_file_requests;
-    pthread_mutex_t f_requests_lock;
+    struct flight_table* flights;
     
 
+    // dictionary the server started with, trained versions are in trainer
     struct compression_info* c_info;
+    struct prefetcher* prefetcher;
+    struct sidecar_store* sidecars;
+    struct checksum_cache* checksums;
+    struct trainer* trainer;
+    struct rate_limiter* limiter;
+    struct memory_governor* memory;
+    struct upstream* upstream;
 
 
 
@@ -64,6 +199,15 @@ struct server_info {
 
 
 
+void default_server_options(struct server_options* options);
+
+int load_server_options(char* options_file, struct server_options* options);
+
+int listen_tcp_socket(struct sockaddr_in* server_addr,
+    struct server_options* options);
+
+int listen_unix_socket(char* path, size_t backlog);
+
 void init_server(char* config_file, struct server_info* info);
 
 
@@ -0,0 +1,611 @@
+#include "sidecar.h"
+#include "compression.h"
+
+// This file contains the store of pre-compressed sidecar files. A file that
+// keeps being retrieved compressed gets a sidecar built for it in the
+// background, holding its contents encoded in fixed size blocks along with
+// an index of where each block starts. The blocks of a retrieval are then
+// read from the sidecar and joined behind the encoded response header
+// instead of encoding the whole range again. A sidecar records the inode,
+// size and mtime of the file it was built from and is ignored, and later
+// rebuilt, once the file changes.
+
+
+struct sidecar_store* create_sidecar_store(struct server_info* s_info,
+    char* sidecar_dir)
+{
+    if (sidecar_dir == NULL)
+    {
+        return NULL;
+    }
+
+    mkdir(sidecar_dir, 0755);
+
+    int dir_fd = open(sidecar_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+    {
+        perror("couldn't open sidecar directory");
+        return NULL;
+    }
+
+    struct stat dir_st;
+    fstat(dir_fd, &dir_st);
+
+    struct sidecar_store* sc = calloc(1, sizeof(*sc));
+
+    sc->s_info = s_info;
+    sc->dir_fd = dir_fd;
+    sc->dev = dir_st.st_dev;
+    pthread_mutex_init(&sc->lock, NULL);
+    pthread_cond_init(&sc->job_cond, NULL);
+
+    pthread_create(&sc->thread, NULL, sidecar_thread, (void*) sc);
+
+    return sc;
+}
+
+
+// writes the name of the sidecar of a file, returns -1 for names that
+// can't have one
+static int sidecar_name(char* file_name, char* suffix, char* name)
+{
+    if (strchr(file_name, '/') != NULL ||
+        strlen(file_name) + strlen(suffix) >= MAX_FILE_NAME)
+    {
+        return -1;
+    }
+
+    sprintf(name, "%s%s", file_name, suffix);
+    return 0;
+}
+
+
+// reads a range of a sidecar or of its file on the queue of the device it
+// is on, so that sidecars don't get around the limit on a device's reads
+static int read_exact(struct sidecar_store* sc, int fd, dev_t dev, void* buf,
+    uint64_t len, uint64_t offset)
+{
+    uint64_t n_read = 0;
+
+    while (n_read < len)
+    {
+        ssize_t ret = volume_pread(sc->s_info->volumes, fd, dev,
+                            (uint8_t*) buf + n_read, len - n_read,
+                            offset + n_read);
+
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        n_read += ret;
+    }
+
+    return 0;
+}
+
+
+static int write_exact(int fd, void* buf, uint64_t len, uint64_t offset)
+{
+    uint64_t n_written = 0;
+
+    while (n_written < len)
+    {
+        ssize_t ret = pwrite(fd, (uint8_t*) buf + n_written, len - n_written,
+                            offset + n_written);
+
+        if (ret <= 0)
+        {
+            return -1;
+        }
+
+        n_written += ret;
+    }
+
+    return 0;
+}
+
+
+static void pack_header(uint8_t* buf, struct sidecar_header* h)
+{
+    uint32_t be_block_size = htobe32(h->block_size);
+    uint64_t be_dict_hash = htobe64(h->dict_hash);
+    uint64_t be_ino = htobe64(h->ino);
+    uint64_t be_file_size = htobe64(h->file_size);
+    uint64_t be_mtime_sec = htobe64(h->mtime_sec);
+    uint64_t be_mtime_nsec = htobe64(h->mtime_nsec);
+    uint32_t be_n_blocks = htobe32(h->n_blocks);
+
+    memcpy(buf, SIDECAR_MAGIC, 4);
+    memcpy(buf + 4, &be_block_size, 4);
+    memcpy(buf + 8, &be_dict_hash, 8);
+    memcpy(buf + 16, &be_ino, 8);
+    memcpy(buf + 24, &be_file_size, 8);
+    memcpy(buf + 32, &be_mtime_sec, 8);
+    memcpy(buf + 40, &be_mtime_nsec, 8);
+    memcpy(buf + 48, &be_n_blocks, 4);
+}
+
+
+static void unpack_header(uint8_t* buf, struct sidecar_header* h)
+{
+    memcpy(&h->block_size, buf + 4, 4);
+    memcpy(&h->dict_hash, buf + 8, 8);
+    memcpy(&h->ino, buf + 16, 8);
+    memcpy(&h->file_size, buf + 24, 8);
+    memcpy(&h->mtime_sec, buf + 32, 8);
+    memcpy(&h->mtime_nsec, buf + 40, 8);
+    memcpy(&h->n_blocks, buf + 48, 4);
+
+    h->block_size = be32toh(h->block_size);
+    h->dict_hash = be64toh(h->dict_hash);
+    h->ino = be64toh(h->ino);
+    h->file_size = be64toh(h->file_size);
+    h->mtime_sec = be64toh(h->mtime_sec);
+    h->mtime_nsec = be64toh(h->mtime_nsec);
+    h->n_blocks = be32toh(h->n_blocks);
+}
+
+
+// the header a sidecar of the current version of a file has to have
+static void expected_header(struct sidecar_store* sc, struct stat* st,
+    struct sidecar_header* h)
+{
+    h->block_size = SIDECAR_BLOCK_SIZE;
+    h->dict_hash = sc->s_info->c_info->dict_hash;
+    h->ino = st->st_ino;
+    h->file_size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->n_blocks = (st->st_size + SIDECAR_BLOCK_SIZE - 1) / SIDECAR_BLOCK_SIZE;
+}
+
+
+// opens the sidecar of a file if it was built from the file as it is now,
+// with the dictionary in use. Returns -1 if there is no such sidecar
+static int open_sidecar(struct sidecar_store* sc, char* file_name,
+    struct stat* st, struct sidecar_header* h)
+{
+    char name[MAX_FILE_NAME];
+    uint8_t buf[SIDECAR_HEADER_SZ];
+    struct sidecar_header expected;
+
+    if (sidecar_name(file_name, SIDECAR_SUFFIX, name) < 0)
+    {
+        return -1;
+    }
+
+    int fd = openat(sc->dir_fd, name, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    expected_header(sc, st, &expected);
+
+    if (read_exact(sc, fd, sc->dev, buf, SIDECAR_HEADER_SZ, 0) < 0 ||
+        memcmp(buf, SIDECAR_MAGIC, 4) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    unpack_header(buf, h);
+
+    if (h->block_size != expected.block_size ||
+        h->dict_hash != expected.dict_hash || h->ino != expected.ino ||
+        h->file_size != expected.file_size ||
+        h->mtime_sec != expected.mtime_sec ||
+        h->mtime_nsec != expected.mtime_nsec ||
+        h->n_blocks != expected.n_blocks)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+bool sidecar_is_current(struct sidecar_store* sc, char* file_name,
+    struct stat* st)
+{
+    struct sidecar_header h = {0};
+    int fd = open_sidecar(sc, file_name, st, &h);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+
+// counts a compressed retrieval of a file and queues a sidecar build once
+// the file has been asked for often enough
+void sidecar_note_access(struct sidecar_store* sc, char* file_name,
+    uint64_t file_size)
+{
+    if (sc == NULL || file_size < SIDECAR_MIN_FILE_SIZE ||
+        strlen(file_name) >= MAX_FILE_NAME)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&sc->lock);
+
+    struct sidecar_candidate* c = NULL;
+    struct sidecar_candidate* oldest = &sc->candidates[0];
+
+    for (size_t i = 0; i < N_SIDECAR_CANDIDATES && c == NULL; i++)
+    {
+        struct sidecar_candidate* curr = &sc->candidates[i];
+
+        if (curr->in_use && strcmp(curr->file_name, file_name) == 0)
+        {
+            c = curr;
+        }
+        else if (!curr->in_use ||
+                (oldest->in_use && curr->last_used < oldest->last_used))
+        {
+            oldest = curr;
+        }
+    }
+
+    if (c == NULL)
+    {
+        c = oldest;
+        c->in_use = true;
+        c->hits = 0;
+        strcpy(c->file_name, file_name);
+    }
+
+    c->hits++;
+    c->last_used = ++sc->clock;
+
+    // the builder checks whether the sidecar is already current, so a file
+    // is only queued once in a while
+    if (c->hits >= SIDECAR_HITS && sc->n_jobs < MAX_SIDECAR_JOBS)
+    {
+        strcpy(sc->jobs[(sc->job_head + sc->n_jobs) % MAX_SIDECAR_JOBS],
+                file_name);
+        sc->n_jobs++;
+        c->in_use = false;
+
+        pthread_cond_signal(&sc->job_cond);
+    }
+
+    pthread_mutex_unlock(&sc->lock);
+}
+
+
+// encodes every block of a file into a temporary sidecar and moves it in
+// place once it is complete, unless the file changed while it was read
+static void build_sidecar(struct sidecar_store* sc, char* file_name)
+{
+    struct compression_info* c_info = sc->s_info->c_info;
+    char name[MAX_FILE_NAME];
+    char tmp_name[MAX_FILE_NAME];
+    struct sidecar_header h;
+    struct stat st;
+    struct stat after;
+
+    if (sidecar_name(file_name, SIDECAR_SUFFIX, name) < 0 ||
+        sidecar_name(file_name, SIDECAR_TMP_SUFFIX, tmp_name) < 0)
+    {
+        return;
+    }
+
+    int fd = open_volume_file(sc->s_info->volumes, file_name, &st);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    if (sidecar_is_current(sc, file_name, &st))
+    {
+        close(fd);
+        return;
+    }
+
+    int out = openat(sc->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC,
+                    0644);
+    if (out < 0)
+    {
+        close(fd);
+        return;
+    }
+
+    expected_header(sc, &st, &h);
+
+    uint64_t index_len = (uint64_t) h.n_blocks * SIDECAR_INDEX_ENTRY_SZ;
+    uint8_t* index = malloc(sizeof(*index)*(index_len > 0 ? index_len : 1));
+    uint8_t* raw = malloc(sizeof(*raw)*SIDECAR_BLOCK_SIZE);
+    uint64_t bits_cap = compressed_bound(c_info, SIDECAR_BLOCK_SIZE);
+    uint8_t* bits = malloc(sizeof(*bits)*bits_cap);
+
+    // the blocks follow the header and the index
+    uint64_t offset = SIDECAR_HEADER_SZ + index_len;
+    bool failed = false;
+
+    for (uint32_t i = 0; i < h.n_blocks && !failed; i++)
+    {
+        uint64_t start = (uint64_t) i * SIDECAR_BLOCK_SIZE;
+        uint64_t len = h.file_size - start < SIDECAR_BLOCK_SIZE ?
+                        h.file_size - start : SIDECAR_BLOCK_SIZE;
+
+        memset(bits, 0, bits_cap);
+
+        if (read_exact(sc, fd, st.st_dev, raw, len, start) < 0)
+        {
+            failed = true;
+            break;
+        }
+
+        uint32_t n_bits = encode_bytes(c_info, raw, len, bits, 0);
+        uint64_t n_bytes = (n_bits + 7) / 8;
+
+        if (write_exact(out, bits, n_bytes, offset) < 0)
+        {
+            failed = true;
+            break;
+        }
+
+        uint64_t be_offset = htobe64(offset);
+        uint32_t be_n_bits = htobe32(n_bits);
+
+        memcpy(index + i*SIDECAR_INDEX_ENTRY_SZ, &be_offset, 8);
+        memcpy(index + i*SIDECAR_INDEX_ENTRY_SZ + 8, &be_n_bits, 4);
+
+        offset += n_bytes;
+    }
+
+    uint8_t header[SIDECAR_HEADER_SZ];
+    pack_header(header, &h);
+
+    if (!failed)
+    {
+        failed = write_exact(out, header, SIDECAR_HEADER_SZ, 0) < 0 ||
+                write_exact(out, index, index_len, SIDECAR_HEADER_SZ) < 0;
+    }
+
+    // the file was written to while it was being encoded
+    if (!failed)
+    {
+        failed = fstat(fd, &after) < 0 || after.st_size != st.st_size ||
+                after.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+                after.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+    }
+
+    close(out);
+    close(fd);
+
+    if (failed || renameat(sc->dir_fd, tmp_name, sc->dir_fd, name) < 0)
+    {
+        unlinkat(sc->dir_fd, tmp_name, 0);
+    }
+
+    free(bits);
+    free(raw);
+    free(index);
+}
+
+
+// encodes the raw bytes of a file range behind the bits already in payload
+static int encode_file_range(struct sidecar_store* sc, int file_fd,
+    struct stat* st, uint64_t start, uint64_t len, uint8_t* payload,
+    uint64_t* n_bits)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    uint8_t* raw = malloc(sizeof(*raw)*len);
+
+    if (read_exact(sc, file_fd, st->st_dev, raw, len, start) < 0)
+    {
+        free(raw);
+        return -1;
+    }
+
+    *n_bits = encode_bytes(sc->s_info->c_info, raw, len, payload, *n_bits);
+    free(raw);
+
+    return 0;
+}
+
+
+// builds the compressed payload of a file retrieval using the sidecar of the
+// file. The blocks fully inside the range are taken from the sidecar and only
+// the partial blocks at either end are encoded. Returns -1 if the file has no
+// current sidecar or the range doesn't cover a whole block
+int sidecar_build_payload(struct sidecar_store* sc, int file_fd,
+    struct stat* st, char* file_name, uint32_t* session_id,
+    uint64_t start_offset, uint64_t n_bytes, uint8_t** payload,
+    uint64_t* payload_len)
+{
+    struct compression_info* c_info = sc->s_info->c_info;
+    struct sidecar_header h;
+    uint64_t end = start_offset + n_bytes;
+
+    int fd = open_sidecar(sc, file_name, st, &h);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // whole blocks inside the range, the last block of the file is whole
+    // when the range runs to the end of the file
+    uint32_t first = (start_offset + h.block_size - 1) / h.block_size;
+    uint32_t last = end == h.file_size ? h.n_blocks : end / h.block_size;
+
+    if (first >= last)
+    {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t n_blocks = last - first;
+    uint8_t* index = malloc(sizeof(*index)*n_blocks*SIDECAR_INDEX_ENTRY_SZ);
+
+    if (read_exact(sc, fd, sc->dev, index, n_blocks*SIDECAR_INDEX_ENTRY_SZ,
+            SIDECAR_HEADER_SZ + (uint64_t) first*SIDECAR_INDEX_ENTRY_SZ) < 0)
+    {
+        free(index);
+        close(fd);
+        return -1;
+    }
+
+    uint64_t* offsets = malloc(sizeof(*offsets)*n_blocks);
+    uint32_t* block_bits = malloc(sizeof(*block_bits)*n_blocks);
+
+    for (uint32_t i = 0; i < n_blocks; i++)
+    {
+        memcpy(&offsets[i], index + i*SIDECAR_INDEX_ENTRY_SZ, 8);
+        memcpy(&block_bits[i], index + i*SIDECAR_INDEX_ENTRY_SZ + 8, 4);
+
+        offsets[i] = be64toh(offsets[i]);
+        block_bits[i] = be32toh(block_bits[i]);
+
+        // blocks that overlap mean the sidecar was damaged
+        if (i > 0 && offsets[i] < offsets[i - 1] + (block_bits[i - 1] + 7) / 8)
+        {
+            free(index);
+            free(block_bits);
+            free(offsets);
+            close(fd);
+            return -1;
+        }
+    }
+
+    free(index);
+
+    // the blocks are stored one after the other so they are read at once
+    uint64_t blocks_len = offsets[n_blocks - 1] - offsets[0] +
+                        (block_bits[n_blocks - 1] + 7) / 8;
+    uint8_t* blocks = malloc(sizeof(*blocks)*blocks_len);
+
+    if (read_exact(sc, fd, sc->dev, blocks, blocks_len, offsets[0]) < 0)
+    {
+        free(blocks);
+        free(block_bits);
+        free(offsets);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    uint64_t head_end = (uint64_t) first * h.block_size;
+    uint64_t tail_start = (uint64_t) last * h.block_size;
+
+    if (tail_start > end)
+    {
+        tail_start = end;
+    }
+
+    uint8_t file_header[4 + 8 + 8];
+    uint64_t be_start_offset = htobe64(start_offset);
+    uint64_t be_n_bytes = htobe64(n_bytes);
+
+    memcpy(file_header, session_id, 4);
+    memcpy(file_header + 4, &be_start_offset, 8);
+    memcpy(file_header + 12, &be_n_bytes, 8);
+
+    uint64_t cap = compressed_bound(c_info, sizeof(file_header) +
+                    (head_end - start_offset) + (end - tail_start)) +
+                    blocks_len + 1;
+    uint8_t* bits = alloc_zeroed_buffer(sizeof(*bits)*cap);
+
+    uint64_t n_bits = encode_bytes(c_info, file_header, sizeof(file_header),
+                                bits, 0);
+
+    int ret = encode_file_range(sc, file_fd, st, start_offset,
+                        head_end - start_offset, bits, &n_bits);
+
+    for (uint32_t i = 0; i < n_blocks && ret == 0; i++)
+    {
+        copy_bits(bits, n_bits, blocks + (offsets[i] - offsets[0]),
+                block_bits[i]);
+        n_bits += block_bits[i];
+    }
+
+    if (ret == 0)
+    {
+        ret = encode_file_range(sc, file_fd, st, tail_start,
+                            end - tail_start, bits, &n_bits);
+    }
+
+    free(blocks);
+    free(block_bits);
+    free(offsets);
+
+    if (ret < 0)
+    {
+        free_buffer(bits);
+        return -1;
+    }
+
+    *payload_len = finish_compressed(bits, n_bits);
+    *payload = bits;
+
+    return 0;
+}
+
+
+// background thread building the queued sidecars
+void* sidecar_thread(void* args)
+{
+    struct sidecar_store* sc = args;
+    char file_name[MAX_FILE_NAME];
+
+    while (true)
+    {
+        pthread_mutex_lock(&sc->lock);
+
+        while (sc->n_jobs == 0 && !sc->stop)
+        {
+            pthread_cond_wait(&sc->job_cond, &sc->lock);
+        }
+
+        if (sc->stop)
+        {
+            pthread_mutex_unlock(&sc->lock);
+            break;
+        }
+
+        strcpy(file_name, sc->jobs[sc->job_head]);
+        sc->job_head = (sc->job_head + 1) % MAX_SIDECAR_JOBS;
+        sc->n_jobs--;
+
+        pthread_mutex_unlock(&sc->lock);
+
+        build_sidecar(sc, file_name);
+    }
+
+    return (void*) NULL;
+}
+
+
+void free_sidecar_store(struct sidecar_store* sc)
+{
+    if (sc == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&sc->lock);
+    sc->stop = true;
+    pthread_cond_signal(&sc->job_cond);
+    pthread_mutex_unlock(&sc->lock);
+
+    pthread_join(sc->thread, NULL);
+
+    close(sc->dir_fd);
+    pthread_cond_destroy(&sc->job_cond);
+    pthread_mutex_destroy(&sc->lock);
+    free(sc);
+}
@@ -0,0 +1,100 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "requests.h"
+
+
+#define SIDECAR_MAGIC "MTSC"
+#define SIDECAR_SUFFIX ".sc"
+#define SIDECAR_TMP_SUFFIX ".sc.tmp"
+
+// raw bytes of a file encoded as one block of its sidecar
+#define SIDECAR_BLOCK_SIZE (64*1024)
+
+// magic, block size, dictionary hash, inode, size, mtime and block count
+#define SIDECAR_HEADER_SZ (4 + 4 + 8 + 8 + 8 + 8 + 8 + 4)
+
+// byte offset and number of bits of each block
+#define SIDECAR_INDEX_ENTRY_SZ (8 + 4)
+
+// files smaller than this are cheap enough to encode when asked for
+#define SIDECAR_MIN_FILE_SIZE (1024*1024)
+
+// compressed retrievals of a file before a sidecar is built for it
+#define SIDECAR_HITS (2)
+
+#define N_SIDECAR_CANDIDATES (64)
+#define MAX_SIDECAR_JOBS (16)
+
+
+// a file being served compressed which doesn't have a sidecar yet
+struct sidecar_candidate {
+    bool in_use;
+    char file_name[MAX_FILE_NAME];
+    uint32_t hits;
+    uint64_t last_used;
+};
+
+// the sidecar header, validated against the file before it is used
+struct sidecar_header {
+    uint32_t block_size;
+    uint64_t dict_hash;
+    uint64_t ino;
+    uint64_t file_size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint32_t n_blocks;
+};
+
+struct sidecar_store {
+    struct server_info* s_info;
+    int dir_fd;
+
+    // device of the directory, whose queue the sidecars are read on
+    dev_t dev;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_t thread;
+    bool stop;
+    uint64_t clock;
+
+    struct sidecar_candidate candidates[N_SIDECAR_CANDIDATES];
+
+    char jobs[MAX_SIDECAR_JOBS][MAX_FILE_NAME];
+    size_t job_head;
+    size_t n_jobs;
+};
+
+
+
+struct sidecar_store* create_sidecar_store(struct server_info* s_info,
+    char* sidecar_dir);
+
+void sidecar_note_access(struct sidecar_store* sc, char* file_name,
+    uint64_t file_size);
+
+bool sidecar_is_current(struct sidecar_store* sc, char* file_name,
+    struct stat* st);
+
+int sidecar_build_payload(struct sidecar_store* sc, int file_fd,
+    struct stat* st, char* file_name, uint32_t* session_id,
+    uint64_t start_offset, uint64_t n_bytes, uint8_t** payload,
+    uint64_t* payload_len);
+
+void* sidecar_thread(void* args);
+
+void free_sidecar_store(struct sidecar_store* sc);
+
+#endif
@@ -1,142 +1,447 @@
 #include "thread_pool.h"
 #include "requests.h"
 #include "server.h"
+#include "ratelimit.h"
 
 
-void* accepter_thread(void* args)
+// turns away a client when the server is at its connection limit, without
+// waiting on the client in any way
+void reject_connection(int client_socket)
 {
-    struct server_info* s_info = args;
-    struct epoll_event events[SOMAXCONN];
-    int server_socket = s_info->server_socket;
-    int epfd = s_info->epfd;
-    int write_fd = s_info->write_fd;
+    uint8_t response[MSG_HEADER_SZ + PAYLOAD_LEN_SZ] = {0};
+    response[0] = ERROR_RESPONSE << 4;
+
+    send(client_socket, response, sizeof(response), MSG_DONTWAIT);
+    close(client_socket);
+}
 
+
+// closes the fd of a connection taken out of the table. Responses sent
+// with MSG_ZEROCOPY the kernel hasn't reported done yet may still be
+// retransmitted after it is closed, so their buffers are held for as long
+// as a client may take to acknowledge a response
+static void close_client_socket(struct server_info* s_info, 
+    int client_socket)
+{
     struct epoll_event event;
-    int n_events = 0;
 
+    epoll_ctl(s_info->epfd, EPOLL_CTL_DEL, client_socket, &event);
+
+    reap_zerocopy(s_info, client_socket, NULL);
+    orphan_zerocopy_sends(&s_info->connections, client_socket,
+                        now_ms() + s_info->options.request_timeout_ms);
+
+    close(client_socket);
+}
+
+
+// finishes a request of a client connection, closing the connection if it
+// has been shut down and this was the last of its requests in flight
+void finish_request(struct server_info* s_info, int client_socket)
+{
+    if (connection_idle(&s_info->connections, client_socket))
+    {
+        close_client_socket(s_info, client_socket);
+    }
+}
+
+
+// shuts a client connection down and finishes the request that gave up on
+// it. Other requests of the connection may still be in flight, the fd is
+// only closed once they are done so that a new client can't be given it
+// and get their responses
+void close_connection(struct server_info* s_info, int client_socket)
+{
+    shutdown(client_socket, SHUT_RDWR);
+    connection_closing(&s_info->connections, client_socket);
+
+    finish_request(s_info, client_socket);
+}
+
+
+// closes the connections which have been idle for too long
+static void expire_connections(struct server_info* s_info)
+{
+    int expired[SOMAXCONN];
+    size_t n_expired;
+
+    do
+    {
+        n_expired = pop_expired_connections(&s_info->connections, now_ms(),
+                                            expired, SOMAXCONN);
+
+        for (size_t i = 0; i < n_expired; i++)
+        {
+            shutdown(expired[i], SHUT_RDWR);
+            close_client_socket(s_info, expired[i]);
+        }
+
+    } while (n_expired == SOMAXCONN);
+
+    expire_zerocopy_sends(&s_info->connections, now_ms());
+}
+
+
+// applies the request timeout to a client socket so that a worker never
+// blocks forever on a client which stops half way through a message
+static void set_client_timeouts(struct server_info* s_info, int client_socket)
+{
+    struct timeval tv;
+    tv.tv_sec = s_info->options.request_timeout_ms / 1000;
+    tv.tv_usec = (s_info->options.request_timeout_ms % 1000) * 1000;
+
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+// turns off Nagle's algorithm on a client socket so that small responses go
+// out at once, and has reads of it spin on the device queue for a while
+// before sleeping
+static void set_client_latency(struct server_info* s_info, int client_socket)
+{
+    int option = 1;
+    int busy_poll_us = s_info->options.busy_poll_us;
+
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &option, 
+                sizeof(option));
+    setsockopt(client_socket, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us,
+                sizeof(busy_poll_us));
+}
+
+
+// accepts all incoming clients of a listening socket, which are handled by
+// the workers of its node. Clients of the unix domain socket are local and
+// have no address
+static void accept_clients(struct server_info* s_info, int listen_socket,
+    bool local, size_t node)
+{
+    struct epoll_event event;
     struct sockaddr_in client_addr;
     uint32_t addr_len = sizeof(struct sockaddr_in);
 
     int client_socket = 1;
 
     while (true)
-    {       
-        n_events = epoll_wait(epfd, events, SOMAXCONN, TIMEOUT);
+    {
+        memset(&client_addr, 0, sizeof(client_addr));
 
-        for (size_t i = 0; i < n_events; i++)
+        client_socket = accept(listen_socket, 
+                local ? NULL : (struct sockaddr*) &client_addr,
+                local ? NULL : &addr_len);
+
+        if (!(client_socket > 0))
         {
-            if (events[i].data.fd == server_socket)
-            {
-                // accepting all incoming clients
-                while (true)
-                {
-                    client_socket = accept(server_socket, 
-                            (struct sockaddr*) &client_addr, &addr_len);
+            break;
+        }
 
-                    if (!(client_socket > 0))
-                    {
-                        break;
-                    }
-                        
-                    
-                    usleep(500);
+        if (!register_connection(&s_info->connections, 
+                client_socket, &client_addr, local,
+                local ? client_socket % s_info->n_nodes : node))
+        {
+            reject_connection(client_socket);
+            continue;
+        }
 
-                    event.data.fd = client_socket;
-                    event.events = EPOLLIN | EPOLLONESHOT;            
-                    epoll_ctl(epfd, EPOLL_CTL_ADD, client_socket, &event);
+        set_client_timeouts(s_info, client_socket);
 
-                }
+        if (!local && s_info->options.latency_profile)
+        {
+            set_client_latency(s_info, client_socket);
+        }
+
+        if (!local && s_info->options.zerocopy_min_bytes > 0)
+        {
+            enable_connection_zerocopy(&s_info->connections, client_socket);
+        }
+        
+        usleep(500);
+
+        event.data.fd = client_socket;
+        event.events = EPOLLIN | EPOLLONESHOT;            
+        epoll_ctl(s_info->epfd, EPOLL_CTL_ADD, client_socket, &event);
+
+    }
+}
+
+
+// whether a read on a connection wouldn't block, because a request, the
+// end of the stream or an error is waiting
+static bool connection_readable(int client_socket)
+{
+    uint8_t byte;
+
+    return recv(client_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+
+// hands a pending request to the scheduler, unless its client is out of
+// tokens, in which case it is put aside until they have come in
+static void dispatch_request(struct server_info* s_info, int client_socket)
+{
+    struct request_class rc;
+    classify_request(client_socket, &rc);
+
+    if (rate_limited(s_info->limiter) && !rc.closed)
+    {
+        in_addr_t client = 0;
+        bool has_client = connection_source(&s_info->connections, 
+                                            client_socket, &client);
+        uint64_t now = now_ms();
+
+        uint64_t wait_ms = rate_limit_admit(s_info->limiter, has_client,
+                                client, rc.has_session, rc.session_id,
+                                rc.cost, now);
+
+        if (wait_ms > 0)
+        {
+            defer_request(s_info->limiter, client_socket, now + wait_ms);
+            return;
+        }
+    }
+
+    size_t node = 0;
+
+    if (s_info->n_nodes > 1)
+    {
+        node = connection_node(&s_info->connections, client_socket);
+    }
+
+    scheduler_enqueue(&s_info->schedulers[node], client_socket, &rc);
+}
+
+
+// returns the node of a listening socket, -1 if fd isn't one
+static int listener_node(struct server_info* s_info, int fd)
+{
+    for (size_t i = 0; i < s_info->n_nodes; i++)
+    {
+        if (s_info->node_sockets[i] == fd)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+// closes the schedulers of all nodes, their workers exit once they have
+// handled the requests already queued
+static void close_schedulers(struct server_info* s_info)
+{
+    for (size_t i = 0; i < s_info->n_nodes; i++)
+    {
+        scheduler_close(&s_info->schedulers[i]);
+    }
+}
+
+
+// dispatches the deferred requests whose tokens should have come in
+static void dispatch_deferred(struct server_info* s_info)
+{
+    int due[SOMAXCONN];
+    size_t n_due;
+
+    do
+    {
+        n_due = pop_due_requests(s_info->limiter, now_ms(), due, SOMAXCONN);
+
+        for (size_t i = 0; i < n_due; i++)
+        {
+            dispatch_request(s_info, due[i]);
+        }
+
+    } while (n_due == SOMAXCONN);
+}
+
+
+void* accepter_thread(void* args)
+{
+    struct server_info* s_info = args;
+    struct epoll_event events[SOMAXCONN];
+    int unix_socket = s_info->unix_socket;
+    int epfd = s_info->epfd;
+
+    int n_events = 0;
+
+    // the wait times out often enough for a stop to be noticed quickly
+    while (!atomic_load(&s_info->stop_accepting))
+    {       
+        int timeout = next_deferred_timeout(s_info->limiter, TIMEOUT,
+                                            now_ms());
+
+        n_events = epoll_wait(epfd, events, SOMAXCONN, 
+                        connection_timeout(&s_info->connections, timeout));
+
+        for (size_t i = 0; i < n_events; i++)
+        {
+            int node = listener_node(s_info, events[i].data.fd);
+
+            if (node >= 0 ||
+                (unix_socket >= 0 && events[i].data.fd == unix_socket))
+            {
+                accept_clients(s_info, events[i].data.fd, 
+                            events[i].data.fd == unix_socket, node);
                 
-                break;
+                // the rest of the events still need to be dispatched, their
+                // one shot triggers won't fire again
+                continue;
             }
             
             else
             {
+                // completions of MSG_ZEROCOPY sends are reported as errors.
+                // A worker sending on the connection may have reaped them
+                // already, so it is only handed on if it has a request or
+                // an error of its own to read, and is armed again otherwise
+                if (!(events[i].events & (EPOLLIN | EPOLLHUP)))
+                {
+                    reap_zerocopy(s_info, events[i].data.fd, NULL);
+
+                    if (!connection_readable(events[i].data.fd))
+                    {
+                        rearm_connection(s_info, events[i].data.fd);
+                        continue;
+                    }
+                }
+
                 // handling an existig client
-                if (events[i].events & (EPOLLIN | EPOLLONESHOT)) 
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) 
                 {
-                    // adding client to queue, so that one of the worker threads
-                    // can handle their request
-                    write(write_fd, &events[i].data.fd, sizeof(int));
+                    // adding client to the scheduler, so that one of the
+                    // worker threads can handle their request
+                    if (connection_busy(&s_info->connections, 
+                            events[i].data.fd))
+                    {
+                        dispatch_request(s_info, events[i].data.fd);
+                    }
 
                 }
                 
             }
         }
+
+        dispatch_deferred(s_info);
+        expire_connections(s_info);
     }
 
     return (void*) NULL;
 }
 
 
-// these threads handle all client requests and read data from a pipe
-void* worker_thread(void* args)
+// these threads handle all client requests taken from the scheduler of
+// their node. Priority workers only take requests from the priority lane,
+// so small requests never wait behind bulk transfers
+static void worker_loop(struct worker* w)
 {
-    struct server_info* s_info = args;
-    int n_bytes;
+    struct server_info* s_info = w->s_info;
     int ret;
     int client_socket;
-    struct epoll_event event;
+    bool shed;
     
-
+    // the buffers a worker allocates come from its own malloc arena, so
+    // once it is pinned they are first touched, and placed, on its node
+    if (s_info->numa != NULL && pin_thread_to_node(s_info->numa, w->node) < 0)
+    {
+        fprintf(stderr, "worker could not be pinned to node %zu\n", w->node);
+    }
 
     while (true)
     {
-        ////fprintf(stderr, "thread: waiting for data\n");
-        n_bytes = read(s_info->read_fd, &client_socket,sizeof(int));
-        ////fprintf(stderr, "thread read bytes: %d and socket: %d\n",n_bytes, client_socket);
+        client_socket = scheduler_next(&s_info->schedulers[w->node],
+                                    w->priority_only, &shed);
 
-        // read fd closed, indicating shutdown message has been sent 
-        if (n_bytes < sizeof(int))
+        // scheduler closed, indicating shutdown message has been sent 
+        if (client_socket < 0)
         {
             break;
         }
 
-        ret = handle_request(client_socket, s_info);
+        // the server is overloaded, the request is answered with an error
+        // without being handled so that the client can back off
+        if (shed)
+        {
+            ret = shed_request(client_socket, s_info);
+        }
+        else
+        {
+            ret = handle_request(client_socket, s_info);
+        }
 
-        if (ret == 1)
+        if (ret == 0)
         {
-            ret = epoll_ctl(s_info->epfd, EPOLL_CTL_DEL, client_socket, &event);
-         
-            shutdown(client_socket, SHUT_RDWR);
-            close(client_socket);
+            finish_request(s_info, client_socket);
+        }
+        else if (ret == 1)
+        {
+            close_connection(s_info, client_socket);
         }
         else if (ret == 2)
         {
-            // shut down signal received  
-            close(s_info->write_fd);
-            close(s_info->read_fd);
+            // shut down signal received, the requests already queued are
+            // still handled before the worker exits
+            close_schedulers(s_info);
             sem_post(&s_info->shutdown_sem);
-            
-            break;
         }
             
     }
+}
+
+
+void* worker_thread(void* args)
+{
+    worker_loop(args);
 
     return (void*) NULL;
+}
+
+
+// returns the number of threads of the pool, the accepter included
+int thread_pool_size()
+{
+    int n_threads = get_nprocs()-1;
+
+    // always leaving room for the accepter, the priority workers and at
+    // least one worker for bulk requests
+    if (n_threads < N_PRIORITY_WORKERS + 2)
+    {
+        n_threads = N_PRIORITY_WORKERS + 2;
+    }
 
+    return n_threads;
 }
 
 
+// every node gets its own priority workers and at least one worker for
+// bulk requests, the rest are dealt out between the nodes in turn
 void create_thread_pool(struct server_info* s_info)
 {
-    // creating thread queue in which client socket fds are stored
-    int queue[2];
-    pipe(queue);
+    int n_nodes = s_info->n_nodes;
+    int n_priority = N_PRIORITY_WORKERS * n_nodes;
+    int n_threads = thread_pool_size();
 
-    s_info->read_fd = queue[0];
-    s_info->write_fd = queue[1];
+    if (n_threads < 1 + n_priority + n_nodes)
+    {
+        n_threads = 1 + n_priority + n_nodes;
+    }
 
-    int n_threads = get_nprocs()-1;
     pthread_t* ptids = malloc(sizeof(*ptids)*n_threads);
+    struct worker* workers = malloc(sizeof(*workers)*n_threads);
 
     s_info->ptids = ptids;
+    s_info->workers = workers;
     s_info->n_threads = n_threads;
 
     
     for (int i = 1; i < n_threads; i++)
     {
-       pthread_create(&ptids[i], NULL, worker_thread, (void*) s_info);
+        workers[i].s_info = s_info;
+        workers[i].priority_only = i <= n_priority;
+        workers[i].node = (i - 1) % n_nodes;
+
+        pthread_create(&ptids[i], NULL, worker_thread, (void*) &workers[i]);
     }
 
     // creating the accepter thread last 
@@ -145,14 +450,39 @@ void create_thread_pool(struct server_info* s_info)
 }
 
 
-void cleanup_thread_pool(struct server_info* s_info)
+// stops the accepter, after which no new connections are taken and no more
+// requests are handed to the workers
+void stop_accepter(struct server_info* s_info)
 {
-    pthread_cancel(s_info->ptids[0]);
+    if (atomic_exchange(&s_info->stop_accepting, true))
+    {
+        return;
+    }
+
+    pthread_join(s_info->ptids[0], NULL);
+}
+
+
+// lets the workers finish every request already handed to them and waits
+// for them to exit. The accepter must have been stopped
+void drain_workers(struct server_info* s_info)
+{
+    close_schedulers(s_info);
 
     for (int i = 1; i < s_info->n_threads; i++)
     {
-        pthread_cancel(s_info->ptids[i]);        
+        pthread_join(s_info->ptids[i], NULL);
     }
 
+    s_info->n_threads = 1;
+}
+
+
+void cleanup_thread_pool(struct server_info* s_info)
+{
+    stop_accepter(s_info);
+    drain_workers(s_info);
+
     free(s_info->ptids);
+    free(s_info->workers);
 }
\ No newline at end of file
@@ -12,13 +12,32 @@
 #include "server.h"
 
 
+// what a worker is started with
+struct worker {
+    struct server_info* s_info;
+    size_t node;
+    bool priority_only;
+};
+
+
+void reject_connection(int client_socket);
+
+void finish_request(struct server_info* s_info, int client_socket);
+
+void close_connection(struct server_info* s_info, int client_socket);
 
 void* accepter_thread(void* args);
 
 void* worker_thread(void* args);
 
+int thread_pool_size();
+
 void create_thread_pool(struct server_info* s_info);
 
+void stop_accepter(struct server_info* s_info);
+
+void drain_workers(struct server_info* s_info);
+
 void cleanup_thread_pool(struct server_info* s_info);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include "training.h"
+
+// This file contains the training of dictionaries fitted to the traffic.
+// Served payloads are sampled into a byte histogram, and a background thread
+// periodically builds a length limited Huffman code from it. A code that
+// does noticeably better than the latest one is published as a new version.
+// Versions are refcounted: a request holds the version its connection
+// selected until it has been handled, and a retired version is freed by
+// whoever drops the last reference, so a version is never swapped out from
+// under a request using it.
+
+
+struct trainer* create_trainer(struct compression_info* base,
+    uint64_t interval_ms)
+{
+    struct trainer* t = calloc(1, sizeof(*t));
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->stop_cond, NULL);
+    t->interval_ms = interval_ms;
+
+    base->id = 0;
+    t->versions[0] = base;
+    t->n_versions = 1;
+    t->next_id = 1;
+
+    if (interval_ms > 0)
+    {
+        pthread_create(&t->thread, NULL, trainer_thread, (void*) t);
+    }
+
+    return t;
+}
+
+
+// adds an evenly spread sample of a payload to the histogram
+void trainer_sample(struct trainer* t, uint8_t* data, uint64_t len)
+{
+    if (t->interval_ms == 0 || len == 0)
+    {
+        return;
+    }
+
+    uint32_t counts[N_SEGMENTS] = {0};
+    uint64_t stride = len > SAMPLE_BYTES ? len / SAMPLE_BYTES : 1;
+    uint64_t n = 0;
+
+    for (uint64_t i = 0; i < len; i += stride)
+    {
+        counts[data[i]]++;
+        n++;
+    }
+
+    // the sample is dropped rather than have the worker wait on the lock,
+    // the histogram only has to follow what is served roughly
+    if (pthread_mutex_trylock(&t->lock) != 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        t->histogram[i] += counts[i];
+    }
+
+    t->n_sampled += n;
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+
+// returns a reference to a dictionary version, or NULL if it doesn't exist
+// or has been retired
+struct compression_info* acquire_dictionary(struct trainer* t, uint32_t id)
+{
+    struct compression_info* c_info = NULL;
+
+    pthread_mutex_lock(&t->lock);
+
+    for (size_t i = 0; i < t->n_versions; i++)
+    {
+        if (t->versions[i]->id == id)
+        {
+            c_info = t->versions[i];
+            c_info->refcount++;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return c_info;
+}
+
+
+void release_dictionary(struct trainer* t, struct compression_info* c_info)
+{
+    pthread_mutex_lock(&t->lock);
+    c_info->refcount--;
+    bool last = c_info->retired && c_info->refcount == 0;
+    pthread_mutex_unlock(&t->lock);
+
+    if (last)
+    {
+        free_compression_info(c_info);
+    }
+}
+
+
+uint32_t latest_dictionary_id(struct trainer* t)
+{
+    pthread_mutex_lock(&t->lock);
+    uint32_t id = t->versions[t->n_versions - 1]->id;
+    pthread_mutex_unlock(&t->lock);
+
+    return id;
+}
+
+
+static uint64_t encoded_bits(const struct huffman_code* codes,
+    uint64_t* histogram)
+{
+    uint64_t n_bits = 0;
+
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        n_bits += histogram[i] * codes[i].length;
+    }
+
+    return n_bits;
+}
+
+
+// makes a new version the latest, retiring the oldest trained version when
+// there are already as many versions as are kept
+static void publish_dictionary(struct trainer* t,
+    struct compression_info* c_info)
+{
+    struct compression_info* retired = NULL;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->n_versions == N_DICTIONARIES)
+    {
+        retired = t->versions[1];
+        retired->retired = true;
+
+        memmove(&t->versions[1], &t->versions[2],
+                sizeof(*t->versions)*(N_DICTIONARIES - 2));
+        t->n_versions--;
+
+        // still in use, the last request using it frees it
+        if (retired->refcount > 0)
+        {
+            retired = NULL;
+        }
+    }
+
+    t->versions[t->n_versions] = c_info;
+    t->n_versions++;
+    t->next_id++;
+
+    pthread_mutex_unlock(&t->lock);
+
+    if (retired != NULL)
+    {
+        free_compression_info(retired);
+    }
+}
+
+
+// builds a code from the sampled bytes and publishes it if it beats the
+// latest version on them
+void train_dictionary(struct trainer* t)
+{
+    uint64_t histogram[N_SEGMENTS];
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->n_sampled < MIN_TRAINING_BYTES)
+    {
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+
+    memcpy(histogram, t->histogram, sizeof(histogram));
+
+    // older traffic counts for less and less
+    for (int i = 0; i < N_SEGMENTS; i++)
+    {
+        t->histogram[i] /= 2;
+    }
+
+    t->n_sampled /= 2;
+
+    struct compression_info* latest = t->versions[t->n_versions - 1];
+    uint64_t latest_bits = encoded_bits(latest->codes, histogram);
+    uint32_t id = t->next_id;
+
+    pthread_mutex_unlock(&t->lock);
+
+    struct huffman_code* codes = malloc(sizeof(*codes)*N_SEGMENTS);
+    build_length_limited_code(histogram, MAX_TRAINED_CODE_LENGTH, codes);
+
+    uint64_t trained_bits = encoded_bits(codes, histogram);
+
+    if (trained_bits * 1000 >
+        latest_bits * (1000 - MIN_IMPROVEMENT_PERMILLE))
+    {
+        free(codes);
+        return;
+    }
+
+    struct compression_info* c_info = compression_info_from_codes(codes, id);
+
+    if (c_info == NULL)
+    {
+        return;
+    }
+
+    publish_dictionary(t, c_info);
+
+    fprintf(stderr, "published dictionary %u, %" PRIu64 " bits for the "
+            "samples instead of %" PRIu64 "\n", id, trained_bits,
+            latest_bits);
+}
+
+
+// background thread training a dictionary every interval
+void* trainer_thread(void* args)
+{
+    struct trainer* t = args;
+
+    while (true)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        deadline.tv_sec += t->interval_ms / 1000;
+        deadline.tv_nsec += (t->interval_ms % 1000) * 1000000;
+
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&t->lock);
+
+        while (!t->stop && pthread_cond_timedwait(&t->stop_cond, &t->lock,
+                                &deadline) != ETIMEDOUT)
+        {
+        }
+
+        bool stop = t->stop;
+        pthread_mutex_unlock(&t->lock);
+
+        if (stop)
+        {
+            break;
+        }
+
+        train_dictionary(t);
+    }
+
+    return (void*) NULL;
+}
+
+
+// frees the trainer and every trained version, the version the server
+// started with is left to the server
+void free_trainer(struct trainer* t)
+{
+    if (t->interval_ms > 0)
+    {
+        pthread_mutex_lock(&t->lock);
+        t->stop = true;
+        pthread_cond_signal(&t->stop_cond);
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_join(t->thread, NULL);
+    }
+
+    for (size_t i = 1; i < t->n_versions; i++)
+    {
+        free_compression_info(t->versions[i]);
+    }
+
+    pthread_cond_destroy(&t->stop_cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
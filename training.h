@@ -0,0 +1,74 @@
+#ifndef TRAINING_H
+#define TRAINING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "compression.h"
+
+
+// how often a new dictionary is trained, 0 turns training off. It is off by
+// default, every payload served is sampled while it is on
+#define TRAINING_INTERVAL_MS (0)
+
+// bytes sampled out of each served payload
+#define SAMPLE_BYTES (1024)
+
+// sampled bytes needed before a dictionary is trained
+#define MIN_TRAINING_BYTES (64 * 1024)
+
+#define MAX_TRAINED_CODE_LENGTH (15)
+
+// a trained dictionary is only published if it needs this many thousandths
+// fewer bits for the sampled bytes than the latest one
+#define MIN_IMPROVEMENT_PERMILLE (20)
+
+// dictionary versions kept, including the one the server started with
+#define N_DICTIONARIES (8)
+
+
+struct trainer {
+    pthread_mutex_t lock;
+    pthread_cond_t stop_cond;
+    pthread_t thread;
+    bool stop;
+    uint64_t interval_ms;
+
+    // byte counts of the sampled payloads, halved after every training
+    uint64_t histogram[N_SEGMENTS];
+    uint64_t n_sampled;
+
+    // published versions from oldest to latest, the first is always the
+    // dictionary the server started with
+    struct compression_info* versions[N_DICTIONARIES];
+    size_t n_versions;
+    uint32_t next_id;
+};
+
+
+
+struct trainer* create_trainer(struct compression_info* base,
+    uint64_t interval_ms);
+
+void trainer_sample(struct trainer* t, uint8_t* data, uint64_t len);
+
+struct compression_info* acquire_dictionary(struct trainer* t, uint32_t id);
+
+void release_dictionary(struct trainer* t, struct compression_info* c_info);
+
+uint32_t latest_dictionary_id(struct trainer* t);
+
+void train_dictionary(struct trainer* t);
+
+void* trainer_thread(void* args);
+
+void free_trainer(struct trainer* t);
+
+#endif
@@ -0,0 +1,921 @@
+#include "upstream.h"
+
+// This file contains the caching proxy mode. A server given an upstream
+// server answers size queries, retrievals and directory listings for the
+// files its own target directories don't have by asking the upstream server
+// over the same protocol. What it says about a file and its listing are
+// kept in memory, the files fetched are written to the cache directory and
+// served from there like local ones, through the page cache. Everything is
+// trusted for ttl_ms before the upstream server is asked again, and a
+// cached file whose size or mtime have changed upstream is fetched again.
+// Workers missing on the same thing at once share one request upstream.
+//
+// A file is fetched whole before it is served, so the first retrieval of
+// one not cached yet waits for all of it however small its range is, and
+// the workers asking for it meanwhile wait on the same fetch. Every chunk
+// of it has to arrive within UPSTREAM_TIMEOUT_MS. The cache directory
+// holds up to max_cache_bytes, files larger than that aren't served.
+
+
+// the name, size and last time served of a file of the cache directory
+struct cached_file {
+    char file_name[MAX_FILE_NAME];
+    uint64_t size;
+    uint64_t atime_ns;
+};
+
+
+static int compare_cached_files(const void* a, const void* b)
+{
+    const struct cached_file* fa = a;
+    const struct cached_file* fb = b;
+
+    return (fa->atime_ns > fb->atime_ns) - (fa->atime_ns < fb->atime_ns);
+}
+
+
+// lists the files of the cache directory into files, if not NULL, and
+// returns the bytes they add up to. Files left over by fetches which never
+// finished are removed
+static uint64_t scan_cache(int dir_fd, struct cached_file** files,
+    size_t* n_files)
+{
+    size_t max_files = 64;
+    uint64_t bytes = 0;
+    struct stat st;
+    struct dirent* dent;
+
+    // closedir closes the descriptor it is given
+    DIR* dir = fdopendir(dup(dir_fd));
+
+    if (files != NULL)
+    {
+        *files = malloc(sizeof(**files)*max_files);
+        *n_files = 0;
+    }
+
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    // the copy shares its position with dir_fd, which an earlier scan left
+    // at the end
+    rewinddir(dir);
+
+    while ((dent = readdir(dir)) != NULL)
+    {
+        if (strncmp(dent->d_name, ".fetch.", 7) == 0 && files == NULL)
+        {
+            unlinkat(dir_fd, dent->d_name, 0);
+            continue;
+        }
+
+        if (dent->d_name[0] == '.' ||
+            strlen(dent->d_name) >= MAX_FILE_NAME ||
+            fstatat(dir_fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        bytes += st.st_size;
+
+        if (files == NULL)
+        {
+            continue;
+        }
+
+        if (*n_files == max_files)
+        {
+            max_files *= 2;
+            *files = realloc(*files, sizeof(**files)*max_files);
+        }
+
+        struct cached_file* f = &(*files)[(*n_files)++];
+        strcpy(f->file_name, dent->d_name);
+        f->size = st.st_size;
+        f->atime_ns = (uint64_t) st.st_atim.tv_sec * 1000000000 +
+                        st.st_atim.tv_nsec;
+    }
+
+    closedir(dir);
+
+    return bytes;
+}
+
+
+// parses an "ip:port" address, and opens the cache directory. Returns NULL
+// if either is unusable, in which case the server only serves its own files
+struct upstream* create_upstream(char* address, char* cache_dir,
+    uint64_t cache_bytes, uint64_t ttl_ms)
+{
+    char host[INET_ADDRSTRLEN];
+    struct sockaddr_in addr = {0};
+    char* colon = strrchr(address, ':');
+
+    if (colon == NULL || colon - address >= INET_ADDRSTRLEN)
+    {
+        fprintf(stderr, "bad upstream address: %s\n", address);
+        return NULL;
+    }
+
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(strtoul(colon + 1, NULL, 10));
+
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad upstream address: %s\n", address);
+        return NULL;
+    }
+
+    if (cache_dir == NULL)
+    {
+        fputs("an upstream server needs an upstream_cache_dir\n", stderr);
+        return NULL;
+    }
+
+    int dir_fd = open(cache_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+    {
+        fprintf(stderr, "couldn't open upstream cache directory %s: %s\n",
+                cache_dir, strerror(errno));
+        return NULL;
+    }
+
+    struct upstream* up = calloc(1, sizeof(*up));
+
+    up->addr = addr;
+    up->ttl_ms = ttl_ms;
+    up->cache_dir_fd = dir_fd;
+    up->cache_bytes = scan_cache(dir_fd, NULL, NULL);
+    up->max_cache_bytes = cache_bytes;
+    pthread_mutex_init(&up->cache_lock, NULL);
+    pthread_mutex_init(&up->lock, NULL);
+    pthread_cond_init(&up->done_cond, NULL);
+
+    // sessions of an earlier run may still be known upstream
+    atomic_init(&up->next_session, (uint32_t) time(NULL) ^
+                ((uint32_t) getpid() << 16));
+    atomic_init(&up->next_tmp, 0);
+
+    return up;
+}
+
+
+// whether a name can be kept in the cache directory as it is
+static bool cacheable_name(char* file_name)
+{
+    return file_name[0] != '\0' && file_name[0] != '.' &&
+        strchr(file_name, '/') == NULL &&
+        strlen(file_name) < MAX_FILE_NAME;
+}
+
+
+static struct upstream_entry* entry_slot(struct upstream* up,
+    char* file_name)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (char* p = file_name; *p != '\0'; p++)
+    {
+        hash = (hash ^ (uint8_t) *p) * 0x100000001b3ULL;
+    }
+
+    return &up->entries[hash % N_UPSTREAM_ENTRIES];
+}
+
+
+// joins the fetch of something from the upstream server, creating it if
+// nobody is fetching it and waiting for it otherwise. leader is set when
+// the caller created the fetch and has to complete it
+static struct upstream_fetch* join_fetch(struct upstream* up, uint8_t kind,
+    char* file_name, bool* leader)
+{
+    struct upstream_fetch* f;
+
+    pthread_mutex_lock(&up->lock);
+
+    for (f = up->fetches; f != NULL; f = f->next)
+    {
+        if (f->kind == kind && strcmp(f->file_name, file_name) == 0)
+        {
+            f->refcount++;
+            *leader = false;
+
+            while (!f->done)
+            {
+                pthread_cond_wait(&up->done_cond, &up->lock);
+            }
+
+            pthread_mutex_unlock(&up->lock);
+            return f;
+        }
+    }
+
+    f = calloc(1, sizeof(*f));
+    f->kind = kind;
+    strncpy(f->file_name, file_name, MAX_FILE_NAME - 1);
+    f->refcount = 1;
+
+    f->next = up->fetches;
+    up->fetches = f;
+    *leader = true;
+
+    pthread_mutex_unlock(&up->lock);
+
+    return f;
+}
+
+
+// publishes the result of a fetch to its waiters and takes it out of the
+// table, the next miss asks the upstream server again
+static void complete_fetch(struct upstream* up, struct upstream_fetch* f,
+    int result)
+{
+    pthread_mutex_lock(&up->lock);
+
+    struct upstream_fetch** cursor = &up->fetches;
+    while (*cursor != NULL && *cursor != f)
+    {
+        cursor = &(*cursor)->next;
+    }
+
+    if (*cursor != NULL)
+    {
+        *cursor = f->next;
+    }
+
+    f->next = NULL;
+    f->done = true;
+    f->result = result;
+
+    pthread_cond_broadcast(&up->done_cond);
+    pthread_mutex_unlock(&up->lock);
+}
+
+
+// drops a reference to a completed fetch, the last one frees it
+static void release_fetch(struct upstream* up, struct upstream_fetch* f)
+{
+    pthread_mutex_lock(&up->lock);
+    f->refcount--;
+    bool last = f->refcount == 0;
+    pthread_mutex_unlock(&up->lock);
+
+    if (last)
+    {
+        free(f);
+    }
+}
+
+
+// takes bytes for a file about to be fetched out of what the cache directory
+// may hold, removing the files served least recently until they fit.
+// Returns -1 if the file is larger than the whole cache
+static int reserve_cache(struct upstream* up, uint64_t bytes)
+{
+    if (bytes > up->max_cache_bytes)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&up->cache_lock);
+
+    if (up->cache_bytes + up->fetching_bytes + bytes > up->max_cache_bytes)
+    {
+        struct cached_file* files;
+        size_t n_files;
+
+        // counted again, files may have been removed behind the server's back
+        up->cache_bytes = scan_cache(up->cache_dir_fd, &files, &n_files);
+
+        qsort(files, n_files, sizeof(*files), compare_cached_files);
+
+        for (size_t i = 0; i < n_files && up->cache_bytes +
+            up->fetching_bytes + bytes > up->max_cache_bytes; i++)
+        {
+            if (unlinkat(up->cache_dir_fd, files[i].file_name, 0) == 0)
+            {
+                up->cache_bytes -= files[i].size;
+            }
+        }
+
+        free(files);
+    }
+
+    up->fetching_bytes += bytes;
+
+    pthread_mutex_unlock(&up->cache_lock);
+
+    return 0;
+}
+
+
+// ends a fetch which reserved bytes of the cache directory, moving its
+// temporary file into place under file_name if it completed
+static int finish_cache(struct upstream* up, char* tmp_name, char* file_name,
+    uint64_t bytes, bool completed)
+{
+    struct stat st;
+    int ret = -1;
+
+    pthread_mutex_lock(&up->cache_lock);
+
+    up->fetching_bytes -= bytes;
+
+    if (completed)
+    {
+        // the version it replaces, if any, leaves the cache
+        uint64_t old_bytes = fstatat(up->cache_dir_fd, file_name, &st,
+                                AT_SYMLINK_NOFOLLOW) == 0 &&
+                            S_ISREG(st.st_mode) ? st.st_size : 0;
+
+        if (renameat(up->cache_dir_fd, tmp_name, up->cache_dir_fd,
+                file_name) == 0)
+        {
+            up->cache_bytes += bytes;
+            up->cache_bytes -= old_bytes < up->cache_bytes ?
+                                old_bytes : up->cache_bytes;
+            ret = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&up->cache_lock);
+
+    return ret;
+}
+
+
+// removes a file from the cache directory
+static void uncache_file(struct upstream* up, char* file_name)
+{
+    struct stat st;
+
+    pthread_mutex_lock(&up->cache_lock);
+
+    if (fstatat(up->cache_dir_fd, file_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        unlinkat(up->cache_dir_fd, file_name, 0) == 0)
+    {
+        up->cache_bytes -= (uint64_t) st.st_size < up->cache_bytes ?
+                            (uint64_t) st.st_size : up->cache_bytes;
+    }
+
+    pthread_mutex_unlock(&up->cache_lock);
+}
+
+
+// opens a connection to the upstream server whose sends and receives give
+// up after UPSTREAM_TIMEOUT_MS, returns -1 if it can't be reached
+static int upstream_connect(struct upstream* up)
+{
+    struct timeval timeout;
+    timeout.tv_sec = UPSTREAM_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (UPSTREAM_TIMEOUT_MS % 1000) * 1000;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr*) &up->addr, sizeof(up->addr)) < 0)
+    {
+        perror("couldn't connect to the upstream server");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static int recv_all(int fd, uint8_t* buf, uint64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = recv(fd, buf, len, 0);
+
+        if (n <= 0)
+        {
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+// sends a request of the given type with two parts of payload, and reads
+// the header of its response. Returns the length of the response payload,
+// which is left in the socket, or -1 if the upstream server answered with
+// an error or anything but the expected response
+static int64_t upstream_call(int fd, uint8_t type, uint8_t* head,
+    uint64_t head_len, uint8_t* tail, uint64_t tail_len)
+{
+    uint8_t header[MSG_HEADER_SZ + PAYLOAD_LEN_SZ];
+    uint64_t be_len = htobe64(head_len + tail_len);
+    uint64_t payload_len;
+
+    header[0] = type << 4;
+    memcpy(header + 1, &be_len, PAYLOAD_LEN_SZ);
+
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = head;
+    iov[1].iov_len = head_len;
+    iov[2].iov_base = tail;
+    iov[2].iov_len = tail_len;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header) + head_len +
+            tail_len ||
+        recv_all(fd, header, sizeof(header)) < 0 ||
+        header[0] != (type + 1) << 4)
+    {
+        return -1;
+    }
+
+    memcpy(&payload_len, header + 1, PAYLOAD_LEN_SZ);
+
+    return be64toh(payload_len);
+}
+
+
+// asks the upstream server for the size and mtime of a file. Returns 0 if
+// it has the file, 1 if it doesn't, and -1 if it couldn't be asked
+static int fetch_stat(int fd, char* file_name, struct upstream_entry* entry)
+{
+    uint8_t stat_entry[FILE_STAT_ENTRY_SZ];
+    uint64_t be_file_size;
+    uint64_t be_mtime;
+
+    if (upstream_call(fd, FILE_STAT_BATCH_REQUEST, (uint8_t*) file_name,
+            strlen(file_name) + 1, NULL, 0) != FILE_STAT_ENTRY_SZ ||
+        recv_all(fd, stat_entry, FILE_STAT_ENTRY_SZ) < 0)
+    {
+        return -1;
+    }
+
+    memcpy(&be_file_size, stat_entry + 1, 8);
+    memcpy(&be_mtime, stat_entry + 9, 8);
+
+    strncpy(entry->file_name, file_name, MAX_FILE_NAME - 1);
+    entry->missing = stat_entry[0] != FILE_STAT_OK;
+    entry->file_size = be64toh(be_file_size);
+    entry->mtime_ns = be64toh(be_mtime);
+    entry->checked_ms = now_ms();
+
+    return entry->missing ? 1 : 0;
+}
+
+
+// what the upstream server says about a file, from memory while it is
+// fresh. Returns 0 if it has the file and -1 if it doesn't or can't be asked
+static int lookup_entry(struct upstream* up, char* file_name,
+    struct upstream_entry* entry)
+{
+    pthread_mutex_lock(&up->lock);
+
+    struct upstream_entry* slot = entry_slot(up, file_name);
+
+    if (slot->in_use && strcmp(slot->file_name, file_name) == 0 &&
+        now_ms() - slot->checked_ms < up->ttl_ms)
+    {
+        *entry = *slot;
+        pthread_mutex_unlock(&up->lock);
+
+        return entry->missing ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&up->lock);
+
+    bool leader;
+    struct upstream_fetch* f = join_fetch(up, UPSTREAM_FETCH_STAT,
+                                        file_name, &leader);
+
+    if (leader)
+    {
+        int fd = upstream_connect(up);
+        int result = fd >= 0 ? fetch_stat(fd, file_name, &f->entry) : -1;
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        // a copy of a file gone upstream is never served again
+        if (result == 1)
+        {
+            uncache_file(up, file_name);
+        }
+
+        // an upstream server which can't be reached isn't remembered
+        if (result >= 0)
+        {
+            pthread_mutex_lock(&up->lock);
+            *slot = f->entry;
+            slot->in_use = true;
+            pthread_mutex_unlock(&up->lock);
+        }
+
+        complete_fetch(up, f, result);
+    }
+
+    int result = f->result;
+    *entry = f->entry;
+    release_fetch(up, f);
+
+    return result == 0 ? 0 : -1;
+}
+
+
+// fills in the size and mtime of a file the upstream server has, for a
+// size query. Returns -1 if it doesn't have it
+int upstream_stat(struct upstream* up, char* file_name, struct stat* st)
+{
+    struct upstream_entry entry;
+
+    if (!cacheable_name(file_name) ||
+        lookup_entry(up, file_name, &entry) < 0)
+    {
+        return -1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0444;
+    st->st_size = entry.file_size;
+    st->st_mtim.tv_sec = entry.mtime_ns / 1000000000;
+    st->st_mtim.tv_nsec = entry.mtime_ns % 1000000000;
+
+    return 0;
+}
+
+
+// opens the cached copy of a file if it is the version the upstream server
+// has, returns -1 if there is none or it is out of date
+static int open_cached(struct upstream* up, char* file_name,
+    struct upstream_entry* entry, struct stat* st)
+{
+    int fd = openat(up->cache_dir_fd, file_name, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, st) == 0 && S_ISREG(st->st_mode) &&
+        st->st_size == entry->file_size &&
+        (uint64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec ==
+        entry->mtime_ns)
+    {
+        // the access time orders the files to be removed when the cache is
+        // full, it is moved on once per ttl to spare the writes
+        uint64_t atime_ms = (uint64_t) st->st_atim.tv_sec * 1000 +
+                            st->st_atim.tv_nsec / 1000000;
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_NOW;
+        times[1].tv_sec = 0;
+        times[1].tv_nsec = UTIME_OMIT;
+
+        if ((uint64_t) time(NULL) * 1000 - atime_ms >= up->ttl_ms)
+        {
+            futimens(fd, times);
+        }
+
+        return fd;
+    }
+
+    close(fd);
+    return -1;
+}
+
+
+// retrieves a file from the upstream server a chunk at a time into out_fd,
+// and checks that it hasn't changed meanwhile
+static int retrieve_file(struct upstream* up, int fd, int out_fd,
+    char* file_name, struct upstream_entry* entry)
+{
+    uint8_t file_header[4 + 8 + 8];
+    uint8_t* chunk = alloc_buffer(UPSTREAM_CHUNK_SZ);
+    uint64_t offset = 0;
+    int ret = 0;
+
+    // a session of its own, servers of earlier versions turn away a range
+    // they have already sent for a session
+    uint32_t session_id = atomic_fetch_add(&up->next_session, 1);
+
+    while (ret == 0 && offset < entry->file_size)
+    {
+        uint64_t n_bytes = entry->file_size - offset;
+        n_bytes = n_bytes < UPSTREAM_CHUNK_SZ ? n_bytes : UPSTREAM_CHUNK_SZ;
+
+        uint64_t be_offset = htobe64(offset);
+        uint64_t be_n_bytes = htobe64(n_bytes);
+
+        memcpy(file_header, &session_id, 4);
+        memcpy(file_header + 4, &be_offset, 8);
+        memcpy(file_header + 12, &be_n_bytes, 8);
+
+        if (upstream_call(fd, FILE_RETRIEVE_REQUEST, file_header,
+                sizeof(file_header), (uint8_t*) file_name,
+                strlen(file_name)) != sizeof(file_header) + n_bytes ||
+            recv_all(fd, file_header, sizeof(file_header)) < 0 ||
+            recv_all(fd, chunk, n_bytes) < 0 ||
+            pwrite(out_fd, chunk, n_bytes, offset) != n_bytes)
+        {
+            ret = -1;
+        }
+
+        offset += n_bytes;
+    }
+
+    free_buffer(chunk);
+
+    struct upstream_entry after;
+
+    if (ret < 0 || fetch_stat(fd, file_name, &after) != 0 ||
+        after.file_size != entry->file_size ||
+        after.mtime_ns != entry->mtime_ns)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// fetches a file into a temporary file of the cache directory, and renames
+// it into place with the upstream mtime once it has all arrived
+static int fetch_file(struct upstream* up, char* file_name,
+    struct upstream_entry* entry)
+{
+    char tmp_name[64];
+    int ret = -1;
+
+    if (reserve_cache(up, entry->file_size) < 0)
+    {
+        fprintf(stderr, "%s is too large for the upstream cache\n",
+                file_name);
+        return -1;
+    }
+
+    snprintf(tmp_name, sizeof(tmp_name), ".fetch.%d.%lu", getpid(),
+            (unsigned long) atomic_fetch_add(&up->next_tmp, 1));
+
+    int out_fd = openat(up->cache_dir_fd, tmp_name,
+                    O_WRONLY | O_CREAT | O_EXCL, 0644);
+    int fd = out_fd >= 0 ? upstream_connect(up) : -1;
+    bool completed = false;
+
+    if (fd >= 0 && retrieve_file(up, fd, out_fd, file_name, entry) == 0)
+    {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_NOW;
+        times[1].tv_sec = entry->mtime_ns / 1000000000;
+        times[1].tv_nsec = entry->mtime_ns % 1000000000;
+
+        completed = futimens(out_fd, times) == 0;
+    }
+
+    ret = finish_cache(up, tmp_name, file_name, entry->file_size, completed);
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (out_fd >= 0)
+    {
+        close(out_fd);
+    }
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "couldn't fetch %s from the upstream server\n",
+                file_name);
+
+        if (out_fd >= 0)
+        {
+            unlinkat(up->cache_dir_fd, tmp_name, 0);
+        }
+    }
+
+    return ret;
+}
+
+
+// opens a file the upstream server has for a retrieval, fetching it into
+// the cache directory unless the copy there is current. Returns -1 if the
+// upstream server doesn't have it or it couldn't be fetched
+int upstream_open_file(struct upstream* up, char* file_name,
+    struct stat* st)
+{
+    struct upstream_entry entry;
+
+    if (!cacheable_name(file_name) ||
+        lookup_entry(up, file_name, &entry) < 0)
+    {
+        return -1;
+    }
+
+    int fd = open_cached(up, file_name, &entry, st);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+
+    bool leader;
+    struct upstream_fetch* f = join_fetch(up, UPSTREAM_FETCH_FILE,
+                                        file_name, &leader);
+
+    if (leader)
+    {
+        complete_fetch(up, f, fetch_file(up, file_name, &entry));
+    }
+
+    release_fetch(up, f);
+
+    return open_cached(up, file_name, &entry, st);
+}
+
+
+// asks the upstream server for its directory listing and keeps it. The
+// memory it takes is reserved for the request which asked for it, a listing
+// longer than UPSTREAM_MAX_LISTING_SZ isn't taken
+static int fetch_listing(struct upstream* up, struct server_info* s_info,
+    struct request* request)
+{
+    int fd = upstream_connect(up);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int64_t listing_len = upstream_call(fd, DIR_LIST_REQUEST, NULL, 0,
+                                    NULL, 0);
+    uint8_t* listing = NULL;
+
+    if (listing_len > UPSTREAM_MAX_LISTING_SZ)
+    {
+        fprintf(stderr, "the upstream server's listing is too long: %ld\n",
+                (long) listing_len);
+    }
+    else if (listing_len >= 0 &&
+        reserve_request_memory(s_info, request, listing_len + 1))
+    {
+        listing = malloc(sizeof(*listing)*(listing_len + 1));
+
+        if (recv_all(fd, listing, listing_len) < 0)
+        {
+            free(listing);
+            listing = NULL;
+        }
+    }
+
+    close(fd);
+
+    if (listing == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&up->lock);
+
+    free(up->listing);
+    up->listing = listing;
+    up->listing_len = listing_len;
+    up->listing_ms = now_ms();
+
+    pthread_mutex_unlock(&up->lock);
+
+    return 0;
+}
+
+
+// adds the files of the upstream server's listing to a directory listing,
+// leaving out the ones a target directory has too. An upstream server which
+// can't be reached adds whatever it listed last. Returns -1 if the memory
+// the merge takes can't be reserved for the request
+int upstream_merge_listing(struct upstream* up, struct server_info* s_info,
+    struct request* request, uint8_t** files, uint64_t* files_len)
+{
+    struct volume_set* vs = s_info->volumes;
+
+    pthread_mutex_lock(&up->lock);
+    bool fresh = up->listing != NULL &&
+                now_ms() - up->listing_ms < up->ttl_ms;
+    pthread_mutex_unlock(&up->lock);
+
+    if (!fresh)
+    {
+        bool leader;
+        struct upstream_fetch* f = join_fetch(up, UPSTREAM_FETCH_LIST, "",
+                                            &leader);
+
+        if (leader)
+        {
+            complete_fetch(up, f, fetch_listing(up, s_info, request));
+        }
+
+        release_fetch(up, f);
+    }
+
+    pthread_mutex_lock(&up->lock);
+
+    if (up->listing == NULL)
+    {
+        pthread_mutex_unlock(&up->lock);
+        return 0;
+    }
+
+    uint64_t listing_len = up->listing_len;
+
+    pthread_mutex_unlock(&up->lock);
+
+    // a copy of the listing, and as much again for the names it adds
+    if (!reserve_request_memory(s_info, request, 2 * (listing_len + 1)))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&up->lock);
+
+    // it may have been fetched again meanwhile
+    listing_len = listing_len < up->listing_len ? listing_len :
+                    up->listing_len;
+    uint8_t* listing = malloc(sizeof(*listing)*(listing_len + 1));
+    memcpy(listing, up->listing, listing_len);
+
+    pthread_mutex_unlock(&up->lock);
+
+    // a lone null byte stands for an empty listing
+    if (*files_len == 1 && (*files)[0] == NULL_BYTE)
+    {
+        *files_len = 0;
+    }
+
+    *files = realloc_buffer(*files, *files_len + listing_len + 1);
+    listing[listing_len] = NULL_BYTE;
+
+    struct stat st;
+    uint64_t pos = 0;
+
+    while (pos < listing_len)
+    {
+        char* name = (char*) listing + pos;
+        size_t name_len = strlen(name);
+
+        pos += name_len + 1;
+
+        if (name_len == 0 || find_volume_file(vs, name, &st) >= 0)
+        {
+            continue;
+        }
+
+        memcpy(*files + *files_len, name, name_len + 1);
+        *files_len += name_len + 1;
+    }
+
+    if (*files_len == 0)
+    {
+        (*files)[0] = NULL_BYTE;
+        *files_len = 1;
+    }
+
+    free(listing);
+
+    return 0;
+}
+
+
+void free_upstream(struct upstream* up)
+{
+    if (up == NULL)
+    {
+        return;
+    }
+
+    close(up->cache_dir_fd);
+    free(up->listing);
+    pthread_mutex_destroy(&up->cache_lock);
+    pthread_cond_destroy(&up->done_cond);
+    pthread_mutex_destroy(&up->lock);
+    free(up);
+}
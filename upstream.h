@@ -0,0 +1,110 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "server.h"
+#include "requests.h"
+
+
+// how long the sizes, listing and cached files fetched from the upstream
+// server are trusted before it is asked again
+#define UPSTREAM_TTL_MS (30 * 1000)
+
+// how long a request to the upstream server may take
+#define UPSTREAM_TIMEOUT_MS (10 * 1000)
+
+// bytes of a file asked for per retrieval when it is fetched
+#define UPSTREAM_CHUNK_SZ (1024 * 1024)
+
+// the longest directory listing taken from the upstream server
+#define UPSTREAM_MAX_LISTING_SZ (64 * 1024 * 1024)
+
+// bytes the files kept in the cache directory may add up to, the ones
+// served least recently are removed to make room for new ones
+#define UPSTREAM_CACHE_BYTES (4ULL * 1024 * 1024 * 1024)
+
+#define N_UPSTREAM_ENTRIES (1024)
+
+#define UPSTREAM_FETCH_STAT (0)
+#define UPSTREAM_FETCH_FILE (1)
+#define UPSTREAM_FETCH_LIST (2)
+
+
+// what the upstream server last said about a file
+struct upstream_entry {
+    bool in_use;
+    char file_name[MAX_FILE_NAME];
+    bool missing;
+    uint64_t file_size;
+    uint64_t mtime_ns;
+    uint64_t checked_ms;
+};
+
+// a request to the upstream server shared by every worker which needs its
+// result while it is in progress
+struct upstream_fetch {
+    uint8_t kind;
+    char file_name[MAX_FILE_NAME];
+
+    int refcount;
+    bool done;
+    int result;
+    struct upstream_entry entry;
+
+    struct upstream_fetch* next;
+};
+
+struct upstream {
+    struct sockaddr_in addr;
+    uint64_t ttl_ms;
+
+    // directory the files fetched are kept in, under their own names, the
+    // bytes they add up to, and those of the fetches in progress
+    int cache_dir_fd;
+    pthread_mutex_t cache_lock;
+    uint64_t cache_bytes;
+    uint64_t fetching_bytes;
+    uint64_t max_cache_bytes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    struct upstream_fetch* fetches;
+    struct upstream_entry entries[N_UPSTREAM_ENTRIES];
+
+    // the upstream server's directory listing, NULL until it is fetched
+    uint8_t* listing;
+    uint64_t listing_len;
+    uint64_t listing_ms;
+
+    // session ids of the retrievals, and names of the partly fetched files
+    atomic_uint_fast32_t next_session;
+    atomic_uint_fast64_t next_tmp;
+};
+
+
+
+struct upstream* create_upstream(char* address, char* cache_dir,
+    uint64_t cache_bytes, uint64_t ttl_ms);
+
+int upstream_stat(struct upstream* up, char* file_name, struct stat* st);
+
+int upstream_open_file(struct upstream* up, char* file_name,
+    struct stat* st);
+
+int upstream_merge_listing(struct upstream* up, struct server_info* s_info,
+    struct request* request, uint8_t** files, uint64_t* files_len);
+
+void free_upstream(struct upstream* up);
+
+#endif
@@ -0,0 +1,487 @@
+#include "volume.h"
+
+// This file contains the namespace of target directories and the I/O queues
+// of their devices. Directories on the same device share a queue, and file
+// reads of the workers are handed to the threads of the file's device. A
+// queue only takes so many reads, past that a read fails straight away
+// instead of adding another worker to the ones already waiting on a
+// saturated disk.
+
+
+static struct io_queue* create_io_queue(dev_t dev, size_t max_jobs)
+{
+    struct io_queue* q = calloc(1, sizeof(*q));
+
+    q->dev = dev;
+    q->max_jobs = max_jobs;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->job_cond, NULL);
+    pthread_cond_init(&q->done_cond, NULL);
+
+    for (int i = 0; i < IO_THREADS_PER_DEVICE; i++)
+    {
+        pthread_create(&q->threads[i], NULL, io_thread, (void*) q);
+    }
+
+    return q;
+}
+
+
+static void free_io_queue(struct io_queue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->job_cond);
+    pthread_mutex_unlock(&q->lock);
+
+    for (int i = 0; i < IO_THREADS_PER_DEVICE; i++)
+    {
+        pthread_join(q->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&q->done_cond);
+    pthread_cond_destroy(&q->job_cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+
+// opens the target directories and starts the threads of every device
+// they are on. Directories which can't be opened are left out
+struct volume_set* create_volume_set(char** dirs, size_t n_dirs,
+    size_t queue_depth, size_t n_workers)
+{
+    struct volume_set* vs = calloc(1, sizeof(*vs));
+
+    for (size_t i = 0; i < n_dirs && vs->n_volumes < MAX_VOLUMES; i++)
+    {
+        struct stat st;
+        int dir_fd = open(dirs[i], O_RDONLY | O_DIRECTORY);
+
+        if (dir_fd < 0 || fstat(dir_fd, &st) < 0)
+        {
+            fprintf(stderr, "couldn't open target directory %s: %s\n",
+                    dirs[i], strerror(errno));
+
+            if (dir_fd >= 0)
+            {
+                close(dir_fd);
+            }
+
+            continue;
+        }
+
+        struct volume* v = &vs->volumes[vs->n_volumes];
+        v->path = strdup(dirs[i]);
+        v->dir_fd = dir_fd;
+        v->dev = st.st_dev;
+        vs->n_volumes++;
+
+        bool has_queue = false;
+
+        for (size_t j = 0; j < vs->n_queues; j++)
+        {
+            if (vs->queues[j]->dev == st.st_dev)
+            {
+                has_queue = true;
+            }
+        }
+
+        if (!has_queue)
+        {
+            vs->queues[vs->n_queues] = create_io_queue(st.st_dev,
+                                                    queue_depth);
+            vs->n_queues++;
+        }
+    }
+
+    if (queue_depth == 0)
+    {
+        // there is nothing to keep a single device from, with more devices
+        // a saturated one can only hold up half of the workers
+        queue_depth = SIZE_MAX;
+
+        if (vs->n_queues > 1)
+        {
+            queue_depth = n_workers / 2 > 0 ? n_workers / 2 : 1;
+        }
+
+        // no reads can have been queued yet
+        for (size_t i = 0; i < vs->n_queues; i++)
+        {
+            vs->queues[i]->max_jobs = queue_depth;
+        }
+    }
+
+    return vs;
+}
+
+
+// looks up a regular file in the namespace. Returns the index of the
+// directory serving it, or -1 if no directory has it
+int find_volume_file(struct volume_set* vs, char* file_name,
+    struct stat* st)
+{
+    for (size_t i = 0; i < vs->n_volumes; i++)
+    {
+        if (fstatat(vs->volumes[i].dir_fd, file_name, st, 0) == 0 &&
+            S_ISREG(st->st_mode))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+// opens a file of the namespace for reading, returns -1 if there isn't one
+int open_volume_file(struct volume_set* vs, char* file_name,
+    struct stat* st)
+{
+    for (size_t i = 0; i < vs->n_volumes; i++)
+    {
+        int fd = openat(vs->volumes[i].dir_fd, file_name, O_RDONLY);
+
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        if (fstat(fd, st) == 0 && S_ISREG(st->st_mode))
+        {
+            return fd;
+        }
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+
+// whether an entry of a directory is a regular file served from it, and not
+// shadowed by a file of the same name in an earlier directory
+static bool is_listed(struct volume_set* vs, size_t v,
+    struct linux_dirent64* entry)
+{
+    struct stat st;
+
+    if (entry->d_type == DT_UNKNOWN)
+    {
+        if (fstatat(vs->volumes[v].dir_fd, entry->d_name, &st, 0) < 0 ||
+            !S_ISREG(st.st_mode))
+        {
+            return false;
+        }
+    }
+    else if (entry->d_type != DT_REG)
+    {
+        return false;
+    }
+
+    return v == 0 || find_volume_file(vs, entry->d_name, &st) == (int) v;
+}
+
+
+// reads file names of the namespace from the cursor on, separated by null
+// bytes, until the next one wouldn't fit in cap bytes. The entries are read
+// in large getdents64 batches straight from the directories. Returns 1 once
+// the whole namespace has been listed, 0 if there are names left and -1 if
+// a directory couldn't be read
+int list_volume_files(struct volume_set* vs, struct list_cursor* cursor,
+    uint8_t* names, size_t cap, size_t* names_len)
+{
+    uint8_t* buf = malloc(sizeof(*buf)*GETDENTS_BUF_SZ);
+    int ret = 1;
+
+    *names_len = 0;
+
+    while (cursor->volume < vs->n_volumes)
+    {
+        // a descriptor of its own, the offset of the cached one is shared
+        int fd = openat(vs->volumes[cursor->volume].dir_fd, ".", 
+                        O_RDONLY | O_DIRECTORY);
+
+        if (fd < 0 || lseek(fd, cursor->position, SEEK_SET) < 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            ret = -1;
+            break;
+        }
+
+        bool full = false;
+
+        while (!full)
+        {
+            long n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SZ);
+
+            if (n < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            // end of this directory
+            if (n == 0)
+            {
+                cursor->volume++;
+                cursor->position = 0;
+                break;
+            }
+
+            for (long pos = 0; pos < n;)
+            {
+                struct linux_dirent64* entry = 
+                    (struct linux_dirent64*) (buf + pos);
+                size_t name_len = strlen(entry->d_name);
+
+                if (is_listed(vs, cursor->volume, entry))
+                {
+                    if (*names_len + name_len + 1 > cap)
+                    {
+                        full = true;
+                        break;
+                    }
+
+                    memcpy(names + *names_len, entry->d_name, name_len + 1);
+                    *names_len += name_len + 1;
+                }
+
+                cursor->position = entry->d_off;
+                pos += entry->d_reclen;
+            }
+        }
+
+        close(fd);
+
+        if (full)
+        {
+            ret = 0;
+            break;
+        }
+
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+
+static ssize_t read_range(int fd, uint8_t* buf, size_t len, off_t offset)
+{
+    size_t n_read = 0;
+
+    while (n_read < len)
+    {
+        ssize_t ret = pread(fd, buf + n_read, len - n_read, offset + n_read);
+
+        if (ret < 0)
+        {
+            return -1;
+        }
+
+        if (ret == 0)
+        {
+            break;
+        }
+
+        n_read += ret;
+    }
+
+    return n_read;
+}
+
+
+// the queue of a device, NULL for a device outside the namespace, e.g.
+// behind a mount point
+static struct io_queue* find_io_queue(struct volume_set* vs, dev_t dev)
+{
+    for (size_t i = 0; i < vs->n_queues; i++)
+    {
+        if (vs->queues[i]->dev == dev)
+        {
+            return vs->queues[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+// reads a range of a file on the queue of its device and waits for it.
+// Returns the number of bytes read, which is only short at the end of the
+// file, or -1 with errno EAGAIN if the device already has as many reads as
+// it may queue
+ssize_t volume_pread(struct volume_set* vs, int fd, dev_t dev, void* buf,
+    size_t len, off_t offset)
+{
+    struct io_queue* q = find_io_queue(vs, dev);
+
+    if (q == NULL)
+    {
+        return read_range(fd, buf, len, offset);
+    }
+
+    struct io_job job = {0};
+    job.fd = fd;
+    job.buf = buf;
+    job.len = len;
+    job.offset = offset;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->n_jobs >= q->max_jobs)
+    {
+        pthread_mutex_unlock(&q->lock);
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (q->tail == NULL)
+    {
+        q->head = &job;
+    }
+    else
+    {
+        q->tail->next = &job;
+    }
+
+    q->tail = &job;
+    q->n_jobs++;
+    pthread_cond_signal(&q->job_cond);
+
+    while (!job.done)
+    {
+        pthread_cond_wait(&q->done_cond, &q->lock);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (job.result < 0)
+    {
+        errno = job.error;
+    }
+
+    return job.result;
+}
+
+
+// counts a read the caller does itself, such as a sendfile to a socket,
+// against the queue of its device until volume_io_end. Returns -1 with errno
+// EAGAIN if the device already has as many reads as it may queue
+int volume_io_begin(struct volume_set* vs, dev_t dev)
+{
+    struct io_queue* q = find_io_queue(vs, dev);
+
+    if (q == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->n_jobs >= q->max_jobs)
+    {
+        pthread_mutex_unlock(&q->lock);
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    q->n_jobs++;
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+
+void volume_io_end(struct volume_set* vs, dev_t dev)
+{
+    struct io_queue* q = find_io_queue(vs, dev);
+
+    if (q == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->n_jobs--;
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+// one of the threads doing the reads of a device
+void* io_thread(void* args)
+{
+    struct io_queue* q = args;
+
+    while (true)
+    {
+        pthread_mutex_lock(&q->lock);
+
+        while (!q->stop && q->head == NULL)
+        {
+            pthread_cond_wait(&q->job_cond, &q->lock);
+        }
+
+        if (q->head == NULL)
+        {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+
+        struct io_job* job = q->head;
+        q->head = job->next;
+
+        if (q->head == NULL)
+        {
+            q->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+
+        ssize_t result = read_range(job->fd, job->buf, job->len,
+                                    job->offset);
+        int error = errno;
+
+        pthread_mutex_lock(&q->lock);
+
+        job->result = result;
+        job->error = error;
+        job->done = true;
+        q->n_jobs--;
+        pthread_cond_broadcast(&q->done_cond);
+
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return (void*) NULL;
+}
+
+
+void free_volume_set(struct volume_set* vs)
+{
+    for (size_t i = 0; i < vs->n_queues; i++)
+    {
+        free_io_queue(vs->queues[i]);
+    }
+
+    for (size_t i = 0; i < vs->n_volumes; i++)
+    {
+        free(vs->volumes[i].path);
+        close(vs->volumes[i].dir_fd);
+    }
+
+    free(vs);
+}
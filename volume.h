@@ -0,0 +1,123 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+// directories the served namespace can span
+#define MAX_VOLUMES (32)
+
+// reads in progress at once on a device
+#define IO_THREADS_PER_DEVICE (4)
+
+// reads queued or in progress on a device before more are turned away, 0
+// picks a default from the number of workers and devices: no limit for a
+// single device, half the workers each for several
+#define IO_QUEUE_DEPTH (0)
+
+// directory entries are read this many bytes at a time
+#define GETDENTS_BUF_SZ (256 * 1024)
+
+
+// a read of a file range, done by one of the threads of its device
+struct io_job {
+    int fd;
+    uint8_t* buf;
+    size_t len;
+    off_t offset;
+
+    ssize_t result;
+    int error;
+    bool done;
+    struct io_job* next;
+};
+
+// the reads of one device. Every device has its own threads, so a slow
+// device only holds up the reads queued on it
+struct io_queue {
+    dev_t dev;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    struct io_job* head;
+    struct io_job* tail;
+
+    // queued and in progress
+    size_t n_jobs;
+    size_t max_jobs;
+    bool stop;
+
+    pthread_t threads[IO_THREADS_PER_DEVICE];
+};
+
+// the entry layout filled in by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// a position in the listing of the namespace: the directory and the
+// getdents64 offset of the next entry within it
+struct list_cursor {
+    uint16_t volume;
+    uint64_t position;
+};
+
+struct volume {
+    char* path;
+    int dir_fd;
+    dev_t dev;
+};
+
+// the target directories served as one namespace. A name is looked up in
+// the directories in the order they were given, the first one holding a
+// regular file of that name serves it
+struct volume_set {
+    struct volume volumes[MAX_VOLUMES];
+    size_t n_volumes;
+
+    struct io_queue* queues[MAX_VOLUMES];
+    size_t n_queues;
+};
+
+
+
+struct volume_set* create_volume_set(char** dirs, size_t n_dirs,
+    size_t queue_depth, size_t n_workers);
+
+int find_volume_file(struct volume_set* vs, char* file_name,
+    struct stat* st);
+
+int open_volume_file(struct volume_set* vs, char* file_name,
+    struct stat* st);
+
+int list_volume_files(struct volume_set* vs, struct list_cursor* cursor,
+    uint8_t* names, size_t cap, size_t* names_len);
+
+ssize_t volume_pread(struct volume_set* vs, int fd, dev_t dev, void* buf,
+    size_t len, off_t offset);
+
+int volume_io_begin(struct volume_set* vs, dev_t dev);
+
+void volume_io_end(struct volume_set* vs, dev_t dev);
+
+void* io_thread(void* args);
+
+void free_volume_set(struct volume_set* vs);
+
+#endif